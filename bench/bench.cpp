@@ -0,0 +1,587 @@
+/**
+ * Host benchmarks for the firmware hot paths. main.cpp is compiled unchanged against
+ * the shims in bench/shim, and the modem is replaced by recorded transcripts (see
+ * transcripts/sample.txt for the format).
+ *
+ *   bench [--baseline FILE] [--update] [--threshold PCT] [--filter NAME] TRANSCRIPT...
+ *
+ * Each benchmark runs its operation once per matching transcript block and reports
+ * ns/op (best of BENCH_SAMPLES), allocations/op and the peak heap growth of a pass.
+ * With --baseline the results are compared against FILE and the run fails when a
+ * metric is more than --threshold percent worse, or when FILE has no entry for a
+ * benchmark, so a missing baseline cannot pass unnoticed; --update rewrites FILE
+ * instead. Allocation counts depend on the ArduinoJson release and times on the
+ * machine, so FILE names both; --update needs a build against ArduinoJson itself,
+ * and a FILE recorded with another release fails the run. A time over the
+ * threshold is measured up to BENCH_RETRIES more times, BENCH_RETRY_PAUSE_MS
+ * apart, and the best counts, so a burst of load on a shared machine does not fail
+ * the build.
+ *
+ * Before timing, every "burst" block is fed to the receive path to check that no
+ * message of a multi-message read is lost and that its alerts come before its
+ * commands; either failure fails the run.
+ */
+#include "firmware.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sys/utsname.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_SAMPLES 7
+#define BENCH_SAMPLE_NS 20000000ULL
+#define BENCH_DEFAULT_THRESHOLD 15.0
+#define BENCH_RETRIES 3 // measurements again of a time over the threshold before it fails
+#define BENCH_RETRY_PAUSE_MS 500
+
+/**
+ * Heap use since start-up. Every allocation carries its size in a 16-byte header
+ * so the live byte count can be tracked on free.
+ */
+struct AllocStats
+{
+  size_t count;
+  size_t live;
+  size_t peak;
+};
+
+static AllocStats allocStats;
+
+void *operator new(size_t size)
+{
+  size_t *block = (size_t *)malloc(size + 16);
+  if (!block)
+    throw std::bad_alloc();
+  block[0] = size;
+  allocStats.count++;
+  allocStats.live += size;
+  if (allocStats.live > allocStats.peak)
+    allocStats.peak = allocStats.live;
+  return (char *)block + 16;
+}
+
+void operator delete(void *ptr) noexcept
+{
+  if (!ptr)
+    return;
+  size_t *block = (size_t *)((char *)ptr - 16);
+  allocStats.live -= block[0];
+  free(block);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+void operator delete(void *ptr, size_t) noexcept { operator delete(ptr); }
+void operator delete[](void *ptr, size_t) noexcept { operator delete(ptr); }
+
+/**
+ * A block of unsolicited modem output from a transcript. For GGA blocks the raw
+ * latitude and longitude fields are split out beforehand.
+ */
+struct UrcBlock
+{
+  std::string kind;
+  std::string raw;
+  String text;
+  String lat;
+  String lon;
+};
+
+struct Benchmark
+{
+  const char *name;
+  const char *kind; // transcript blocks the operation runs on, nullptr for all
+  void (*op)(const UrcBlock &block);
+};
+
+struct Result
+{
+  double nsPerOp;
+  double allocsPerOp;
+  double peakBytes;
+};
+
+static std::vector<UrcBlock> blocks;
+static std::vector<std::pair<std::string, std::string>> replies;
+static const std::string defaultReply = "OK\r\n";
+static volatile long sink;
+
+/**
+ * Answers a line written to the modem UART from the transcript's @reply rules.
+ */
+static const std::string *modemReply(const std::string &line)
+{
+  for (const auto &reply : replies)
+  {
+    if (line.compare(0, reply.first.size(), reply.first) == 0)
+      return &reply.second;
+  }
+  return &defaultReply;
+}
+
+/**
+ * Returns the n-th comma-separated field of the NMEA sentence in `raw`.
+ */
+static std::string nmeaField(const std::string &raw, int field)
+{
+  size_t at = raw.find('$');
+  for (int i = 0; i < field && at != std::string::npos; i++)
+    at = raw.find(',', at + 1);
+  if (at == std::string::npos)
+    return "";
+  size_t end = raw.find(',', at + 1);
+  return raw.substr(at + 1, end == std::string::npos ? std::string::npos : end - at - 1);
+}
+
+static bool loadTranscript(const char *path)
+{
+  std::ifstream in(path);
+  if (!in)
+  {
+    fprintf(stderr, "cannot open %s\n", path);
+    return false;
+  }
+  std::string *target = nullptr;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.empty() && !target)
+      continue;
+    if (line[0] == '#')
+      continue;
+    if (line.compare(0, 7, "@reply ") == 0)
+    {
+      replies.push_back({line.substr(7), ""});
+      target = &replies.back().second;
+    }
+    else if (line.compare(0, 5, "@urc ") == 0)
+    {
+      blocks.push_back({line.substr(5), "", "", "", ""});
+      target = &blocks.back().raw;
+    }
+    else if (target)
+    {
+      if (!line.empty() && line.back() == '\\')
+        target->append(line, 0, line.size() - 1);
+      else
+        target->append(line + "\r\n");
+    }
+  }
+  for (UrcBlock &block : blocks)
+  {
+    block.text = block.raw;
+    if (block.kind == "gga")
+    {
+      block.lat = nmeaField(block.raw, 2);
+      block.lon = nmeaField(block.raw, 4);
+    }
+  }
+  return true;
+}
+
+/**
+ * Puts the firmware back into the idle receive state after an operation, so
+ * repeated alerts are not dropped as duplicates.
+ */
+static void resetFirmware()
+{
+  mainFlag = 0;
+  alertOutput = OUTPUT_NONE;
+  statusPending = false;
+  memset(seenAlerts, 0, sizeof(seenAlerts));
+  seenAlertHead = 0;
+  memset(commandSpent, 0, sizeof(commandSpent));
+  memset(commandQueued, 0, sizeof(commandQueued));
+  alertSeq = 0;
+  catchupPending = false;
+  pendingURC = "";
+  LTE_Serial.clear();
+}
+
+static void benchAtLineParse(const UrcBlock &block)
+{
+  const char *json = parseResponse(block.text.c_str());
+  sink += json ? json - block.text.c_str() : 0;
+  sink += parseRegistrationStat(block.text, "+CEREG: ");
+  for (int field = 1; field <= 4; field++)
+    sink += parseResponseField(block.text, "+QCSQ: ", field);
+  sink += (long)parseModemTime(block.text, false);
+}
+
+static void benchAlertDecode(const UrcBlock &block)
+{
+  StaticJsonDocument<768 * JSON_OBJECT_SIZE(1) / 16> doc;
+  String code = processJsonMessage(parseResponse(block.text.c_str()), doc);
+  sink += code.length();
+}
+
+static void benchNmeaCoord(const UrcBlock &block)
+{
+  float lat = actualCoord(block.lat, 2);
+  float lon = actualCoord(block.lon, 3);
+  sink += (long)(lat * 1e5f) + (long)(lon * 1e5f) + ggaFixQuality(block.text);
+}
+
+static void benchPayloadSerialize(const UrcBlock &block)
+{
+  Publish_Message(parseLOCResponse(block.text.c_str()));
+  Publish_LIVE_NOW();
+  resetFirmware();
+}
+
+static void benchAlertDispatch(const UrcBlock &block)
+{
+  LTE_Serial.inject(block.raw);
+  receiveATCommand(1);
+  commandLoop();
+  resetFirmware();
+}
+
+/**
+ * Runs loop()'s receive steps until the injected output is used up, stopping each
+ * alert as the button would.
+ */
+static void drainReceive()
+{
+  for (int pass = 0; pass < 64 && (LTE_Serial.available() || pendingURC.length() > 0); pass++)
+  {
+    receiveATCommand(1);
+    commandLoop();
+    mainFlag = 0;
+  }
+}
+
+/**
+ * Counts the occurrences of `key` in `text` and returns the largest number that
+ * follows one of them.
+ */
+static uint32_t scanKey(const std::string &text, const char *key, unsigned int &count)
+{
+  uint32_t largest = 0;
+  count = 0;
+  for (size_t at = text.find(key); at != std::string::npos; at = text.find(key, at + 1))
+  {
+    largest = std::max(largest, (uint32_t)strtoul(text.c_str() + at + strlen(key), nullptr, 10));
+    count++;
+  }
+  return largest;
+}
+
+/**
+ * Feeds each burst block to the receive path in one read, then cut in the middle of
+ * its last message, and checks that every id was remembered and alertSeq reached
+ * the last seq. Every block holds an alert, so the first read of the whole block
+ * must start one before dispatching anything else.
+ *
+ * @return the number of failed checks.
+ */
+static int checkBursts()
+{
+  int failures = 0;
+  for (const UrcBlock &block : blocks)
+  {
+    if (block.kind != "burst")
+      continue;
+    unsigned int ids, seqs;
+    scanKey(block.raw, "\"id\":\"", ids);
+    uint32_t lastSeq = scanKey(block.raw, "\"seq\":", seqs);
+    size_t cut = block.raw.rfind("+QMTRECV:") + 20;
+    for (int split = 0; split < 2; split++)
+    {
+      resetFirmware();
+      if (split)
+      {
+        LTE_Serial.inject(block.raw.substr(0, cut));
+        receiveATCommand(1);
+        mainFlag = 0;
+        LTE_Serial.inject(block.raw.substr(cut));
+      }
+      else
+      {
+        LTE_Serial.inject(block.raw);
+        receiveATCommand(1);
+        if (mainFlag == 0 || seenAlertHead != 1)
+        {
+          printf("OUT OF ORDER burst: %u messages dispatched before an alert started\n", seenAlertHead - (mainFlag != 0));
+          failures++;
+        }
+        mainFlag = 0;
+      }
+      drainReceive();
+      if (seenAlertHead != ids || alertSeq != lastSeq)
+      {
+        printf("DROPPED %s: %u of %u messages, seq %lu of %lu\n", split ? "split burst" : "burst",
+               seenAlertHead, ids, (unsigned long)alertSeq, (unsigned long)lastSeq);
+        failures++;
+      }
+    }
+  }
+  resetFirmware();
+  return failures;
+}
+
+const Benchmark BENCHMARKS[] = {
+    {"at_line_parse", nullptr, benchAtLineParse},
+    {"alert_decode", "alert", benchAlertDecode},
+    {"nmea_coord", "gga", benchNmeaCoord},
+    {"payload_serialize", "gga", benchPayloadSerialize},
+    {"alert_dispatch", "alert", benchAlertDispatch},
+};
+
+/**
+ * Runs the operation once over every matching block.
+ *
+ * @return the number of operations run.
+ */
+static size_t runPass(const Benchmark &bench)
+{
+  size_t ops = 0;
+  for (const UrcBlock &block : blocks)
+  {
+    if (!bench.kind || block.kind == bench.kind)
+    {
+      bench.op(block);
+      ops++;
+    }
+  }
+  return ops;
+}
+
+static Result measure(const Benchmark &bench, size_t &ops)
+{
+  Result result;
+  ops = runPass(bench); // warm-up, also grows any lazily sized buffers
+
+  AllocStats before = allocStats;
+  allocStats.peak = allocStats.live;
+  runPass(bench);
+  result.allocsPerOp = ops ? (double)(allocStats.count - before.count) / ops : 0;
+  result.peakBytes = (double)(allocStats.peak - before.live);
+  allocStats.peak = before.peak > allocStats.peak ? before.peak : allocStats.peak;
+
+  result.nsPerOp = 0;
+  for (int sample = 0; sample < BENCH_SAMPLES && ops > 0; sample++)
+  {
+    size_t passes = 0;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t elapsed = 0;
+    do
+    {
+      runPass(bench);
+      passes++;
+      elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    } while (elapsed < BENCH_SAMPLE_NS);
+    double nsPerOp = (double)elapsed / (passes * ops);
+    if (sample == 0 || nsPerOp < result.nsPerOp)
+      result.nsPerOp = nsPerOp;
+  }
+  return result;
+}
+
+/**
+ * Names the JSON library the firmware is built against, empty for a stand-in that
+ * does not declare an ArduinoJson release.
+ */
+static std::string jsonLibrary()
+{
+#ifdef ARDUINOJSON_VERSION
+  return std::string("ArduinoJson ") + ARDUINOJSON_VERSION;
+#else
+  return "";
+#endif
+}
+
+/**
+ * Describes the machine the times are measured on: the CPU model and the compiler.
+ */
+static std::string machineName()
+{
+  std::string cpu;
+  std::ifstream info("/proc/cpuinfo");
+  std::string line;
+  while (cpu.empty() && std::getline(info, line))
+  {
+    if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+      cpu = line.substr(line.find(':') + 2);
+  }
+  if (cpu.empty())
+  {
+    struct utsname name;
+    cpu = "unknown";
+    if (uname(&name) == 0)
+      cpu.assign(name.sysname).append(" ").append(name.machine);
+  }
+#ifdef __clang__
+  return cpu + ", " + __VERSION__;
+#else
+  return cpu + ", gcc " + __VERSION__;
+#endif
+}
+
+/**
+ * Reads FILE, with the library it was recorded with from its "# library" line.
+ */
+static std::map<std::string, Result> loadBaseline(const char *path, std::string &library)
+{
+  std::map<std::string, Result> baseline;
+  std::ifstream in(path);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    if (line.compare(0, 10, "# library ") == 0)
+      library = line.substr(10);
+    if (line.empty() || line[0] == '#')
+      continue;
+    char name[64];
+    Result r;
+    if (sscanf(line.c_str(), "%63s %lf %lf %lf", name, &r.nsPerOp, &r.allocsPerOp, &r.peakBytes) == 4)
+      baseline[name] = r;
+  }
+  return baseline;
+}
+
+static bool saveBaseline(const char *path, const std::map<std::string, Result> &results)
+{
+  FILE *out = fopen(path, "w");
+  if (!out)
+    return false;
+  fprintf(out, "# library %s\n", jsonLibrary().c_str());
+  fprintf(out, "# machine %s\n", machineName().c_str());
+  fprintf(out, "# name ns/op allocs/op peak_bytes\n");
+  for (const auto &entry : results)
+    fprintf(out, "%s %.1f %.2f %.0f\n", entry.first.c_str(), entry.second.nsPerOp, entry.second.allocsPerOp, entry.second.peakBytes);
+  return fclose(out) == 0;
+}
+
+/**
+ * Reports a metric that grew by more than `threshold` percent over the baseline.
+ * An allocation count or peak that was zero fails on any growth.
+ */
+static bool regressed(const char *name, const char *metric, double base, double now, double threshold)
+{
+  if (now <= base * (1 + threshold / 100) && !(base == 0 && now > 0))
+    return false;
+  printf("REGRESSION %s %s: %.2f -> %.2f", name, metric, base, now);
+  if (base > 0)
+    printf(" (+%.1f%%)", (now / base - 1) * 100);
+  printf("\n");
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  const char *baselinePath = nullptr;
+  const char *filter = nullptr;
+  bool update = false;
+  double threshold = BENCH_DEFAULT_THRESHOLD;
+  int transcripts = 0;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+      baselinePath = argv[++i];
+    else if (!strcmp(argv[i], "--threshold") && i + 1 < argc)
+      threshold = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+      filter = argv[++i];
+    else if (!strcmp(argv[i], "--update"))
+      update = true;
+    else if (!loadTranscript(argv[i]))
+      return 2;
+    else
+      transcripts++;
+  }
+  if (transcripts == 0 || (update && !baselinePath))
+  {
+    fprintf(stderr, "usage: %s [--baseline FILE] [--update] [--threshold PCT] [--filter NAME] TRANSCRIPT...\n", argv[0]);
+    return 2;
+  }
+  if (update && jsonLibrary().empty())
+  {
+    fprintf(stderr, "not built against ArduinoJson, its allocations would not match the device's; no baseline recorded\n");
+    return 2;
+  }
+
+  // the device as it is once armed: provisioned defaults, SD and I2S up
+  LTE_Serial.setResponder(modemReply);
+  loadProvisioning(false);
+  sdReady = true;
+  i2sReady = true;
+
+  if (checkBursts() > 0)
+    return 1;
+
+  std::map<std::string, Result> results;
+  printf("%-20s %8s %12s %10s %12s\n", "benchmark", "ops", "ns/op", "allocs/op", "peak bytes");
+  for (const Benchmark &bench : BENCHMARKS)
+  {
+    if (filter && !strstr(bench.name, filter))
+      continue;
+    size_t ops;
+    Result r = measure(bench, ops);
+    results[bench.name] = r;
+    printf("%-20s %8zu %12.1f %10.2f %12.0f\n", bench.name, ops, r.nsPerOp, r.allocsPerOp, r.peakBytes);
+  }
+
+  if (!baselinePath)
+    return 0;
+  if (update)
+  {
+    if (!saveBaseline(baselinePath, results))
+    {
+      fprintf(stderr, "cannot write %s\n", baselinePath);
+      return 2;
+    }
+    printf("baseline written to %s\n", baselinePath);
+    return 0;
+  }
+
+  std::string library;
+  std::map<std::string, Result> baseline = loadBaseline(baselinePath, library);
+  if (baseline.empty())
+  {
+    printf("FAILED: no baseline in %s, run with --update to record one\n", baselinePath);
+    return 1;
+  }
+  if (library != jsonLibrary())
+  {
+    printf("FAILED: %s was recorded with %s, this build uses %s\n", baselinePath, library.empty() ? "an unknown library" : library.c_str(),
+           jsonLibrary().empty() ? "a stand-in" : jsonLibrary().c_str());
+    return 1;
+  }
+  bool failed = false;
+  for (const Benchmark &bench : BENCHMARKS)
+  {
+    auto entry = results.find(bench.name);
+    auto base = baseline.find(bench.name);
+    if (entry == results.end() || base == baseline.end())
+      continue;
+    for (int retry = 0; retry < BENCH_RETRIES && entry->second.nsPerOp > base->second.nsPerOp * (1 + threshold / 100); retry++)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(BENCH_RETRY_PAUSE_MS));
+      size_t ops;
+      entry->second.nsPerOp = std::min(entry->second.nsPerOp, measure(bench, ops).nsPerOp);
+    }
+  }
+  for (const auto &entry : results)
+  {
+    auto base = baseline.find(entry.first);
+    if (base == baseline.end())
+    {
+      printf("MISSING %s has no baseline, run with --update to record one\n", entry.first.c_str());
+      failed = true;
+      continue;
+    }
+    const char *name = entry.first.c_str();
+    failed |= regressed(name, "ns/op", base->second.nsPerOp, entry.second.nsPerOp, threshold);
+    failed |= regressed(name, "allocs/op", base->second.allocsPerOp, entry.second.allocsPerOp, threshold);
+    failed |= regressed(name, "peak bytes", base->second.peakBytes, entry.second.peakBytes, threshold);
+  }
+  printf(failed ? "FAILED: missing baseline or regression beyond %.0f%%\n" : "OK: within %.0f%% of the baseline\n", threshold);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+/**
+ * main.cpp compiled for the host, shared by the bench and fleet tools. Include it
+ * once, before anything else that uses ArduinoJson.
+ */
+#pragma once
+#include <ArduinoJson.h>
+
+// ArduinoJson slots are 16 bytes on the ESP32 and larger on a 64-bit host; scale the
+// documents so everything that fits on the device fits here too
+template <size_t N>
+using BenchJsonDocument = StaticJsonDocument<N * JSON_OBJECT_SIZE(1) / 16>;
+#define StaticJsonDocument BenchJsonDocument
+
+#include "../main.cpp"
+
+#undef StaticJsonDocument
@@ -0,0 +1,776 @@
+/**
+ * Fleet simulator for capacity planning of the broker side. main.cpp is compiled once
+ * against the shims in bench/shim and every virtual device takes turns running it:
+ * before a device handles an event its identity, topics and dedup table are swapped
+ * into the firmware globals, and the modem is answered by a responder that hands each
+ * AT+QMTPUBEX payload to an in-process broker model.
+ *
+ *   fleet [--devices N] [--scenario NAME]... [options]
+ *
+ * Scenarios run in the order given, --gap seconds apart:
+ *   boot       every device is power cycled within --boot-window (a boot storm)
+ *   live       the backend sends STATUS to every device (LIVE_NOW burst)
+ *   loc        the backend sends LOC to every device (mass LOC replies)
+ *   alert      an alert goes to every device; users stop it after --ack-mean seconds
+ *              on average and the firmware answers with its location
+ *   reconnect  the broker drops every session and devices open, connect and
+ *              subscribe again within --reconnect-spread
+ *
+ * Time is simulated. The time the firmware spends in a handler (its AT round trips,
+ * --at-latency each, and its own delays) comes from the shim's virtual clock and
+ * keeps the device busy. The cellular link is a one-way latency per device, drawn
+ * from a log-normal around --latency. The broker is two FIFO servers: TLS session
+ * setup at --connect-rate per second and packet routing (CONNECT, SUBSCRIBE and
+ * every PUBLISH) at --route-rate per second. Boot, the connect steps and their
+ * timeouts follow setup() and connectToAWS(); a step that times out restarts the
+ * device. Publishes are not held up waiting for their PUBACK. The run stops --gap
+ * seconds after the last scenario starts, whatever is still retrying.
+ *
+ * The report gives, per scenario, the broker load per second and the latency
+ * distribution of each kind of traffic.
+ */
+#include "firmware.h"
+
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+#define FLEET_DEFAULT_DEVICES 1000
+#define FLEET_LAT_CENTER 28.40
+#define FLEET_LON_CENTER 77.35
+#define FLEET_SPREAD_DEG 0.5
+
+enum Phase
+{
+  PHASE_OFF,
+  PHASE_BOOTING,
+  PHASE_CONNECTING,
+  PHASE_ONLINE
+};
+
+enum Step
+{
+  STEP_OPEN,
+  STEP_CONNECT,
+  STEP_SUBSCRIBE
+};
+
+enum Kind
+{
+  KIND_CONNECT,
+  KIND_CATCHUP,
+  KIND_BOOT_LIVE,
+  KIND_STATUS,
+  KIND_LOC,
+  KIND_ALERT,
+  KIND_ACK,
+  KINDS
+};
+
+const char *KIND_NAMES[] = {"connect", "catchup", "boot_live_now", "status_reply", "loc_reply", "alert_start", "ack_loc"};
+
+enum EventType
+{
+  EV_POWER_ON,
+  EV_STEP_SEND,
+  EV_STEP_ARRIVE,
+  EV_STEP_DONE,
+  EV_STEP_TIMEOUT,
+  EV_TLS_DONE,
+  EV_PUB_ARRIVE,
+  EV_CMD_PUBLISH,
+  EV_DELIVER,
+  EV_ACK,
+  EV_SCENARIO
+};
+
+struct Event
+{
+  double time;
+  uint64_t seq;
+  uint8_t type;
+  uint8_t step;
+  uint32_t device;
+  uint32_t token;
+  uint32_t message;
+};
+
+struct EventLater
+{
+  bool operator()(const Event &a, const Event &b) const
+  {
+    return a.time != b.time ? a.time > b.time : a.seq > b.seq;
+  }
+};
+
+/**
+ * A device's share of the firmware state, swapped in by adoptDevice(). `token` moves
+ * on with every connect step and restart, so stale timeouts and replies are ignored;
+ * `session` moves on when the broker session is lost.
+ */
+struct VirtualDevice
+{
+  String id;
+  double latency;
+  double lat;
+  double lon;
+  Phase phase;
+  double freeAt;
+  double phaseStart;
+  uint32_t token;
+  uint32_t session;
+  uint32_t seen[SEEN_ALERT_SLOTS];
+  unsigned int seenHead;
+  uint8_t commandSpent[COMMAND_LIMIT_COUNT];
+  unsigned long commandRefilledAt[COMMAND_LIMIT_COUNT];
+};
+
+/**
+ * A publish in flight, with the time and scenario its latency is measured from.
+ */
+struct Message
+{
+  Kind kind;
+  double origin;
+  int scenario;
+  std::string payload;
+};
+
+/**
+ * One FIFO server of the broker model. Arrivals must be offered in time order.
+ * Used for routing, where nothing is abandoned once sent.
+ */
+struct FifoServer
+{
+  double serviceMs;
+  double freeAt;
+  double maxWait;
+
+  double serve(double arrival)
+  {
+    double start = std::max(arrival, freeAt);
+    maxWait = std::max(maxWait, start - arrival);
+    freeAt = start + serviceMs;
+    return freeAt;
+  }
+};
+
+/**
+ * The broker's TLS handshakes, served one at a time from a backlog. A handshake whose
+ * device gave up (QMTOPEN timed out) is dropped when it reaches the head, the way a
+ * reset connection leaves the backlog, so a storm of retries cannot keep the server
+ * busy with dead sessions.
+ */
+struct TlsServer
+{
+  double serviceMs;
+  std::deque<Event> backlog;
+  bool busy;
+  double maxWait;
+};
+
+struct Options
+{
+  int devices = FLEET_DEFAULT_DEVICES;
+  std::vector<std::string> scenarios;
+  double gap = 300;
+  double bootWindow = 60;
+  double bootMin = 10;
+  double bootMax = 30;
+  double latency = 80;
+  double connectRate = 500;
+  double routeRate = 5000;
+  double fanout = 0;
+  double atLatency = 20;
+  double ackMean = 20;
+  double reconnectSpread = 30;
+  unsigned long seed = 1;
+};
+
+/**
+ * Load seen by the broker in one second of simulated time.
+ */
+struct Second
+{
+  uint32_t in;
+  uint32_t out;
+  uint32_t sessions;
+};
+
+struct ScenarioStats
+{
+  std::string name;
+  double start;
+  std::vector<double> samples[KINDS];
+  uint32_t restarts;
+  uint32_t missed;
+  double connectWait;
+  double routeWait;
+};
+
+static Options options;
+static std::mt19937_64 rng;
+static std::vector<VirtualDevice> fleet;
+static std::vector<Message> messages;
+static std::vector<Second> seconds;
+static std::vector<ScenarioStats> scenarios;
+static std::priority_queue<Event, std::vector<Event>, EventLater> events;
+static uint64_t eventSeq = 0;
+static int currentScenario = -1;
+static double horizon = 0;
+static TlsServer connectServer;
+static FifoServer routeServer;
+
+// what the responder saw while a device ran the firmware
+static VirtualDevice *current = nullptr;
+static std::vector<std::string> published;
+static bool awaitingPayload = false;
+static int publishQos = 0;
+static std::string modemOutput;
+
+static double uniform(double low, double high)
+{
+  return std::uniform_real_distribution<double>(low, high)(rng);
+}
+
+static void schedule(double time, EventType type, uint32_t device, uint32_t token = 0, uint32_t message = 0, Step step = STEP_OPEN)
+{
+  if (time > horizon)
+    return;
+  events.push({time, eventSeq++, (uint8_t)type, (uint8_t)step, device, token, message});
+}
+
+static Second &secondAt(double time)
+{
+  size_t at = (size_t)(time / 1000);
+  if (at >= seconds.size())
+    seconds.resize(at + 1, {0, 0, 0});
+  return seconds[at];
+}
+
+static void record(int scenario, Kind kind, double value)
+{
+  if (scenario >= 0)
+    scenarios[scenario].samples[kind].push_back(value);
+}
+
+/**
+ * Formats a coordinate as the ddmm.mmmmm (or dddmm.mmmmm) field of a GGA sentence.
+ */
+static std::string nmeaCoord(double value, int degreeDigits)
+{
+  double magnitude = fabs(value);
+  int degrees = (int)magnitude;
+  char field[24];
+  snprintf(field, sizeof(field), "%0*d%08.5f", degreeDigits, degrees, (magnitude - degrees) * 60);
+  return field;
+}
+
+/**
+ * The modem of the device being run: publishes are captured, GNSS queries answered
+ * with the device's position and anything else with OK. Each line costs --at-latency
+ * of the device's time.
+ */
+static const std::string *fleetModem(const std::string &line)
+{
+  delay((unsigned long)options.atLatency);
+  if (awaitingPayload)
+  {
+    awaitingPayload = false;
+    published.push_back(line);
+    modemOutput = publishQos ? "OK\r\n\r\n+QMTPUBEX: 0,1,0\r\n" : "OK\r\n\r\n+QMTPUBEX: 0,0,0\r\n";
+    return &modemOutput;
+  }
+  if (line.compare(0, 12, "AT+QMTPUBEX=") == 0)
+  {
+    // AT+QMTPUBEX=0,<qos>,<msgid>,0,"<topic>",<length>
+    publishQos = line.size() > 14 ? line[14] - '0' : 0;
+    awaitingPayload = true;
+    modemOutput = "> ";
+    return &modemOutput;
+  }
+  if (line.compare(0, 12, "AT+QGPSGNMEA") == 0)
+  {
+    modemOutput = "+QGPSGNMEA: $GPGGA,101500.00," + nmeaCoord(current->lat, 2) + (current->lat < 0 ? ",S," : ",N,") +
+                  nmeaCoord(current->lon, 3) + (current->lon < 0 ? ",W," : ",E,") + "1,08,1.02,220.0,M,-35.2,M,,*5A\r\nOK\r\n";
+    return &modemOutput;
+  }
+  modemOutput = "OK\r\n";
+  return &modemOutput;
+}
+
+/**
+ * Loads a device into the firmware globals, in the idle receive state.
+ */
+static void adoptDevice(VirtualDevice &dev)
+{
+  current = &dev;
+  DEVICE_ID = dev.id;
+  CLIENT_ID = "fleet-" + dev.id;
+  TOPIC_SUB = "AWS/CIER/SUB/" + dev.id;
+  TOPIC_INFO = "AWS/CIER/INFO/" + dev.id;
+  cmdPublishInfoQos0 = "AT+QMTPUBEX=0,0,0,0,\"" + TOPIC_INFO + "\",";
+  cmdPublishInfoQos1 = "AT+QMTPUBEX=0,1,1,0,\"" + TOPIC_INFO + "\",";
+  memcpy(seenAlerts, dev.seen, sizeof(seenAlerts));
+  seenAlertHead = dev.seenHead;
+  memcpy(commandSpent, dev.commandSpent, sizeof(commandSpent));
+  memcpy(commandRefilledAt, dev.commandRefilledAt, sizeof(commandRefilledAt));
+  memset(commandQueued, 0, sizeof(commandQueued));
+  mainFlag = 0;
+  alertOutput = OUTPUT_NONE;
+  statusPending = false;
+  pendingURC = "";
+  LTE_Serial.clear();
+  published.clear();
+  awaitingPayload = false;
+}
+
+/**
+ * Saves the device's dedup table back and sends what it published to the broker.
+ *
+ * @return the time the device spent in the firmware, in ms.
+ */
+static double releaseDevice(VirtualDevice &dev, uint32_t index, unsigned long startedAt, double now, Kind kind, double origin, int scenario)
+{
+  memcpy(dev.seen, seenAlerts, sizeof(seenAlerts));
+  dev.seenHead = seenAlertHead;
+  memcpy(dev.commandSpent, commandSpent, sizeof(commandSpent));
+  memcpy(dev.commandRefilledAt, commandRefilledAt, sizeof(commandRefilledAt));
+  double busy = (double)(millis() - startedAt);
+  dev.freeAt = now + busy;
+  for (const std::string &payload : published)
+  {
+    messages.push_back({kind, origin, scenario, payload});
+    schedule(now + busy + dev.latency, EV_PUB_ARRIVE, index, 0, messages.size() - 1);
+  }
+  published.clear();
+  current = nullptr;
+  return busy;
+}
+
+static void startStep(uint32_t index, Step step, double now)
+{
+  VirtualDevice &dev = fleet[index];
+  static const unsigned long TIMEOUTS[] = {MQTT_OPEN_TIMEOUT, MQTT_CONN_TIMEOUT, MQTT_SUB_TIMEOUT};
+  dev.token++;
+  schedule(now + TIMEOUTS[step], EV_STEP_TIMEOUT, index, dev.token, 0, step);
+  // TCP handshake and ClientHello for the open; one packet otherwise
+  double toBroker = step == STEP_OPEN ? 3 * dev.latency : dev.latency;
+  schedule(now + toBroker, EV_STEP_ARRIVE, index, dev.token, 0, step);
+}
+
+/**
+ * Boots a device. A restart keeps `phaseStart`, so the connect time of a boot storm
+ * includes the attempts that timed out.
+ */
+static void powerOn(uint32_t index, double now, bool restart)
+{
+  VirtualDevice &dev = fleet[index];
+  dev.phase = PHASE_BOOTING;
+  if (!restart)
+    dev.phaseStart = now;
+  dev.token++;
+  dev.session++;
+  schedule(now + uniform(options.bootMin, options.bootMax) * 1000, EV_STEP_SEND, index, dev.token, 0, STEP_OPEN);
+}
+
+/**
+ * The device is subscribed: connectToAWS() asks for a catch-up and publishes
+ * LIVE_NOW right away.
+ */
+static void goOnline(uint32_t index, double now)
+{
+  VirtualDevice &dev = fleet[index];
+  record(currentScenario, KIND_CONNECT, now - dev.phaseStart);
+  dev.phase = PHASE_ONLINE;
+  adoptDevice(dev);
+  unsigned long startedAt = millis();
+  catchupFrom = alertSeq;
+  requestCatchup();
+  releaseDevice(dev, index, startedAt, std::max(now, dev.freeAt), KIND_CATCHUP, now, currentScenario);
+  adoptDevice(dev);
+  startedAt = millis();
+  Publish_LIVE_NOW();
+  releaseDevice(dev, index, startedAt, std::max(now, dev.freeAt), KIND_BOOT_LIVE, now, currentScenario);
+}
+
+/**
+ * Starts the next live handshake in the TLS backlog, if any.
+ */
+static void nextHandshake(double now)
+{
+  connectServer.busy = false;
+  while (!connectServer.backlog.empty())
+  {
+    Event head = connectServer.backlog.front();
+    connectServer.backlog.pop_front();
+    if (head.token != fleet[head.device].token)
+      continue;
+    connectServer.maxWait = std::max(connectServer.maxWait, now - head.time);
+    connectServer.busy = true;
+    head.time = now + connectServer.serviceMs;
+    head.type = EV_TLS_DONE;
+    head.seq = eventSeq++;
+    events.push(head);
+    return;
+  }
+}
+
+static void handleStep(const Event &ev)
+{
+  VirtualDevice &dev = fleet[ev.device];
+  if (ev.token != dev.token)
+    return;
+  Step step = (Step)ev.step;
+  switch (ev.type)
+  {
+  case EV_STEP_SEND:
+    dev.phase = PHASE_CONNECTING;
+    startStep(ev.device, step, ev.time);
+    break;
+  case EV_STEP_ARRIVE:
+    if (step == STEP_OPEN)
+    {
+      connectServer.backlog.push_back(ev);
+      if (!connectServer.busy)
+        nextHandshake(ev.time);
+    }
+    else
+    {
+      double done = routeServer.serve(ev.time);
+      secondAt(done).in++;
+      schedule(done + dev.latency, EV_STEP_DONE, ev.device, ev.token, 0, step);
+    }
+    break;
+  case EV_STEP_DONE:
+    if (step == STEP_SUBSCRIBE)
+    {
+      dev.token++;
+      goOnline(ev.device, ev.time);
+    }
+    else
+      startStep(ev.device, (Step)(step + 1), ev.time);
+    break;
+  case EV_STEP_TIMEOUT:
+    // connectToAWS() restarts the ESP32, and setup() power cycles the modem
+    if (currentScenario >= 0)
+      scenarios[currentScenario].restarts++;
+    powerOn(ev.device, ev.time, true);
+    break;
+  }
+}
+
+/**
+ * Queues a backend command to every device, all at once or at --fanout per second.
+ */
+static void broadcastCommand(Kind kind, const char *payload, double now)
+{
+  messages.push_back({kind, now, currentScenario, payload});
+  uint32_t message = messages.size() - 1;
+  for (uint32_t i = 0; i < fleet.size(); i++)
+  {
+    double at = options.fanout > 0 ? now + i * 1000.0 / options.fanout : now;
+    schedule(at, EV_CMD_PUBLISH, i, 0, message);
+  }
+}
+
+static void startScenario(const Event &ev)
+{
+  currentScenario = ev.message;
+  ScenarioStats &stats = scenarios[currentScenario];
+  connectServer.maxWait = 0;
+  routeServer.maxWait = 0;
+  const std::string &name = stats.name;
+  if (name == "boot")
+  {
+    for (uint32_t i = 0; i < fleet.size(); i++)
+    {
+      fleet[i].phase = PHASE_OFF;
+      fleet[i].token++;
+      fleet[i].session++;
+      schedule(ev.time + uniform(0, options.bootWindow) * 1000, EV_POWER_ON, i);
+    }
+  }
+  else if (name == "reconnect")
+  {
+    for (uint32_t i = 0; i < fleet.size(); i++)
+    {
+      VirtualDevice &dev = fleet[i];
+      if (dev.phase == PHASE_OFF)
+        continue;
+      dev.phase = PHASE_CONNECTING;
+      dev.phaseStart = ev.time;
+      dev.token++;
+      dev.session++;
+      schedule(ev.time + uniform(0, options.reconnectSpread) * 1000, EV_STEP_SEND, i, dev.token, 0, STEP_OPEN);
+    }
+  }
+  else if (name == "live")
+    broadcastCommand(KIND_STATUS, "{\"message\":\"STATUS\"}", ev.time);
+  else if (name == "loc")
+    broadcastCommand(KIND_LOC, "{\"message\":\"LOC\"}", ev.time);
+  else if (name == "alert")
+  {
+    std::string payload = "{\"message\":\"1\",\"id\":\"fleet-" + std::to_string(currentScenario) + "\"}";
+    messages.push_back({KIND_ALERT, ev.time, currentScenario, payload});
+    uint32_t message = messages.size() - 1;
+    for (uint32_t i = 0; i < fleet.size(); i++)
+      schedule(options.fanout > 0 ? ev.time + i * 1000.0 / options.fanout : ev.time, EV_CMD_PUBLISH, i, 0, message);
+  }
+}
+
+/**
+ * Hands a command to the device's firmware as the +QMTRECV URC the modem would print.
+ */
+static void deliver(const Event &ev)
+{
+  VirtualDevice &dev = fleet[ev.device];
+  if (ev.token != dev.session || dev.phase != PHASE_ONLINE)
+  {
+    scenarios[messages[ev.message].scenario].missed++;
+    return;
+  }
+  const Message &command = messages[ev.message];
+  double now = std::max(ev.time, dev.freeAt);
+  adoptDevice(dev);
+  String urc = "+QMTRECV: 0,1,\"" + TOPIC_SUB + "\"," + String((unsigned int)command.payload.size()) + ",\"" +
+               command.payload.c_str() + "\"\r\n";
+  LTE_Serial.inject(urc.c_str());
+  unsigned long startedAt = millis();
+  receiveATCommand(1);
+  commandLoop();
+  bool alerting = mainFlag == 1;
+  Kind replyKind = command.kind == KIND_ALERT ? KIND_ACK : command.kind;
+  double busy = releaseDevice(dev, ev.device, startedAt, now, replyKind, command.origin, command.scenario);
+  if (alerting)
+  {
+    record(command.scenario, KIND_ALERT, now + busy - command.origin);
+    double ack = std::exponential_distribution<double>(1.0 / options.ackMean)(rng) * 1000;
+    schedule(now + busy + ack, EV_ACK, ev.device, dev.session, ev.message);
+  }
+}
+
+/**
+ * The user pressed the button: loop() stops the alert and replies with the location.
+ */
+static void acknowledge(const Event &ev)
+{
+  VirtualDevice &dev = fleet[ev.device];
+  if (ev.token != dev.session || dev.phase != PHASE_ONLINE)
+    return;
+  const Message &alert = messages[ev.message];
+  double now = std::max(ev.time, dev.freeAt);
+  adoptDevice(dev);
+  unsigned long startedAt = millis();
+  mainFlag = 1;
+  stopAlert();
+  mainFlag = 0;
+  checkLOC();
+  releaseDevice(dev, ev.device, startedAt, now, KIND_ACK, alert.origin, alert.scenario);
+}
+
+static void run()
+{
+  while (!events.empty())
+  {
+    Event ev = events.top();
+    events.pop();
+    switch (ev.type)
+    {
+    case EV_SCENARIO:
+      startScenario(ev);
+      break;
+    case EV_POWER_ON:
+      powerOn(ev.device, ev.time, false);
+      break;
+    case EV_STEP_SEND:
+    case EV_STEP_ARRIVE:
+    case EV_STEP_DONE:
+    case EV_STEP_TIMEOUT:
+      handleStep(ev);
+      break;
+    case EV_TLS_DONE:
+      secondAt(ev.time).sessions++;
+      // ServerHello to Finished: another round trip and a half
+      schedule(ev.time + 3 * fleet[ev.device].latency, EV_STEP_DONE, ev.device, ev.token, 0, STEP_OPEN);
+      nextHandshake(ev.time);
+      break;
+    case EV_PUB_ARRIVE:
+    {
+      double done = routeServer.serve(ev.time);
+      secondAt(ev.time).in++;
+      const Message &message = messages[ev.message];
+      record(message.scenario, message.kind, done - message.origin);
+      break;
+    }
+    case EV_CMD_PUBLISH:
+    {
+      double done = routeServer.serve(ev.time);
+      secondAt(done).out++;
+      VirtualDevice &dev = fleet[ev.device];
+      schedule(done + dev.latency, EV_DELIVER, ev.device, dev.session, ev.message);
+      break;
+    }
+    case EV_DELIVER:
+      deliver(ev);
+      break;
+    case EV_ACK:
+      acknowledge(ev);
+      break;
+    }
+    if (currentScenario >= 0)
+    {
+      ScenarioStats &stats = scenarios[currentScenario];
+      stats.connectWait = std::max(stats.connectWait, connectServer.maxWait);
+      stats.routeWait = std::max(stats.routeWait, routeServer.maxWait);
+    }
+  }
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+  size_t at = std::min(values.size() - 1, (size_t)(p / 100 * values.size()));
+  std::nth_element(values.begin(), values.begin() + at, values.end());
+  return values[at];
+}
+
+static void report()
+{
+  for (size_t s = 0; s < scenarios.size(); s++)
+  {
+    ScenarioStats &stats = scenarios[s];
+    double end = s + 1 < scenarios.size() ? scenarios[s + 1].start : seconds.size() * 1000.0;
+    uint32_t peakIn = 0, peakOut = 0, peakSessions = 0;
+    uint64_t totalIn = 0, totalOut = 0, totalSessions = 0;
+    size_t first = (size_t)(stats.start / 1000), last = std::min(seconds.size(), (size_t)(end / 1000));
+    for (size_t i = first; i < last; i++)
+    {
+      peakIn = std::max(peakIn, seconds[i].in);
+      peakOut = std::max(peakOut, seconds[i].out);
+      peakSessions = std::max(peakSessions, seconds[i].sessions);
+      totalIn += seconds[i].in;
+      totalOut += seconds[i].out;
+      totalSessions += seconds[i].sessions;
+    }
+    double span = std::max<size_t>(1, last - first);
+    printf("\n%s at %.0f s: %u restarts, %u commands missed\n", stats.name.c_str(), stats.start / 1000, stats.restarts, stats.missed);
+    if (stats.name == "boot" || stats.name == "reconnect")
+      printf("  online at the end of the window: %zu of %zu\n", stats.samples[KIND_CONNECT].size(), fleet.size());
+    printf("  broker in     %8.1f msg/s mean %8u peak\n", totalIn / span, peakIn);
+    printf("  broker out    %8.1f msg/s mean %8u peak\n", totalOut / span, peakOut);
+    printf("  TLS sessions  %8.1f /s mean    %8u peak\n", totalSessions / span, peakSessions);
+    printf("  queue wait    %8.0f ms TLS     %8.0f ms routing (max)\n", stats.connectWait, stats.routeWait);
+    printf("  %-14s %8s %10s %10s %10s %10s\n", "latency", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (int k = 0; k < KINDS; k++)
+    {
+      std::vector<double> &v = stats.samples[k];
+      if (v.empty())
+        continue;
+      double max = *std::max_element(v.begin(), v.end());
+      printf("  %-14s %8zu %10.0f %10.0f %10.0f %10.0f\n", KIND_NAMES[k], v.size(),
+             percentile(v, 50), percentile(v, 90), percentile(v, 99), max);
+    }
+  }
+}
+
+static bool parseArgs(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (i + 1 >= argc)
+      return false;
+    const char *value = argv[++i];
+    if (!strcmp(arg, "--devices"))
+      options.devices = atoi(value);
+    else if (!strcmp(arg, "--scenario"))
+      options.scenarios.push_back(value);
+    else if (!strcmp(arg, "--gap"))
+      options.gap = atof(value);
+    else if (!strcmp(arg, "--boot-window"))
+      options.bootWindow = atof(value);
+    else if (!strcmp(arg, "--boot-min"))
+      options.bootMin = atof(value);
+    else if (!strcmp(arg, "--boot-max"))
+      options.bootMax = atof(value);
+    else if (!strcmp(arg, "--latency"))
+      options.latency = atof(value);
+    else if (!strcmp(arg, "--connect-rate"))
+      options.connectRate = atof(value);
+    else if (!strcmp(arg, "--route-rate"))
+      options.routeRate = atof(value);
+    else if (!strcmp(arg, "--fanout"))
+      options.fanout = atof(value);
+    else if (!strcmp(arg, "--at-latency"))
+      options.atLatency = atof(value);
+    else if (!strcmp(arg, "--ack-mean"))
+      options.ackMean = atof(value);
+    else if (!strcmp(arg, "--reconnect-spread"))
+      options.reconnectSpread = atof(value);
+    else if (!strcmp(arg, "--seed"))
+      options.seed = strtoul(value, nullptr, 10);
+    else
+      return false;
+  }
+  for (const std::string &name : options.scenarios)
+  {
+    if (name != "boot" && name != "live" && name != "loc" && name != "alert" && name != "reconnect")
+      return false;
+  }
+  return options.devices > 0 && options.connectRate > 0 && options.routeRate > 0 && options.bootMax >= options.bootMin;
+}
+
+int main(int argc, char **argv)
+{
+  if (!parseArgs(argc, argv))
+  {
+    fprintf(stderr, "usage: %s [--devices N] [--scenario boot|live|loc|alert|reconnect]... [--gap S]\n"
+                    "  [--boot-window S] [--boot-min S] [--boot-max S] [--latency MS] [--connect-rate N]\n"
+                    "  [--route-rate N] [--fanout N] [--at-latency MS] [--ack-mean S] [--reconnect-spread S] [--seed N]\n",
+            argv[0]);
+    return 2;
+  }
+  if (options.scenarios.empty())
+    options.scenarios = {"boot", "live", "loc", "alert", "reconnect"};
+
+  rng.seed(options.seed);
+  LTE_Serial.setResponder(fleetModem);
+  connectServer = {1000 / options.connectRate, {}, false, 0};
+  routeServer = {1000 / options.routeRate, 0, 0};
+
+  // every device starts online with a session, as after a quiet day
+  std::lognormal_distribution<double> latency(log(options.latency), 0.5);
+  fleet.resize(options.devices);
+  for (int i = 0; i < options.devices; i++)
+  {
+    VirtualDevice &dev = fleet[i];
+    dev.id = String(i + 1);
+    dev.latency = latency(rng);
+    dev.lat = FLEET_LAT_CENTER + uniform(-FLEET_SPREAD_DEG, FLEET_SPREAD_DEG);
+    dev.lon = FLEET_LON_CENTER + uniform(-FLEET_SPREAD_DEG, FLEET_SPREAD_DEG);
+    dev.phase = PHASE_ONLINE;
+    dev.freeAt = 0;
+    dev.phaseStart = 0;
+    dev.token = 0;
+    dev.session = 0;
+    memset(dev.seen, 0, sizeof(dev.seen));
+    dev.seenHead = 0;
+  }
+
+  // the last scenario gets a gap too, then whatever is still retrying is cut off
+  horizon = options.scenarios.size() * options.gap * 1000;
+  for (size_t s = 0; s < options.scenarios.size(); s++)
+  {
+    double start = s * options.gap * 1000;
+    scenarios.push_back({options.scenarios[s], start, {}, 0, 0, 0, 0});
+    schedule(start, EV_SCENARIO, 0, 0, s);
+  }
+  printf("%d devices, TLS %.0f/s, routing %.0f msg/s, link %.0f ms one way (median)\n",
+         options.devices, options.connectRate, options.routeRate, options.latency);
+  run();
+  report();
+  return 0;
+}
@@ -0,0 +1,230 @@
+/**
+ * Runs the firmware's OTA download, startOta() and otaLoop() in main.cpp compiled
+ * for the host, against a real HTTP server, usually tools/ota_server.py:
+ *
+ *   python3 tools/ota_server.py serve DIR --port 8080 --drop-every 3 &
+ *   ota [--latency MS] --key release_pub.pem '<payload json>'
+ *
+ * The payload is the one `ota_server.py sign` prints, with an http:// URL. The
+ * responder plays the EC200U HTTP client: AT+QHTTPURL sets the URL, the request the
+ * firmware writes after AT+QHTTPGET goes to the server as it is, and the response
+ * is reported with +QHTTPGET --latency ms later and handed out by AT+QHTTPREAD. A
+ * response cut short by the server fails the GET, as a dropped link does on the
+ * modem. The image lands in the shim's update partition, where the firmware checks
+ * its SHA-256 and signature against the key given with --key.
+ *
+ * Between loop passes the firmware polls the UART as loop() does, so the report of
+ * the longest pass shows what an alert arriving during the download waits for.
+ */
+#include <string>
+
+// read by verifyOtaImage() at run time, so the key can come from the command line
+static std::string releaseKey;
+#define OTA_PUBLIC_KEY releaseKey.c_str()
+
+#include "firmware.h"
+
+#include <fstream>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define OTA_HTTP_ERROR 701
+
+enum Expecting
+{
+  EXPECT_COMMAND,
+  EXPECT_URL,
+  EXPECT_REQUEST
+};
+
+static unsigned long latency = 300;
+static Expecting expecting = EXPECT_COMMAND;
+static std::string url;
+static std::string body;
+static std::string reply;
+static std::string urc;
+static unsigned long urcDue = 0;
+static uint32_t requests = 0;
+static uint32_t failed = 0;
+
+/**
+ * Sends the firmware's request to the host and port of `url` and reads the response.
+ *
+ * @return the HTTP status, or 0 when the server cannot be reached or cuts the body
+ * short of its Content-Length.
+ */
+static int httpExchange(const std::string &request, std::string &content)
+{
+  size_t hostStart = url.find("://") + 3;
+  size_t pathStart = url.find('/', hostStart);
+  std::string authority = url.substr(hostStart, pathStart - hostStart);
+  size_t colon = authority.find(':');
+  std::string host = authority.substr(0, colon);
+  std::string port = colon == std::string::npos ? "80" : authority.substr(colon + 1);
+
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *address = nullptr;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &address) != 0)
+    return 0;
+  int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+  timeval timeout = {OTA_HTTP_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  bool connected = fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+  freeaddrinfo(address);
+  if (!connected || send(fd, request.data(), request.size(), 0) != (ssize_t)request.size())
+  {
+    if (fd >= 0)
+      close(fd);
+    return 0;
+  }
+
+  std::string response;
+  char buffer[4096];
+  size_t headerEnd = std::string::npos;
+  long contentLength = -1;
+  ssize_t got;
+  while ((got = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+  {
+    response.append(buffer, got);
+    if (headerEnd == std::string::npos && (headerEnd = response.find("\r\n\r\n")) != std::string::npos)
+    {
+      size_t field = response.find("Content-Length: ");
+      if (field != std::string::npos && field < headerEnd)
+        contentLength = atol(response.c_str() + field + 16);
+    }
+    if (headerEnd != std::string::npos && contentLength >= 0 && response.size() - headerEnd - 4 >= (size_t)contentLength)
+      break;
+  }
+  close(fd);
+  if (headerEnd == std::string::npos || response.compare(0, 7, "HTTP/1.") != 0)
+    return 0;
+  content = response.substr(headerEnd + 4);
+  if (contentLength < 0 || content.size() < (size_t)contentLength)
+    return 0;
+  content.resize(contentLength);
+  return atoi(response.c_str() + 9);
+}
+
+/**
+ * Answers the firmware's HTTP commands the way the modem does; everything else is OK.
+ */
+static const std::string *answer(const std::string &line)
+{
+  if (expecting == EXPECT_URL)
+  {
+    url = line;
+    expecting = EXPECT_COMMAND;
+    reply = url.compare(0, 7, "http://") == 0 ? "OK\r\n" : "ERROR\r\n";
+  }
+  else if (expecting == EXPECT_REQUEST)
+  {
+    expecting = EXPECT_COMMAND;
+    requests++;
+    int status = httpExchange(line, body);
+    if (status == 0)
+    {
+      failed++;
+      urc = "\r\n+QHTTPGET: " + std::to_string(OTA_HTTP_ERROR) + "\r\n";
+    }
+    else
+      urc = "\r\n+QHTTPGET: 0," + std::to_string(status) + "," + std::to_string(body.size()) + "\r\n";
+    urcDue = millis() + latency;
+    reply = "OK\r\n";
+  }
+  else if (line.compare(0, 12, "AT+QHTTPURL=") == 0)
+  {
+    LTE_Serial.expectRaw(atoi(line.c_str() + 12));
+    expecting = EXPECT_URL;
+    reply = "CONNECT\r\n";
+  }
+  else if (line.compare(0, 12, "AT+QHTTPGET=") == 0)
+  {
+    LTE_Serial.expectRaw(atoi(strchr(line.c_str(), ',') + 1));
+    expecting = EXPECT_REQUEST;
+    reply = "CONNECT\r\n";
+  }
+  else if (line.compare(0, 13, "AT+QHTTPREAD=") == 0)
+    reply = "CONNECT\r\n" + body + "\r\nOK\r\n\r\n+QHTTPREAD: 0\r\n";
+  else
+    reply = "OK\r\n";
+  return &reply;
+}
+
+static void deliver(unsigned long now)
+{
+  if (!urc.empty() && now >= urcDue)
+  {
+    LTE_Serial.inject(urc);
+    urc.clear();
+  }
+}
+
+static bool readFile(const char *path, std::string &text)
+{
+  std::ifstream in(path);
+  text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return in.is_open();
+}
+
+int main(int argc, char **argv)
+{
+  const char *payload = nullptr;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--latency") && i + 1 < argc)
+      latency = atol(argv[++i]);
+    else if (!strcmp(argv[i], "--key") && i + 1 < argc)
+    {
+      if (!readFile(argv[++i], releaseKey))
+      {
+        fprintf(stderr, "%s: cannot read\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (argv[i][0] != '-' && !payload)
+      payload = argv[i];
+  }
+  DynamicJsonDocument command(1024);
+  if (!payload || releaseKey.empty() || deserializeJson(command, payload))
+  {
+    fprintf(stderr, "usage: %s [--latency MS] --key PUBLIC_KEY_PEM PAYLOAD_JSON\n", argv[0]);
+    return 2;
+  }
+
+  LTE_Serial.setResponder(answer);
+  setDelayHook(deliver);
+  startOta(command);
+  if (!otaActive)
+  {
+    fprintf(stderr, "startOta() refused the payload\n");
+    return 1;
+  }
+
+  unsigned long longest = 0;
+  uint32_t lastOffset = 0;
+  while (otaActive && !otaReady)
+  {
+    unsigned long start = millis();
+    receiveATCommand(1);
+    otaLoop();
+    longest = max(longest, millis() - start);
+    if (otaOffset != lastOffset)
+    {
+      printf("%8lu ms  %lu/%lu bytes\n", millis(), (unsigned long)otaOffset, (unsigned long)otaSize);
+      lastOffset = otaOffset;
+    }
+    delay(10);
+  }
+
+  printf("%u requests, %u failed, longest loop pass %lu ms, %.1f s in all\n", requests, failed, longest, millis() / 1000.0);
+  if (!otaReady)
+  {
+    printf("download abandoned\n");
+    return 1;
+  }
+  printf("image verified: SHA-256 and signature match\n");
+  return 0;
+}
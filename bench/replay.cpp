@@ -0,0 +1,286 @@
+/**
+ * Replays a UART capture from the field (see CAPTURE_DIR in main.cpp) into main.cpp
+ * compiled for the host against the shims in bench/shim, to reproduce a device's
+ * behaviour at the desk.
+ *
+ *   replay [--config FILE] [--speed X] [--tail S] [--diffs N] CAPTURE...
+ *
+ * The files of one boot are given in order (/capture/12.cap /capture/13.cap ...).
+ * The firmware boots as on the device, setup() then loop(), and every run of bytes
+ * the modem sent is handed to LTE_Serial once the virtual clock reaches the time it
+ * was captured, so the firmware sees the same responses and URCs at the same moments.
+ * Each line the firmware writes is compared with what the device wrote; the first
+ * --diffs divergences are printed and a short read-ahead keeps an extra or missing
+ * line from misaligning the rest. The run stops --tail seconds after the last record.
+ *
+ * --config loads the device's config.json into NVS before boot, so topics and the
+ * client id match the capture. Time is virtual and the replay is deterministic; with
+ * --speed the run is also paced against the wall clock, 1 for the original timing
+ * (handy with a debugger attached), 10 for ten times faster. An idle pass of loop()
+ * takes 1 ms.
+ */
+#include "firmware.h"
+
+#include <chrono>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#define REPLAY_LOOKAHEAD 8
+
+/**
+ * A run of bytes from the capture. TX runs are split into lines beforehand.
+ */
+struct Chunk
+{
+  uint32_t time;
+  std::string data;
+  bool gap;
+};
+
+struct Options
+{
+  std::vector<std::string> files;
+  std::string config;
+  double speed = 0;
+  double tail = 5;
+  int diffs = 10;
+};
+
+static Options options;
+static std::vector<Chunk> received;
+static std::vector<Chunk> sentLines;
+static size_t nextReceived = 0;
+static size_t nextSent = 0;
+static uint32_t lastRecord = 0;
+static uint32_t gaps = 0;
+static uint32_t matched = 0;
+static uint32_t diverged = 0;
+static uint32_t skipped = 0;
+static uint32_t extra = 0;
+static std::chrono::steady_clock::time_point wallStart;
+
+/**
+ * Reads the capture files of one boot in order. Returns false with a message when a
+ * file is missing, is not a capture or does not continue the previous one.
+ */
+static bool loadCapture()
+{
+  std::string line;
+  bool lineGap = false;
+  uint32_t lineTime = 0;
+  uint32_t boot = 0;
+  for (size_t i = 0; i < options.files.size(); i++)
+  {
+    const std::string &path = options.files[i];
+    std::ifstream in(path, std::ios::binary);
+    CaptureFileHeader header;
+    if (!in.read((char *)&header, sizeof(header)) || memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) || header.version != CAPTURE_VERSION)
+    {
+      fprintf(stderr, "%s: not a version %d UART capture\n", path.c_str(), CAPTURE_VERSION);
+      return false;
+    }
+    if (i == 0 && header.part != 0)
+      fprintf(stderr, "%s: part %u of boot %u, the start of the boot is missing\n", path.c_str(), header.part, header.boot);
+    if (i == 0 && !(header.flags & CAPTURE_FROM_BOOT))
+      fprintf(stderr, "%s: capture was turned on after boot, setup() will not match it\n", path.c_str());
+    if (i > 0 && (header.boot != boot || header.part != i))
+    {
+      fprintf(stderr, "%s: boot %u part %u does not follow the previous file\n", path.c_str(), header.boot, header.part);
+      return false;
+    }
+    boot = header.boot;
+
+    CaptureRecord record;
+    while (in.read((char *)&record, sizeof(record)))
+    {
+      std::string data(record.length, '\0');
+      if (!in.read(&data[0], record.length))
+      {
+        fprintf(stderr, "%s: truncated record at %u ms\n", path.c_str(), record.time);
+        break;
+      }
+      bool gap = record.flags & CAPTURE_GAP;
+      gaps += gap;
+      lastRecord = record.time;
+      if (record.direction == CAPTURE_RX)
+      {
+        received.push_back({record.time, data, gap});
+        continue;
+      }
+      // lines as the shim's responder sees them: split at \n, without \r
+      for (char c : data)
+      {
+        if (line.empty() && !lineGap)
+        {
+          lineTime = record.time;
+          lineGap = gap;
+        }
+        if (c == '\n')
+        {
+          sentLines.push_back({lineTime, line, lineGap});
+          line.clear();
+          lineGap = false;
+        }
+        else if (c != '\r')
+          line += c;
+      }
+    }
+  }
+  printf("boot %u: %zu RX runs, %zu TX lines, %.1f s, %u gaps\n", boot, received.size(), sentLines.size(), lastRecord / 1000.0, gaps);
+  return true;
+}
+
+/**
+ * Provisions the firmware from the device's config.json the way loadProvisioning()
+ * would from the SD card, through NVS.
+ */
+static bool loadConfig()
+{
+  std::ifstream in(options.config);
+  if (!in)
+  {
+    fprintf(stderr, "%s: cannot read\n", options.config.c_str());
+    return false;
+  }
+  std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  DynamicJsonDocument config(4096);
+  if (deserializeJson(config, text))
+  {
+    fprintf(stderr, "%s: not a JSON config\n", options.config.c_str());
+    return false;
+  }
+  Preferences nvs;
+  nvs.begin(CONFIG_NAMESPACE, false);
+  // the replayed firmware has no card to capture to
+  for (JsonPair field : config.as<JsonObject>())
+  {
+    if (strcmp(field.key().c_str(), CAPTURE_SETTING))
+      nvs.putString(field.key().c_str(), field.value().as<String>());
+  }
+  nvs.end();
+  return true;
+}
+
+/**
+ * Called after every delay(): hands the firmware the modem output that is due and,
+ * with --speed, waits for the wall clock to catch up.
+ */
+static void deliver(unsigned long now)
+{
+  while (nextReceived < received.size() && received[nextReceived].time <= now)
+    LTE_Serial.inject(received[nextReceived++].data);
+  if (options.speed > 0)
+    std::this_thread::sleep_until(wallStart + std::chrono::microseconds((long long)(now * 1000 / options.speed)));
+}
+
+static void report(const char *what, const Chunk *captured, const std::string &replayed)
+{
+  if (diverged + skipped + extra > (uint32_t)options.diffs)
+    return;
+  printf("%8lu ms  %s\n", millis(), what);
+  if (captured)
+    printf("            device: %s%s\n", captured->data.c_str(), captured->gap ? "  (after a gap)" : "");
+  printf("            replay: %s\n", replayed.c_str());
+}
+
+/**
+ * Compares each line the firmware writes with the next one the device wrote. A line
+ * found a few lines further on counts the ones in between as skipped; a line not
+ * found at all counts as a divergence when the device wrote something else at that
+ * point, or as extra when the device had nothing left.
+ */
+static const std::string *compareLine(const std::string &line)
+{
+  if (nextSent < sentLines.size() && sentLines[nextSent].data == line)
+  {
+    matched++;
+    nextSent++;
+    return nullptr;
+  }
+  for (size_t ahead = 1; ahead <= REPLAY_LOOKAHEAD && nextSent + ahead < sentLines.size(); ahead++)
+  {
+    if (sentLines[nextSent + ahead].data == line)
+    {
+      skipped += ahead;
+      report("device wrote more lines before this one", &sentLines[nextSent], line);
+      matched++;
+      nextSent += ahead + 1;
+      return nullptr;
+    }
+  }
+  if (nextSent < sentLines.size())
+  {
+    diverged++;
+    report("diverged", &sentLines[nextSent], line);
+    nextSent++;
+  }
+  else
+  {
+    extra++;
+    report("past the end of the capture", nullptr, line);
+  }
+  return nullptr;
+}
+
+static void summary()
+{
+  printf("replayed to %.1f s: %zu/%zu RX runs delivered\n", millis() / 1000.0, nextReceived, received.size());
+  printf("TX lines: %u matched, %u diverged, %u skipped, %u extra, %zu not reached\n",
+         matched, diverged, skipped, extra, sentLines.size() - min(nextSent, sentLines.size()));
+}
+
+static bool parseArgs(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--", 2))
+    {
+      options.files.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc)
+      return false;
+    const char *value = argv[++i];
+    if (!strcmp(arg, "--config"))
+      options.config = value;
+    else if (!strcmp(arg, "--speed"))
+      options.speed = atof(value);
+    else if (!strcmp(arg, "--tail"))
+      options.tail = atof(value);
+    else if (!strcmp(arg, "--diffs"))
+      options.diffs = atoi(value);
+    else
+      return false;
+  }
+  return !options.files.empty() && options.speed >= 0 && options.tail >= 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (!parseArgs(argc, argv))
+  {
+    fprintf(stderr, "usage: %s [--config FILE] [--speed X] [--tail S] [--diffs N] CAPTURE...\n", argv[0]);
+    return 2;
+  }
+  if (!loadCapture() || (!options.config.empty() && !loadConfig()))
+    return 1;
+
+  // a restart ends the boot the capture covers; the shim exits, report anyway
+  atexit(summary);
+  LTE_Serial.setResponder(compareLine);
+  setDelayHook(deliver);
+  wallStart = std::chrono::steady_clock::now();
+
+  // the shim runs no tasks, so the storage half of the boot goes first
+  storageTask(nullptr);
+  setup();
+  unsigned long end = lastRecord + (unsigned long)(options.tail * 1000);
+  while (millis() < end)
+  {
+    loop();
+    delay(1);
+  }
+  return 0;
+}
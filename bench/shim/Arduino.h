@@ -0,0 +1,335 @@
+// Host stand-in for the parts of the Arduino-ESP32 core that main.cpp uses. Time is
+// virtual: millis() only moves when the firmware calls delay(), so timeouts expire
+// instantly and every run takes the same path.
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <string>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define SERIAL_8N1 0x800001c
+#define HEX 16
+#define DEC 10
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+/**
+ * Arduino String on top of std::string. Allocation counts differ from the ESP32
+ * core (its small-string buffer is shorter) but are stable from run to run.
+ */
+class String
+{
+public:
+  String() {}
+  String(const char *c) : s(c ? c : "") {}
+  String(const std::string &x) : s(x) {}
+  String(char c) : s(1, c) {}
+  String(int v, unsigned char base = DEC) : s(format(base == HEX ? "%x" : "%d", v)) {}
+  String(unsigned int v, unsigned char base = DEC) : s(format(base == HEX ? "%x" : "%u", v)) {}
+  String(long v, unsigned char base = DEC) : s(format(base == HEX ? "%lx" : "%ld", v)) {}
+  String(unsigned long v, unsigned char base = DEC) : s(format(base == HEX ? "%lx" : "%lu", v)) {}
+  String(long long v, unsigned char base = DEC) : s(format(base == HEX ? "%llx" : "%lld", v)) {}
+  String(unsigned long long v, unsigned char base = DEC) : s(format(base == HEX ? "%llx" : "%llu", v)) {}
+  String(float v, unsigned int digits = 2) : s(format("%.*f", digits, (double)v)) {}
+  String(double v, unsigned int digits = 2) : s(format("%.*f", digits, v)) {}
+
+  unsigned int length() const { return s.size(); }
+  const char *c_str() const { return s.c_str(); }
+  bool isEmpty() const { return s.empty(); }
+  bool reserve(unsigned int n)
+  {
+    s.reserve(n);
+    return true;
+  }
+
+  char operator[](unsigned int i) const { return i < s.size() ? s[i] : 0; }
+  char &operator[](unsigned int i) { return s[i]; }
+  char charAt(unsigned int i) const { return (*this)[i]; }
+
+  bool operator==(const String &o) const { return s == o.s; }
+  bool operator==(const char *o) const { return s == (o ? o : ""); }
+  bool operator!=(const String &o) const { return s != o.s; }
+  bool operator!=(const char *o) const { return !(*this == o); }
+  bool operator<(const String &o) const { return s < o.s; }
+  bool equals(const String &o) const { return s == o.s; }
+
+  bool concat(const String &o)
+  {
+    s += o.s;
+    return true;
+  }
+  bool concat(const char *o)
+  {
+    if (o)
+      s += o;
+    return true;
+  }
+  bool concat(const char *o, unsigned int n)
+  {
+    s.append(o, n);
+    return true;
+  }
+  bool concat(char o)
+  {
+    s += o;
+    return true;
+  }
+  template <class T>
+  String &operator+=(const T &o)
+  {
+    concat(String(o));
+    return *this;
+  }
+  String &operator+=(const String &o)
+  {
+    concat(o);
+    return *this;
+  }
+  String &operator+=(const char *o)
+  {
+    concat(o);
+    return *this;
+  }
+  String &operator+=(char o)
+  {
+    concat(o);
+    return *this;
+  }
+
+  int indexOf(char c, unsigned int from = 0) const { return found(s.find(c, from)); }
+  int indexOf(const String &c, unsigned int from = 0) const { return found(s.find(c.s, from)); }
+  int lastIndexOf(char c) const { return found(s.rfind(c)); }
+  int lastIndexOf(const String &c) const { return found(s.rfind(c.s)); }
+  String substring(unsigned int from) const { return from >= s.size() ? String() : String(s.substr(from)); }
+  String substring(unsigned int from, unsigned int to) const
+  {
+    if (from > to)
+    {
+      unsigned int t = from;
+      from = to;
+      to = t;
+    }
+    if (from >= s.size())
+      return String();
+    return String(s.substr(from, to - from));
+  }
+  bool startsWith(const String &p) const { return s.compare(0, p.s.size(), p.s) == 0; }
+  bool endsWith(const String &p) const { return s.size() >= p.s.size() && s.compare(s.size() - p.s.size(), p.s.size(), p.s) == 0; }
+
+  void trim()
+  {
+    size_t a = s.find_first_not_of(" \t\r\n");
+    size_t b = s.find_last_not_of(" \t\r\n");
+    s = a == std::string::npos ? std::string() : s.substr(a, b - a + 1);
+  }
+  void toLowerCase()
+  {
+    for (char &c : s)
+      c = tolower((unsigned char)c);
+  }
+  void toUpperCase()
+  {
+    for (char &c : s)
+      c = toupper((unsigned char)c);
+  }
+  void replace(const String &from, const String &to)
+  {
+    if (from.s.empty())
+      return;
+    for (size_t at = s.find(from.s); at != std::string::npos; at = s.find(from.s, at + to.s.size()))
+      s.replace(at, from.s.size(), to.s);
+  }
+  void remove(unsigned int index, unsigned int count = (unsigned int)-1)
+  {
+    if (index < s.size())
+      s.erase(index, count);
+  }
+
+  long toInt() const { return atol(s.c_str()); }
+  float toFloat() const { return atof(s.c_str()); }
+  double toDouble() const { return atof(s.c_str()); }
+  void toCharArray(char *buffer, unsigned int size) const { getBytes((unsigned char *)buffer, size); }
+  void getBytes(unsigned char *buffer, unsigned int size) const
+  {
+    if (size == 0)
+      return;
+    size_t n = s.size() < size - 1 ? s.size() : size - 1;
+    memcpy(buffer, s.data(), n);
+    buffer[n] = 0;
+  }
+
+private:
+  std::string s;
+
+  static int found(size_t at) { return at == std::string::npos ? -1 : (int)at; }
+  static std::string format(const char *fmt, ...)
+  {
+    char buffer[48];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return buffer;
+  }
+};
+
+// ArduinoJson names this type when String support is enabled
+class StringSumHelper : public String
+{
+public:
+  using String::String;
+};
+
+template <class T>
+String operator+(const String &a, const T &b)
+{
+  String r(a);
+  r += b;
+  return r;
+}
+inline String operator+(const char *a, const String &b)
+{
+  String r(a);
+  r += b;
+  return r;
+}
+
+class Print;
+
+class Printable
+{
+public:
+  virtual ~Printable() {}
+  virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print
+{
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t) { return 1; }
+  virtual size_t write(const uint8_t *buffer, size_t size)
+  {
+    size_t n = 0;
+    while (size--)
+      n += write(*buffer++);
+    return n;
+  }
+  size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+  size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+  virtual void flush() {}
+
+  size_t print(const String &s) { return write(s.c_str(), s.length()); }
+  size_t print(const char *s) { return write(s); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned int v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(unsigned long long v, int base = DEC) { return print(String(v, base)); }
+  size_t print(double v, int digits = 2) { return print(String(v, digits)); }
+  size_t print(const Printable &p) { return p.printTo(*this); }
+  template <class T>
+  size_t println(const T &v)
+  {
+    return print(v) + println();
+  }
+  template <class T>
+  size_t println(const T &v, int format)
+  {
+    return print(v, format) + println();
+  }
+  size_t println() { return write("\r\n"); }
+  size_t printf(const char *fmt, ...)
+  {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    return write(buffer, n < (int)sizeof(buffer) ? n : sizeof(buffer) - 1);
+  }
+};
+
+class Stream : public Print
+{
+public:
+  virtual int available() { return 0; }
+  virtual int read() { return -1; }
+  virtual int peek() { return -1; }
+  void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+  size_t readBytes(char *buffer, size_t length)
+  {
+    size_t n = 0;
+    for (int c; n < length && (c = read()) >= 0;)
+      buffer[n++] = (char)c;
+    return n;
+  }
+  size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+  // like the ESP32 core, these wait up to the timeout for each byte, so a read that
+  // runs out of data costs the full timeout of virtual time
+  String readString()
+  {
+    String r;
+    for (int c; (c = timedRead()) >= 0;)
+      r += (char)c;
+    return r;
+  }
+  String readStringUntil(char terminator)
+  {
+    String r;
+    for (int c; (c = timedRead()) >= 0 && c != terminator;)
+      r += (char)c;
+    return r;
+  }
+
+protected:
+  int timedRead();
+
+  unsigned long _timeout = 1000;
+};
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+// host only: called after every delay() with the new millis(), see bench/replay.cpp
+void setDelayHook(void (*hook)(unsigned long now));
+void delayMicroseconds(unsigned int us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+inline void yield() {}
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+inline long random(long max) { return max > 0 ? rand() % max : 0; }
+inline long random(long min, long max) { return min + random(max - min); }
+
+struct EspClass
+{
+  void restart();
+  uint32_t getFreeHeap() { return 0; }
+  uint64_t getEfuseMac() { return 0; }
+  uint32_t getSketchSize() { return 0; }
+  uint32_t getFreeSketchSpace() { return 0; }
+  uint32_t getCpuFreqMHz() { return 240; }
+};
+extern EspClass ESP;
+
+#include "HardwareSerial.h"
@@ -0,0 +1,15 @@
+// Host stand-in for ESP32-audioI2S: every clip "starts", nothing is decoded.
+#pragma once
+#include "FS.h"
+
+class Audio
+{
+public:
+  bool setPinout(uint8_t, uint8_t, uint8_t, int8_t = -1) { return true; }
+  void setVolume(uint8_t) {}
+  bool connecttoFS(fs::FS &, const char *, int32_t = -1) { return true; }
+  void loop() {}
+  uint32_t stopSong() { return 0; }
+  bool isRunning() { return false; }
+  uint32_t getAudioCurrentTime() { return 0; }
+};
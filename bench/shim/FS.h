@@ -0,0 +1,66 @@
+// Host stand-in for the ESP32 FS layer. There is no card, so nothing exists and
+// every open fails, unless a tool points the card at a host directory with
+// shimSdRoot(); paths are then resolved under it.
+#pragma once
+#include "Arduino.h"
+#include <memory>
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+namespace fs
+{
+struct FileImpl;
+
+class File : public Stream
+{
+public:
+  File() {}
+  explicit File(std::shared_ptr<FileImpl> impl) : impl(impl) {}
+  operator bool() const { return impl != nullptr; }
+  void close() { impl.reset(); }
+  size_t size() const;
+  size_t position() const;
+  bool seek(uint32_t position);
+  bool isDirectory();
+  File openNextFile();
+  const char *name() const;
+  const char *path() const;
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t read(uint8_t *buffer, size_t size);
+  using Print::write;
+  size_t write(uint8_t value) override { return write(&value, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override;
+  void flush() override;
+  time_t getLastWrite() { return 0; }
+  void rewindDirectory();
+
+private:
+  std::shared_ptr<FileImpl> impl;
+};
+
+class FS
+{
+public:
+  File open(const char *path, const char *mode = FILE_READ, bool create = false);
+  File open(const String &path, const char *mode = FILE_READ, bool create = false) { return open(path.c_str(), mode, create); }
+  bool exists(const char *path);
+  bool exists(const String &path) { return exists(path.c_str()); }
+  bool remove(const char *path);
+  bool remove(const String &path) { return remove(path.c_str()); }
+  bool rename(const char *from, const char *to);
+  bool rename(const String &from, const String &to) { return rename(from.c_str(), to.c_str()); }
+  bool mkdir(const char *path);
+  bool mkdir(const String &path) { return mkdir(path.c_str()); }
+  bool rmdir(const char *path);
+};
+}
+
+using fs::File;
+using fs::FS;
+
+// backs the card with a host directory; SD.begin() fails while none is set
+void shimSdRoot(const char *directory);
@@ -0,0 +1,125 @@
+// Host stand-in for HardwareSerial. UART 2 plays the modem: bytes queued with
+// inject() are what the firmware reads, and each line the firmware writes is
+// answered from the responder, the way the EC200U answers AT commands. Data the
+// firmware sends after a CONNECT without a line end (AT+QHTTPURL, AT+QHTTPGET) is
+// handed over whole once the responder has announced its length with expectRaw().
+#pragma once
+#include "Arduino.h"
+
+typedef enum
+{
+  UART_BREAK_ERROR,
+  UART_BUFFER_FULL_ERROR,
+  UART_FIFO_OVF_ERROR,
+  UART_FRAME_ERROR,
+  UART_PARITY_ERROR
+} hardwareSerial_error_t;
+
+#define HW_FLOWCTRL_CTS_RTS 3
+
+class HardwareSerial : public Stream
+{
+public:
+  // returns the modem's answer to a line written by the firmware, or nullptr
+  typedef const std::string *(*Responder)(const std::string &line);
+
+  HardwareSerial(int)
+  {
+    // sized once so the shim itself does not allocate while a benchmark runs
+    _rx.reserve(1 << 16);
+    _line.reserve(4096);
+  }
+
+  void begin(unsigned long, uint32_t = SERIAL_8N1, int8_t = -1, int8_t = -1, bool = false, unsigned long = 20000UL) {}
+  void end() {}
+  void updateBaudRate(unsigned long) {}
+  size_t setRxBufferSize(size_t n) { return n; }
+  size_t setTxBufferSize(size_t n) { return n; }
+  bool setPins(int8_t, int8_t, int8_t = -1, int8_t = -1) { return true; }
+  bool setHwFlowCtrlMode(uint8_t = 0, uint8_t = 64) { return true; }
+  void onReceive(void (*)(void), bool = false) {}
+  void onReceiveError(void (*)(hardwareSerial_error_t)) {}
+  void setRxTimeout(uint8_t) {}
+  void setRxFIFOFull(uint8_t) {}
+  operator bool() const { return true; }
+
+  int available() override { return _rx.size() - _rxPos; }
+  int read() override { return _rxPos < _rx.size() ? (uint8_t)_rx[_rxPos++] : -1; }
+  int peek() override { return _rxPos < _rx.size() ? (uint8_t)_rx[_rxPos] : -1; }
+  // like the ESP32 core, the buffer reads take the bytes directly instead of
+  // going through read() one at a time
+  size_t read(uint8_t *buffer, size_t size)
+  {
+    size_t n = min(size, _rx.size() - _rxPos);
+    memcpy(buffer, _rx.data() + _rxPos, n);
+    _rxPos += n;
+    return n;
+  }
+  size_t readBytes(uint8_t *buffer, size_t length) { return HardwareSerial::read(buffer, length); }
+  size_t readBytes(char *buffer, size_t length) { return HardwareSerial::read((uint8_t *)buffer, length); }
+
+  using Print::write;
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    for (size_t i = 0; i < size; i++)
+      HardwareSerial::write(buffer[i]);
+    return size;
+  }
+  size_t write(uint8_t c) override
+  {
+    _written++;
+    if (!_responder)
+      return 1;
+    if (_raw > 0)
+    {
+      _line += (char)c;
+      if (--_raw == 0)
+        respond();
+    }
+    else if (c == '\n')
+      respond();
+    else if (c != '\r')
+      _line += (char)c;
+    return 1;
+  }
+
+  void setResponder(Responder responder) { _responder = responder; }
+  // the next `length` bytes written go to the responder as one piece, line ends included
+  void expectRaw(size_t length) { _raw = length; }
+  void inject(const std::string &data)
+  {
+    // a line the firmware is still writing is kept
+    if (_rxPos == _rx.size())
+    {
+      _rx.clear();
+      _rxPos = 0;
+    }
+    _rx.append(data);
+  }
+  void clear()
+  {
+    _rx.clear();
+    _rxPos = 0;
+    _line.clear();
+    _raw = 0;
+  }
+  size_t written() const { return _written; }
+
+private:
+  void respond()
+  {
+    const std::string *reply = _responder(_line);
+    if (reply)
+      inject(*reply);
+    _line.clear();
+  }
+
+  std::string _rx;
+  size_t _rxPos = 0;
+  std::string _line;
+  size_t _written = 0;
+  size_t _raw = 0;
+  Responder _responder = nullptr;
+};
+
+extern HardwareSerial Serial;
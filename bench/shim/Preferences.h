@@ -0,0 +1,63 @@
+// Host stand-in for Preferences: strings are kept in memory for the run, so a tool
+// can provision the firmware before boot (see bench/replay.cpp); every other read
+// returns its default.
+#pragma once
+#include "Arduino.h"
+#include <map>
+class Preferences
+{
+public:
+  bool begin(const char *name, bool = false, const char * = NULL)
+  {
+    _namespace = name;
+    return true;
+  }
+  void end() {}
+  bool clear()
+  {
+    std::string prefix = _namespace + "/";
+    for (auto it = strings().lower_bound(prefix); it != strings().end() && it->first.compare(0, prefix.size(), prefix) == 0;)
+      it = strings().erase(it);
+    return true;
+  }
+  bool remove(const char *) { return true; }
+  bool isKey(const char *) { return false; }
+  size_t putString(const char *key, const char *v)
+  {
+    strings()[_namespace + "/" + key] = v;
+    return strlen(v);
+  }
+  size_t putString(const char *key, const String &v) { return putString(key, v.c_str()); }
+  String getString(const char *key, const String &d = String())
+  {
+    auto found = strings().find(_namespace + "/" + key);
+    return found == strings().end() ? d : String(found->second.c_str());
+  }
+  size_t putUInt(const char *, uint32_t) { return 4; }
+  uint32_t getUInt(const char *, uint32_t d = 0) { return d; }
+  size_t putInt(const char *, int32_t) { return 4; }
+  int32_t getInt(const char *, int32_t d = 0) { return d; }
+  size_t putUShort(const char *, uint16_t) { return 2; }
+  uint16_t getUShort(const char *, uint16_t d = 0) { return d; }
+  size_t putUChar(const char *, uint8_t) { return 1; }
+  uint8_t getUChar(const char *, uint8_t d = 0) { return d; }
+  size_t putULong(const char *, uint32_t) { return 4; }
+  uint32_t getULong(const char *, uint32_t d = 0) { return d; }
+  size_t putULong64(const char *, uint64_t) { return 8; }
+  uint64_t getULong64(const char *, uint64_t d = 0) { return d; }
+  size_t putLong64(const char *, int64_t) { return 8; }
+  int64_t getLong64(const char *, int64_t d = 0) { return d; }
+  size_t putBool(const char *, bool) { return 1; }
+  bool getBool(const char *, bool d = false) { return d; }
+  size_t putBytes(const char *, const void *, size_t n) { return n; }
+  size_t getBytes(const char *, void *, size_t) { return 0; }
+  size_t getBytesLength(const char *) { return 0; }
+
+private:
+  std::string _namespace;
+  static std::map<std::string, std::string> &strings()
+  {
+    static std::map<std::string, std::string> values;
+    return values;
+  }
+};
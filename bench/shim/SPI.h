@@ -0,0 +1,10 @@
+#pragma once
+#include "Arduino.h"
+
+class SPIClass
+{
+public:
+  void begin(int8_t = -1, int8_t = -1, int8_t = -1, int8_t = -1) {}
+};
+
+extern SPIClass SPI;
@@ -0,0 +1,11 @@
+#pragma once
+#include "Arduino.h"
+#include "esp_wifi.h"
+#define WIFI_STA WIFI_MODE_STA
+class WiFiClass
+{
+public:
+  bool mode(wifi_mode_t) { return true; }
+  bool disconnect(bool = false, bool = false) { return true; }
+};
+inline WiFiClass WiFi;
@@ -0,0 +1,67 @@
+// Host stand-in for the legacy ESP-IDF I2S driver. Writes are accepted in full.
+#pragma once
+#include "esp_partition.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum
+{
+  I2S_NUM_0,
+  I2S_NUM_1
+} i2s_port_t;
+typedef enum
+{
+  I2S_BITS_PER_SAMPLE_16BIT = 16
+} i2s_bits_per_sample_t;
+typedef enum
+{
+  I2S_CHANNEL_MONO = 1,
+  I2S_CHANNEL_STEREO = 2
+} i2s_channel_t;
+typedef enum
+{
+  I2S_CHANNEL_FMT_RIGHT_LEFT,
+  I2S_CHANNEL_FMT_ONLY_LEFT
+} i2s_channel_fmt_t;
+typedef enum
+{
+  I2S_COMM_FORMAT_STAND_I2S = 1
+} i2s_comm_format_t;
+
+#define I2S_MODE_MASTER 1
+#define I2S_MODE_TX 4
+#define I2S_PIN_NO_CHANGE -1
+
+typedef struct
+{
+  int mode;
+  int sample_rate;
+  i2s_bits_per_sample_t bits_per_sample;
+  i2s_channel_fmt_t channel_format;
+  i2s_comm_format_t communication_format;
+  int intr_alloc_flags;
+  int dma_buf_count;
+  int dma_buf_len;
+  bool use_apll;
+  bool tx_desc_auto_clear;
+  int fixed_mclk;
+} i2s_config_t;
+
+typedef struct
+{
+  int mck_io_num;
+  int bck_io_num;
+  int ws_io_num;
+  int data_out_num;
+  int data_in_num;
+} i2s_pin_config_t;
+
+inline esp_err_t i2s_driver_install(i2s_port_t, const i2s_config_t *, int, void *) { return ESP_OK; }
+inline esp_err_t i2s_driver_uninstall(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_set_pin(i2s_port_t, const i2s_pin_config_t *) { return ESP_OK; }
+inline esp_err_t i2s_set_clk(i2s_port_t, uint32_t, uint32_t, i2s_channel_t) { return ESP_OK; }
+inline esp_err_t i2s_zero_dma_buffer(i2s_port_t) { return ESP_OK; }
+inline esp_err_t i2s_write(i2s_port_t, const void *, size_t size, size_t *written, TickType_t)
+{
+  *written = size;
+  return ESP_OK;
+}
@@ -0,0 +1,4 @@
+#pragma once
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+#define RTC_DATA_ATTR
@@ -0,0 +1,10 @@
+#pragma once
+#include "esp_partition.h"
+#define APP_ELF_SHA256_SZ 65
+#define ESP_CORE_DUMP_TASK_NAME_LEN 16
+#define ESP_CORE_DUMP_BT_MAX 16
+typedef struct { uint32_t bt[ESP_CORE_DUMP_BT_MAX]; uint32_t depth; bool corrupted; } esp_core_dump_bt_info_t;
+typedef struct { uint32_t exc_tcb; char exc_task[ESP_CORE_DUMP_TASK_NAME_LEN]; uint32_t exc_pc; esp_core_dump_bt_info_t exc_bt_info; uint32_t core_dump_version; uint8_t app_elf_sha256[APP_ELF_SHA256_SZ]; } esp_core_dump_summary_t;
+esp_err_t esp_core_dump_image_get(size_t *, size_t *);
+esp_err_t esp_core_dump_image_erase();
+esp_err_t esp_core_dump_get_summary(esp_core_dump_summary_t *);
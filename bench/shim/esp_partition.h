@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_FAIL -1
+#define SPI_FLASH_SEC_SIZE 4096
+typedef struct { uint32_t address; uint32_t size; char label[17]; } esp_partition_t;
+esp_err_t esp_partition_read(const esp_partition_t *, size_t, void *, size_t);
+esp_err_t esp_partition_write(const esp_partition_t *, size_t, const void *, size_t);
+esp_err_t esp_partition_erase_range(const esp_partition_t *, size_t, size_t);
+const esp_partition_t *esp_partition_find_first(int, int, const char *);
+esp_err_t spi_flash_read(size_t, void *, size_t);
+// host only: the contents of a partition the firmware wrote, see bench/ota.cpp
+const uint8_t *shimPartitionData(const esp_partition_t *partition);
@@ -0,0 +1,7 @@
+#pragma once
+#include "esp_partition.h"
+#include <stdbool.h>
+esp_err_t esp_task_wdt_init(uint32_t, bool);
+esp_err_t esp_task_wdt_add(void *);
+esp_err_t esp_task_wdt_reset();
+esp_err_t esp_task_wdt_delete(void *);
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xffffffffUL
+#define pdMS_TO_TICKS(x) (x)
+#define BIT0 1
+#define BIT1 2
+#define BIT2 4
+#define BIT3 8
+#define portMUX_INITIALIZER_UNLOCKED {0}
+typedef struct { int x; } portMUX_TYPE;
+#define portENTER_CRITICAL(m)
+#define portEXIT_CRITICAL(m)
@@ -0,0 +1,6 @@
+#pragma once
+#include <stddef.h>
+typedef enum { MBEDTLS_MD_NONE, MBEDTLS_MD_SHA256 } mbedtls_md_type_t;
+typedef struct { mbedtls_md_type_t type; } mbedtls_md_info_t;
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t);
+int mbedtls_md_hmac(const mbedtls_md_info_t *, const unsigned char *, size_t, const unsigned char *, size_t, unsigned char *);
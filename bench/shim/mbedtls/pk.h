@@ -0,0 +1,8 @@
+#pragma once
+#include <stddef.h>
+#include "md.h"
+typedef struct { void *key; } mbedtls_pk_context;
+void mbedtls_pk_init(mbedtls_pk_context *);
+void mbedtls_pk_free(mbedtls_pk_context *);
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *, const unsigned char *, size_t);
+int mbedtls_pk_verify(mbedtls_pk_context *, mbedtls_md_type_t, const unsigned char *, size_t, const unsigned char *, size_t);
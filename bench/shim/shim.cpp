@@ -0,0 +1,296 @@
+// Definitions behind the host shim headers. Hardware calls succeed without doing
+// anything, except where the firmware reads back what it wrote (GPIO levels, the
+// update partition, the card once shimSdRoot() gives it a directory). Built with SHIM_OPENSSL, SHA-256, HMAC and signature checks
+// are real; otherwise digests are zero and every signature is rejected.
+#include "Arduino.h"
+#include "SD.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_task_wdt.h"
+#include "esp_core_dump.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "mbedtls/md.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#ifdef SHIM_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/pem.h>
+#endif
+
+static unsigned long virtualMicros = 0;
+static uint8_t pinLevels[64];
+static void (*delayHook)(unsigned long now) = nullptr;
+// the OTA update partition; erased sectors read 0xFF and writes only clear bits, as
+// on flash, so a chunk written without its erase shows up as corrupt
+static const esp_partition_t updatePartition = {0x110000, 0x180000, "ota_1"};
+static std::vector<uint8_t> updateFlash(updatePartition.size, 0xFF);
+
+HardwareSerial Serial(0);
+SDFS SD;
+SPIClass SPI;
+EspClass ESP;
+
+unsigned long millis() { return virtualMicros / 1000; }
+unsigned long micros() { return virtualMicros; }
+void delay(unsigned long ms)
+{
+  virtualMicros += ms * 1000;
+  if (delayHook)
+    delayHook(millis());
+}
+void setDelayHook(void (*hook)(unsigned long now)) { delayHook = hook; }
+int Stream::timedRead()
+{
+  unsigned long start = millis();
+  int c;
+  while ((c = read()) < 0 && millis() - start < _timeout)
+    delay(1);
+  return c;
+}
+void delayMicroseconds(unsigned int us) { virtualMicros += us; }
+void pinMode(uint8_t, uint8_t) {}
+void digitalWrite(uint8_t pin, uint8_t value) { pinLevels[pin % 64] = value; }
+int digitalRead(uint8_t pin) { return pinLevels[pin % 64]; }
+
+void EspClass::restart()
+{
+  fprintf(stderr, "firmware called ESP.restart()\n");
+  exit(3);
+}
+
+esp_reset_reason_t esp_reset_reason() { return ESP_RST_POWERON; }
+esp_err_t esp_task_wdt_init(uint32_t, bool) { return ESP_OK; }
+esp_err_t esp_task_wdt_add(void *) { return ESP_OK; }
+esp_err_t esp_task_wdt_reset() { return ESP_OK; }
+esp_err_t esp_task_wdt_delete(void *) { return ESP_OK; }
+
+esp_err_t esp_core_dump_image_get(size_t *, size_t *) { return ESP_FAIL; }
+esp_err_t esp_core_dump_image_erase() { return ESP_OK; }
+esp_err_t esp_core_dump_get_summary(esp_core_dump_summary_t *) { return ESP_FAIL; }
+
+const esp_partition_t *esp_ota_get_next_update_partition(const esp_partition_t *) { return &updatePartition; }
+const esp_partition_t *esp_ota_get_running_partition() { return nullptr; }
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t *partition) { return partition == &updatePartition ? ESP_OK : ESP_FAIL; }
+esp_err_t esp_ota_mark_app_valid_cancel_rollback() { return ESP_OK; }
+esp_err_t esp_ota_get_state_partition(const esp_partition_t *, esp_ota_img_states_t *) { return ESP_FAIL; }
+esp_err_t esp_ota_mark_app_invalid_rollback_and_reboot() { return ESP_FAIL; }
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t offset, void *data, size_t length)
+{
+  if (partition != &updatePartition || offset + length > partition->size)
+    return ESP_FAIL;
+  memcpy(data, updateFlash.data() + offset, length);
+  return ESP_OK;
+}
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t offset, const void *data, size_t length)
+{
+  if (partition != &updatePartition || offset + length > partition->size)
+    return ESP_FAIL;
+  for (size_t i = 0; i < length; i++)
+    updateFlash[offset + i] &= ((const uint8_t *)data)[i];
+  return ESP_OK;
+}
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t length)
+{
+  if (partition != &updatePartition || offset % SPI_FLASH_SEC_SIZE || length % SPI_FLASH_SEC_SIZE || offset + length > partition->size)
+    return ESP_FAIL;
+  memset(updateFlash.data() + offset, 0xFF, length);
+  return ESP_OK;
+}
+const uint8_t *shimPartitionData(const esp_partition_t *partition) { return partition == &updatePartition ? updateFlash.data() : nullptr; }
+
+// the card: an open file or directory under sdRoot
+static std::string sdRoot;
+
+struct fs::FileImpl
+{
+  std::string path;
+  std::string name;
+  FILE *file = nullptr;
+  DIR *dir = nullptr;
+  ~FileImpl()
+  {
+    if (file)
+      fclose(file);
+    if (dir)
+      closedir(dir);
+  }
+};
+
+void shimSdRoot(const char *directory) { sdRoot = directory; }
+bool SDFS::begin(uint8_t, SPIClass &, uint32_t, const char *, uint8_t, bool) { return !sdRoot.empty(); }
+
+static std::string hostPath(const char *path) { return sdRoot + (path[0] == '/' ? "" : "/") + path; }
+
+fs::File fs::FS::open(const char *path, const char *mode, bool)
+{
+  if (sdRoot.empty())
+    return File();
+  auto impl = std::make_shared<FileImpl>();
+  impl->path = path;
+  impl->name = impl->path.substr(impl->path.rfind('/') + 1);
+  std::string host = hostPath(path);
+  struct stat info;
+  if (!strcmp(mode, FILE_READ) && stat(host.c_str(), &info) == 0 && S_ISDIR(info.st_mode))
+    impl->dir = opendir(host.c_str());
+  else
+    impl->file = fopen(host.c_str(), (std::string(mode) + "b").c_str());
+  return impl->file || impl->dir ? File(impl) : File();
+}
+
+bool fs::FS::exists(const char *path)
+{
+  struct stat info;
+  return !sdRoot.empty() && stat(hostPath(path).c_str(), &info) == 0;
+}
+bool fs::FS::remove(const char *path) { return !sdRoot.empty() && ::unlink(hostPath(path).c_str()) == 0; }
+bool fs::FS::rename(const char *from, const char *to) { return !sdRoot.empty() && ::rename(hostPath(from).c_str(), hostPath(to).c_str()) == 0; }
+bool fs::FS::mkdir(const char *path) { return !sdRoot.empty() && ::mkdir(hostPath(path).c_str(), 0755) == 0; }
+bool fs::FS::rmdir(const char *path) { return !sdRoot.empty() && ::rmdir(hostPath(path).c_str()) == 0; }
+
+size_t fs::File::size() const
+{
+  struct stat info;
+  return impl && impl->file && fstat(fileno(impl->file), &info) == 0 ? info.st_size : 0;
+}
+size_t fs::File::position() const { return impl && impl->file ? ftell(impl->file) : 0; }
+bool fs::File::seek(uint32_t position) { return impl && impl->file && fseek(impl->file, position, SEEK_SET) == 0; }
+bool fs::File::isDirectory() { return impl && impl->dir; }
+const char *fs::File::name() const { return impl ? impl->name.c_str() : ""; }
+const char *fs::File::path() const { return impl ? impl->path.c_str() : ""; }
+int fs::File::available() { return impl && impl->file ? size() - position() : 0; }
+int fs::File::read() { return impl && impl->file ? fgetc(impl->file) : -1; }
+int fs::File::peek()
+{
+  int c = read();
+  if (c >= 0)
+    ungetc(c, impl->file);
+  return c;
+}
+size_t fs::File::read(uint8_t *buffer, size_t size) { return impl && impl->file ? fread(buffer, 1, size, impl->file) : 0; }
+size_t fs::File::write(const uint8_t *buffer, size_t size) { return impl && impl->file ? fwrite(buffer, 1, size, impl->file) : 0; }
+void fs::File::flush()
+{
+  if (impl && impl->file)
+    fflush(impl->file);
+}
+void fs::File::rewindDirectory()
+{
+  if (impl && impl->dir)
+    rewinddir(impl->dir);
+}
+
+fs::File fs::File::openNextFile()
+{
+  if (!impl || !impl->dir)
+    return File();
+  for (dirent *entry; (entry = readdir(impl->dir));)
+  {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+    {
+      std::string child = impl->path;
+      child.append("/").append(entry->d_name);
+      return SD.open(child.c_str());
+    }
+  }
+  return File();
+}
+const esp_partition_t *esp_partition_find_first(int, int, const char *) { return nullptr; }
+esp_err_t spi_flash_read(size_t, void *, size_t) { return ESP_FAIL; }
+
+EventGroupHandle_t xEventGroupCreate() { return nullptr; }
+EventBits_t xEventGroupSetBits(EventGroupHandle_t, EventBits_t bits) { return bits; }
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t, EventBits_t bits, BaseType_t, BaseType_t, TickType_t) { return bits; }
+EventBits_t xEventGroupGetBits(EventGroupHandle_t) { return 0; }
+QueueHandle_t xQueueCreate(UBaseType_t, UBaseType_t) { return nullptr; }
+BaseType_t xQueueSend(QueueHandle_t, const void *, TickType_t) { return pdFALSE; }
+BaseType_t xQueueReceive(QueueHandle_t, void *, TickType_t) { return pdFALSE; }
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *, BaseType_t) { return pdFALSE; }
+BaseType_t xTaskCreate(TaskFunction_t, const char *, uint32_t, void *, UBaseType_t, TaskHandle_t *) { return pdFALSE; }
+void vTaskDelete(TaskHandle_t) {}
+void vTaskDelay(TickType_t ticks) { delay(ticks); }
+
+#ifdef SHIM_OPENSSL
+void mbedtls_sha256_init(mbedtls_sha256_context *ctx) { ctx->state = EVP_MD_CTX_new(); }
+void mbedtls_sha256_free(mbedtls_sha256_context *ctx)
+{
+  EVP_MD_CTX_free((EVP_MD_CTX *)ctx->state);
+  ctx->state = nullptr;
+}
+int mbedtls_sha256_starts(mbedtls_sha256_context *ctx, int) { return EVP_DigestInit_ex((EVP_MD_CTX *)ctx->state, EVP_sha256(), nullptr) == 1 ? 0 : -1; }
+int mbedtls_sha256_update(mbedtls_sha256_context *ctx, const unsigned char *input, size_t length) { return EVP_DigestUpdate((EVP_MD_CTX *)ctx->state, input, length) == 1 ? 0 : -1; }
+int mbedtls_sha256_finish(mbedtls_sha256_context *ctx, unsigned char *output) { return EVP_DigestFinal_ex((EVP_MD_CTX *)ctx->state, output, nullptr) == 1 ? 0 : -1; }
+int mbedtls_sha256(const unsigned char *input, size_t length, unsigned char *output, int)
+{
+  return EVP_Digest(input, length, output, nullptr, EVP_sha256(), nullptr) == 1 ? 0 : -1;
+}
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type)
+{
+  static const mbedtls_md_info_t sha256 = {MBEDTLS_MD_SHA256};
+  return type == MBEDTLS_MD_SHA256 ? &sha256 : nullptr;
+}
+int mbedtls_md_hmac(const mbedtls_md_info_t *, const unsigned char *key, size_t keyLength, const unsigned char *input, size_t length, unsigned char *output)
+{
+  return HMAC(EVP_sha256(), key, keyLength, input, length, output, nullptr) ? 0 : -1;
+}
+
+void mbedtls_pk_init(mbedtls_pk_context *ctx) { ctx->key = nullptr; }
+void mbedtls_pk_free(mbedtls_pk_context *ctx)
+{
+  EVP_PKEY_free((EVP_PKEY *)ctx->key);
+  ctx->key = nullptr;
+}
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *ctx, const unsigned char *key, size_t length)
+{
+  // the length counts the terminating NUL of a PEM key, as in mbedtls
+  BIO *bio = BIO_new_mem_buf(key, length - 1);
+  ctx->key = PEM_read_bio_PUBKEY(bio, nullptr, nullptr, nullptr);
+  BIO_free(bio);
+  return ctx->key ? 0 : -1;
+}
+int mbedtls_pk_verify(mbedtls_pk_context *ctx, mbedtls_md_type_t, const unsigned char *hash, size_t hashLength, const unsigned char *signature, size_t signatureLength)
+{
+  EVP_PKEY_CTX *verify = ctx->key ? EVP_PKEY_CTX_new((EVP_PKEY *)ctx->key, nullptr) : nullptr;
+  bool valid = verify && EVP_PKEY_verify_init(verify) == 1 && EVP_PKEY_CTX_set_signature_md(verify, EVP_sha256()) == 1 &&
+               EVP_PKEY_verify(verify, signature, signatureLength, hash, hashLength) == 1;
+  EVP_PKEY_CTX_free(verify);
+  return valid ? 0 : -1;
+}
+#else
+void mbedtls_sha256_init(mbedtls_sha256_context *) {}
+void mbedtls_sha256_free(mbedtls_sha256_context *) {}
+int mbedtls_sha256_starts(mbedtls_sha256_context *, int) { return 0; }
+int mbedtls_sha256_update(mbedtls_sha256_context *, const unsigned char *, size_t) { return 0; }
+int mbedtls_sha256_finish(mbedtls_sha256_context *, unsigned char *output)
+{
+  memset(output, 0, 32);
+  return 0;
+}
+int mbedtls_sha256(const unsigned char *, size_t, unsigned char *output, int)
+{
+  memset(output, 0, 32);
+  return 0;
+}
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type)
+{
+  static const mbedtls_md_info_t sha256 = {MBEDTLS_MD_SHA256};
+  return type == MBEDTLS_MD_SHA256 ? &sha256 : nullptr;
+}
+int mbedtls_md_hmac(const mbedtls_md_info_t *, const unsigned char *, size_t, const unsigned char *, size_t, unsigned char *output)
+{
+  memset(output, 0, 32);
+  return 0;
+}
+
+void mbedtls_pk_init(mbedtls_pk_context *) {}
+void mbedtls_pk_free(mbedtls_pk_context *) {}
+int mbedtls_pk_parse_public_key(mbedtls_pk_context *, const unsigned char *, size_t) { return -1; }
+int mbedtls_pk_verify(mbedtls_pk_context *, mbedtls_md_type_t, const unsigned char *, size_t, const unsigned char *, size_t) { return -1; }
+#endif
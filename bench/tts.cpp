@@ -0,0 +1,61 @@
+/**
+ * Feeds hostile alert text to the firmware's speakViaModem() in main.cpp compiled
+ * for the host and checks the exact lines written to the modem UART:
+ *
+ *   tts
+ *
+ * The text of a TTS alert comes from the broker and from peers. A CR or LF in it
+ * must not end AT+QTTS early and have the rest run as modem commands, and the line
+ * must hold only printable ASCII and whole UTF-8 characters. Exits 1 on any
+ * difference, so the build runs it as a check.
+ */
+#include "firmware.h"
+
+#include <vector>
+
+static const std::string ok = "OK\r\n";
+static std::vector<std::string> written;
+
+static const std::string *answer(const std::string &line)
+{
+  written.push_back(line);
+  return &ok;
+}
+
+struct TtsCase
+{
+  const char *name;
+  std::string text;
+  std::string line;
+};
+
+int main()
+{
+  const std::string namaste = "\xE0\xA4\xA8\xE0\xA4\xAE\xE0\xA4\xB8\xE0\xA5\x8D\xE0\xA4\xA4\xE0\xA5\x87";
+  const TtsCase cases[] = {
+      {"line ends", "Evacuate now.\r\nAT+QFDEL=\"*\"\r\nAT+QMTDISC=0",
+       "AT+QTTS=2,\"Evacuate now.  AT+QFDEL=*  AT+QMTDISC=0\""},
+      {"control bytes", "Move\tuphill\x7F\x1B[0m now",
+       "AT+QTTS=2,\"Move uphill [0m now\""},
+      {"utf-8", "Alert: " + namaste + " \xC2\xB0" "C", "AT+QTTS=2,\"Alert: " + namaste + " \xC2\xB0" "C\""},
+      {"stray bytes", "Flood\xFF\xC0\xAF \xE0\xA4 warning\xE0", "AT+QTTS=2,\"Flood  warning\""},
+      {"truncation", std::string(TTS_MAX_TEXT - 1, 'a') + namaste, "AT+QTTS=2,\"" + std::string(TTS_MAX_TEXT - 1, 'a') + "\""},
+  };
+
+  LTE_Serial.setResponder(answer);
+  int failures = 0;
+  for (const TtsCase &test : cases)
+  {
+    written.clear();
+    speakViaModem(test.text.c_str());
+    if (written.size() != 1 || written[0] != test.line)
+    {
+      printf("FAILED %s: %zu lines written\n", test.name, written.size());
+      for (const std::string &line : written)
+        printf("  %s\n", line.c_str());
+      failures++;
+    }
+  }
+  printf("%d of %zu TTS lines as expected\n", (int)(sizeof(cases) / sizeof(cases[0])) - failures, sizeof(cases) / sizeof(cases[0]));
+  return failures > 0 ? 1 : 0;
+}
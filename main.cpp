@@ -4,6 +4,24 @@
 #include "SD.h"
 #include "FS.h"
 #include "HardwareSerial.h"
+#include <Preferences.h>
+#include "esp_ota_ops.h"
+#include "mbedtls/sha256.h"
+#include "mbedtls/pk.h"
+#include "esp_attr.h"
+#include "esp_system.h"
+#include "esp_task_wdt.h"
+#include "esp_core_dump.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/event_groups.h"
+#include "driver/i2s.h"
+#include <WiFi.h>
+#include "esp_wifi.h"
+#include "esp_now.h"
+#include "mbedtls/md.h"
+#include <atomic>
 
 // microSD Card Reader connections
 #define I2S_DOUT 26
@@ -18,6 +36,9 @@
 
 #define EC_RX 16
 #define EC_TX 17
+// GPIOs wired to the modem RTS/CTS lines; hardware flow control stays off while -1
+#define EC_RTS -1
+#define EC_CTS -1
 
 //peripheral devices
 #define UserSwitch 22
@@ -25,11 +46,766 @@
 #define OnboardLED 5
 
 #define BAUDRATE 115200
+#define LTE_FAST_BAUD 921600
+#define LTE_RX_BUFFER 16384
 
-HardwareSerial LTE_Serial(2);
+// console logging: messages above LOG_LEVEL are compiled out, the rest are copied
+// into a ring of LOG_SLOTS slots and written to Serial by a low-priority task
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+#define LOG_SLOTS 256
+#define LOG_SLOT_SIZE 64
+#define LOG_MAX_LINE 512
+#define LOG_TASK_PRIORITY 1
+#define LOG_DRAIN_INTERVAL 20
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logPrintf(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void)0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logPrintf(__VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void)0)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logPrintf(__VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+// AT traffic is logged without formatting, so the hot path only copies it
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logPrintf(__VA_ARGS__)
+#define LOG_TRAFFIC(prefix, text) logWrite(prefix, strlen(prefix), (text).c_str(), (text).length())
+#else
+#define LOG_DEBUG(...) ((void)0)
+#define LOG_TRAFFIC(prefix, text) ((void)0)
+#endif
+
+// provisioning defaults, used when neither NVS nor the SD card provide a value
+#define DEFAULT_DEVICE_ID "1"
+#define DEFAULT_CLIENT_ID "M26_0206"
+#define DEFAULT_APN "" // empty selects the APN from the SIM operator
+#define DEFAULT_BROKER_HOST "a3egi4f3zufw8w-ats.iot.us-east-1.amazonaws.com"
+#define DEFAULT_BROKER_PORT 8883
+#define DEFAULT_RELAY_KEY "" // empty leaves the ESP-NOW relay off
+#define DEFAULT_CLEAN_SESSION 0 // 0 has the broker keep the session and queue QoS1 alerts
+#define DEFAULT_KEEPALIVE 60
+#define CONFIG_FILE "/config.json"
+#define CONFIG_NAMESPACE "provision"
+
+// network attach
+#define AT_TIMEOUT 3000
+#define REG_POLL_INTERVAL 1000
+#define REG_TIMEOUT 60000
+#define COPS_SCAN_TIMEOUT 180000
+#define FALLBACK_APN "internet"
+
+// link monitor
+#define LINK_HISTORY 16
+#define LINK_SAMPLE_GOOD 60000
+#define LINK_SAMPLE_POOR 15000
+#define STATUS_COALESCE_WINDOW 30000
+#define PUBACK_TIMEOUT_GOOD 5000
+#define PUBACK_TIMEOUT_POOR 20000
+
+// inbound command limits, see COMMAND_LIMITS; alerts are never limited
+#define COMMAND_LIMIT_COUNT 8
+#define COMMAND_QUEUE_SIZE 8 // commands with a payload waiting for commandLoop()
+#define RECEIVE_BURST 8 // +QMTRECV messages taken from the UART per loop() pass
+
+// over-the-air update
+// 32 KB per ranged GET: ~2.8 s of payload at 115200 baud (~0.4 s at LTE_FAST_BAUD)
+// against ~0.5 s of QHTTPGET/QHTTPREAD round trips, and a whole number of 4 KB
+// flash sectors
+#define OTA_CHUNK_SIZE 32768
+#define OTA_READ_BUFFER 1024
+#define OTA_HTTP_TIMEOUT 60
+#define OTA_MAX_FAILURES 20
+#define OTA_IDLE_BEFORE_SWAP 60000
+#define OTA_NAMESPACE "ota"
+
+// PEM public key of the release signing key (ECDSA P-256); images are rejected while empty
+#ifndef OTA_PUBLIC_KEY
+#define OTA_PUBLIC_KEY ""
+#endif
+
+// remote clip cache on the SD card
+#define CLIP_DIR "/clips"
+#define CLIP_INDEX CLIP_DIR "/index.json"
+#define CLIP_INDEX_TMP CLIP_DIR "/index.tmp"
+#define CLIP_CACHE_SLOTS 16
+#define CLIP_CACHE_BYTES (16UL * 1024 * 1024)
+#define CLIP_CHUNK_SIZE 8192
+#define CLIP_CHUNK_INTERVAL 5000
+#define CLIP_MAX_FAILURES 20
+#define CLIP_NAMESPACE "clip"
+
+// TLS credentials in the modem UFS, uploaded from CERT_DIR on the SD card under
+// names that carry the first 8 hex digits of their SHA-256
+#define CERT_DIR "/certs"
+#define CERT_NAMESPACE "certs"
+#define CERT_MAX_SIZE 8192
+#define CERT_UPLOAD_TIMEOUT 10
+#define CERT_SET_KEY "set" // NVS key of the credential set in use, see commitCerts()
+
+// UART capture: timestamped LTE_Serial traffic in numbered files under CAPTURE_DIR,
+// a new one every boot and every CAPTURE_FILE_BYTES, the oldest deleted once there
+// are CAPTURE_FILES; replayed on a host with bench/replay
+#define CAPTURE_SETTING "uart_capture"
+#define CAPTURE_DIR "/capture"
+#define CAPTURE_MAGIC "UCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_BYTES (4UL * 1024 * 1024)
+#define CAPTURE_FILES 8
+#define CAPTURE_RING 16384
+#define CAPTURE_STAGE 256
+#define CAPTURE_COALESCE_MS 5
+#define CAPTURE_TASK_PRIORITY 1
+#define CAPTURE_DRAIN_INTERVAL 50
+#define CAPTURE_RX 0
+#define CAPTURE_TX 1
+#define CAPTURE_GAP 1
+#define CAPTURE_FROM_BOOT 1
+
+// network time
+#define TIME_RESYNC_INTERVAL (6UL * 60 * 60 * 1000)
+#define TIME_RETRY_INTERVAL (5UL * 60 * 1000)
+#define NTP_SERVER "pool.ntp.org"
+#define NTP_TIMEOUT 30000
+
+// assisted GNSS
+#define AGNSS_VALIDITY_S (2UL * 60 * 60)
+#define AGNSS_RETRY_INTERVAL (10UL * 60 * 1000)
+#define AGNSS_TIMEOUT 10000
+#define AGNSS_NAMESPACE "agnss"
+#define GNSS_POLL_INTERVAL 2000
+#define GNSS_TRACK_INTERVAL 60000
+// without a fix the poll interval doubles every GNSS_SEARCH_WINDOW, up to GNSS_TRACK_INTERVAL
+#define GNSS_SEARCH_WINDOW (5UL * 60 * 1000)
+#define GNSS_MAX_BACKOFF 5
+// metres of horizontal error per unit of HDOP
+#define GNSS_UERE 5
+
+// cell tower position when there is no GNSS fix; CELL_DB_FILE is built from
+// OpenCellID by tools/cell_db.py
+#define CELL_DB_FILE "/cells.bin"
+#define CELL_NEIGHBOURS 6
+#define CELL_QUERY_TIMEOUT 300
+#define CELL_DEFAULT_RANGE 3000
+#define CELL_MIN_ACCURACY 200
+// a LOC within this long of the last cell query reuses its result
+#define CELL_CACHE_TTL 60000
+#define LOCATION_NONE 0
+#define LOCATION_CELL 1
+#define LOCATION_GNSS 2
+#define LOCATION_DOC_SIZE (JSON_OBJECT_SIZE(7) + JSON_OBJECT_SIZE(5) + 48)
+
+// supervision and crash capture
+#define WDT_TIMEOUT_S 30
+#define BOOT_LOOP_LIMIT 3
+#define HEALTHY_UPTIME 120000
+#define SIM_RETRY_LIMIT 30
+#define CRASH_DIR "/crash"
+#define CRASH_LOG_SIZE 1024
+#define CRASH_LOG_MAGIC 0xC1E2A7D5
+#define CRASH_UPLOAD_LOG 512
+#define DIAG_NAMESPACE "diag"
+
+/**
+ * The subsystem the main task is working in, kept in RTC memory so the boot after a
+ * watchdog reset or panic can tell where the firmware hung.
+ */
+enum Stage
+{
+  STAGE_BOOT,
+  STAGE_NET,
+  STAGE_GPS,
+  STAGE_AWS,
+  STAGE_RECEIVE,
+  STAGE_LINK,
+  STAGE_PUBLISH,
+  STAGE_OTA,
+  STAGE_CLIP,
+  STAGE_TIME,
+  STAGE_ALERT,
+  STAGE_RELAY
+};
+
+const char *STAGE_NAMES[] = {"BOOT", "NET", "GPS", "AWS", "RECEIVE", "LINK", "PUBLISH", "OTA", "CLIP", "TIME", "ALERT", "RELAY"};
+
+// MQTT transport: the modem's AT MQTT stack, or PubSubClient on the ESP32 over a TLS
+// socket of the modem; select with -DMQTT_TRANSPORT=1 (env:esp32dev-pubsub)
+#define MQTT_TRANSPORT_AT 0
+#define MQTT_TRANSPORT_PUBSUB 1
+#ifndef MQTT_TRANSPORT
+#define MQTT_TRANSPORT MQTT_TRANSPORT_AT
+#endif
+#define SSL_CONTEXT_ID 2
+#define SSL_CLIENT_ID 1
+#define SSL_RX_CHUNK 1024
+#define SSL_TX_CHUNK 1460
+#define SSL_POLL_INTERVAL 5000
+#define MQTT_PACKET_BUFFER 2048
+#define MQTT_INBOX_SLOTS 4
+
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+#include <PubSubClient.h>
+#endif
+
+// MQTTBENCH command
+#define MQTT_BENCH_MAX_COUNT 100
+#define MQTT_BENCH_MAX_SIZE 1024
+#define MQTT_ECHO_TIMEOUT 30000
+
+// boot pipeline
+#define MODEM_BOOT_TIMEOUT 20000
+#define MQTT_OPEN_TIMEOUT 75000
+#define MQTT_CONN_TIMEOUT 15000
+#define MQTT_SUB_TIMEOUT 15000
+#define STORAGE_READY BIT0
+
+/**
+ * Boot stages timed by bootTiming. Storage runs in its own task while the modem powers
+ * up, so stages overlap and their durations do not add up to the armed time.
+ */
+enum BootStage
+{
+  BOOT_STORAGE,
+  BOOT_MODEM,
+  BOOT_GNSS,
+  BOOT_NET,
+  BOOT_TIME,
+  BOOT_AWS,
+  BOOT_STAGES
+};
+
+const char *BOOT_STAGE_NAMES[] = {"SD", "MODEM", "GNSS", "NET", "TIME", "AWS"};
+
+// pre-transcoded alert audio, played on the second I2S port without a decoder
+#define PCM_I2S_PORT I2S_NUM_1
+#define PCM_DMA_BUFFERS 8
+#define PCM_DMA_FRAMES 256
+#define PCM_MAX_BLOCK 1024
+#define PCM_MAX_SAMPLES ((PCM_MAX_BLOCK - 4) * 2 + 1)
+#define PCM_STAGE_FRAMES 128
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IMA_ADPCM 0x0011
+
+// alert deduplication
+#define SEEN_ALERT_SLOTS 64
+#define DEDUP_NAMESPACE "dedup"
+#define CATCHUP_RETRY_INTERVAL 30000
+
+// alert delivery receipts, batched on the INFO topic
+#define RECEIPT_SLOTS 8
+#define RECEIPT_BATCH 4
+#define RECEIPT_FLUSH_DELAY 60000
+#define RECEIPT_DOC_SIZE (JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(RECEIPT_BATCH) + RECEIPT_BATCH * (JSON_ARRAY_SIZE(8) + 48))
+#define ACK_NONE 0
+#define ACK_BUTTON 1
+
+// event journal on the SD card: fixed-size records in numbered files of
+// JOURNAL_FILE_RECORDS, the oldest deleted once there are JOURNAL_FILES, with a
+// (seq, time) index entry every JOURNAL_INDEX_STRIDE records
+#define JOURNAL_DIR "/journal"
+#define JOURNAL_FILE_RECORDS 8192
+#define JOURNAL_FILES 4
+#define JOURNAL_INDEX_STRIDE 64
+#define JOURNAL_BUFFER 32
+#define JOURNAL_BATCH 16
+#define JOURNAL_FLUSH_INTERVAL 30000
+#define JOURNAL_TEXT_SIZE 12
+#define JOURNAL_REPLY_RECORDS 10
+#define JOURNAL_SCAN_LIMIT 256
+#define JOURNAL_DOC_SIZE (JSON_OBJECT_SIZE(4) + JSON_ARRAY_SIZE(JOURNAL_REPLY_RECORDS) + JOURNAL_REPLY_RECORDS * (JSON_ARRAY_SIZE(7) + JOURNAL_TEXT_SIZE + 1))
+
+// peer relay over ESP-NOW; a frame at the long-range rate takes ~4-8 ms of airtime,
+// see tools/relay_sim.py for the effect of the TTL and jitter on a whole town
+#define RELAY_CHANNEL 1
+#define RELAY_TTL 4
+#define RELAY_MAGIC 0xDB
+#define RELAY_HEADER_SIZE 8
+#define RELAY_TAG_SIZE 16
+#define RELAY_MAX_PAYLOAD (ESP_NOW_MAX_DATA_LEN - RELAY_HEADER_SIZE - RELAY_TAG_SIZE)
+#define RELAY_QUEUE_DEPTH 8
+#define RELAY_PENDING 4
+#define RELAY_JITTER_MIN 5
+#define RELAY_JITTER_MAX 60
+// frames whose origin time is further off than this are replays, in seconds
+#define RELAY_MAX_AGE 120
+#define RELAY_MAX_SKEW 30
+#define BROKER_RETRY_INTERVAL 600000
+
+// alert output
+#define ALERT_START_DEADLINE 1500
+#define TTS_REPEAT_INTERVAL 10000
+#define TTS_MAX_TEXT 200
+
+enum AlertOutput
+{
+  OUTPUT_NONE,
+  OUTPUT_I2S,
+  OUTPUT_PCM,
+  OUTPUT_MODEM
+};
+
+/**
+ * An alert the server can trigger by its message code, the clip played from the SD
+ * card and the line the modem speaks when the SD/I2S chain cannot play it.
+ */
+struct AlertClip
+{
+  const char *code;
+  const char *file;
+  const char *speech;
+};
+
+/**
+ * A TLS credential of the broker SSL context: the QSSLCFG setting, which is also its
+ * name in CERT commands, and the file name used on the SD card and, before the
+ * first rotation, in UFS.
+ */
+struct CertRole
+{
+  const char *setting;
+  const char *file;
+};
+
+/**
+ * A clip pushed over MQTT and kept in the SD cache under its SHA-256. Several codes
+ * may share one file. `used` is the value of `clipUseCounter` when the clip was last
+ * played, and drives the LRU eviction.
+ */
+struct CachedClip
+{
+  String code;
+  String sha256;
+  String file;
+  String speech;
+  uint32_t size;
+  uint32_t used;
+};
+
+/**
+ * A piece of a console message. A message takes as many consecutive slots as it
+ * needs; `length` turns non-zero once the piece is filled in, and the drain task
+ * clears it again after writing the piece out.
+ */
+struct LogSlot
+{
+  std::atomic<uint8_t> length;
+  char text[LOG_SLOT_SIZE - 1];
+};
+
+/**
+ * Delivery receipt of one alert. `startMs` and `ackMs` count from `receivedAt` and
+ * stay -1 until the alert sounds or is acknowledged. `pending` marks a receipt that
+ * changed since it was last published, `pendingSince` when it first did.
+ */
+struct AlertReceipt
+{
+  String id;
+  unsigned long receivedAt;
+  uint32_t receivedUnix;
+  long latency;
+  long startMs;
+  long ackMs;
+  uint8_t gesture;
+  uint8_t hops;
+  const char *output;
+  bool pending;
+  bool sending;
+  unsigned long pendingSince;
+};
+
+/**
+ * Event types of the journal, with what `code`, `value` and `text` hold for each.
+ */
+enum JournalEvent
+{
+  JOURNAL_BOOT = 1,    // reset reason, boot count, reset reason name
+  JOURNAL_ALERT,       // relay hops, ms since "issued" (-1 unknown), alert id
+  JOURNAL_PLAYBACK,    // AlertOutput, ms from arrival to sound, alert id
+  JOURNAL_ACK,         // gesture, ms from arrival to acknowledgement, alert id
+  JOURNAL_CONNECT,     // MQTT_TRANSPORT, ms the broker connect took
+  JOURNAL_BROKER_DOWN, // -, -, failed step
+  JOURNAL_FIX,         // aided, time to first fix in ms
+  JOURNAL_ERROR,       // -, detail, where
+  JOURNAL_LOCATION     // LOCATION_* source, accuracy in m
+};
+
+/**
+ * One journal record, 32 bytes on the card. `time` is Unix seconds, 0 when the clock
+ * was not synced, and `text` is not NUL-terminated when it fills the field.
+ */
+struct JournalRecord
+{
+  uint32_t seq;
+  uint32_t time;
+  uint32_t uptime;
+  uint8_t type;
+  uint8_t code;
+  uint16_t reserved;
+  int32_t value;
+  char text[JOURNAL_TEXT_SIZE];
+} __attribute__((packed));
+
+/**
+ * An entry of a journal file's index: the first record of a stride and its time.
+ */
+struct JournalIndexEntry
+{
+  uint32_t seq;
+  uint32_t time;
+} __attribute__((packed));
+
+/**
+ * A cell the modem reports. `area` is the TAC on LTE and the LAC on GSM.
+ */
+struct CellId
+{
+  bool lte;
+  uint16_t mcc;
+  uint16_t mnc;
+  uint32_t area;
+  uint32_t cell;
+};
+
+/**
+ * The result of one cellPosition() query, kept for CELL_CACHE_TTL.
+ */
+struct CellEstimate
+{
+  bool valid;
+  unsigned long time;
+  int count;
+  CellId serving;
+  int found;
+  float lat;
+  float lon;
+  int accuracy;
+};
+
+/**
+ * One record of CELL_DB_FILE, 24 bytes, sorted by mcc, mnc, area and cell.
+ * Coordinates are in millionths of a degree and `range` is the cell radius in
+ * metres, 0 when unknown.
+ */
+struct CellRecord
+{
+  uint16_t mcc;
+  uint16_t mnc;
+  uint32_t area;
+  uint32_t cell;
+  int32_t lat;
+  int32_t lon;
+  uint16_t range;
+  uint16_t reserved;
+} __attribute__((packed));
+
+/**
+ * Start of a UART capture file. `part` counts the files written during one boot,
+ * so the parts of a boot are replayed in order; `flags` has CAPTURE_FROM_BOOT when
+ * the capture was on from power-up rather than turned on by a command.
+ */
+struct CaptureFileHeader
+{
+  char magic[4];
+  uint8_t version;
+  uint8_t flags;
+  uint16_t part;
+  uint32_t boot;
+} __attribute__((packed));
+
+/**
+ * One run of UART bytes in one direction, followed by the `length` bytes. `time` is
+ * millis() at the first byte; `flags` has CAPTURE_GAP when records were dropped just
+ * before this one.
+ */
+struct CaptureRecord
+{
+  uint32_t time;
+  uint8_t direction;
+  uint8_t flags;
+  uint16_t length;
+} __attribute__((packed));
+
+/**
+ * An alert flooded to nearby devices over ESP-NOW. `time` is the Unix time at which
+ * the first device sent it. The tag is the HMAC-SHA256 of `time` and the payload
+ * under the provisioned relay key, truncated to RELAY_TAG_SIZE bytes; `ttl` and
+ * `hops` change at every hop and are not covered by it.
+ */
+struct RelayFrame
+{
+  uint8_t magic;
+  uint8_t ttl;
+  uint8_t hops;
+  uint8_t length;
+  uint32_t time;
+  uint8_t tag[RELAY_TAG_SIZE];
+  char payload[RELAY_MAX_PAYLOAD];
+} __attribute__((packed));
+
+typedef bool (*HttpSink)(uint32_t offset, const uint8_t *data, size_t length);
+
+// outcome of one httpGetRange() step
+enum HttpResult
+{
+  HTTP_FAILED,
+  HTTP_PENDING,
+  HTTP_COMPLETE
+};
+
+const AlertClip ALERT_CLIPS[] = {
+    {"1", "/EARTHQUAKE.mp3", "Earthquake alert. Drop, cover and hold on."},
+    {"2", "/FLOOD.mp3", "Flood alert. Move to higher ground now."},
+    {"3", "/LANDSLIDE.mp3", "Landslide alert. Move away from slopes now."},
+    {"4", "/LIGHTENINGSTRIKE.mp3", "Lightning alert. Go indoors now."},
+    {"5", "/THUNDERSTORM.mp3", "Thunderstorm alert. Stay indoors."},
+};
+
+/**
+ * Token bucket of an inbound command that costs modem or uplink time: up to `burst`
+ * requests at once, then one every `interval` ms; the rest are shed. Every one is
+ * run by commandLoop() once the inbound traffic is drained. A `coalesced` command
+ * takes no arguments, and a request arriving while one is queued is answered by it;
+ * the others are queued with their payload and run in order.
+ */
+struct CommandLimit
+{
+  const char *code;
+  unsigned long interval;
+  uint8_t burst;
+  bool coalesced;
+};
+
+const CommandLimit COMMAND_LIMITS[COMMAND_LIMIT_COUNT] = {
+    {"LOC", 10000, 3, true},
+    {"STATUS", 10000, 3, true},
+    {"LOG", 2000, 5, false},
+    {"CLIP", 10000, 3, false},
+    {"CERT", 10000, 3, false},
+    {"CAPTURE", 10000, 3, false},
+    {"OTA", 60000, 2, false},
+    {"MQTTBENCH", 60000, 1, false},
+};
+
+#define CERT_ROLE_COUNT 3
+const CertRole CERT_ROLES[CERT_ROLE_COUNT] = {
+    {"cacert", "cacert.pem"},
+    {"clientcert", "client.pem"},
+    {"clientkey", "user_key.pem"},
+};
+
+enum LinkQuality
+{
+  LINK_UNKNOWN,
+  LINK_POOR,
+  LINK_FAIR,
+  LINK_GOOD
+};
+
+/**
+ * One sample of the cellular link. Signal fields hold -999 when the serving RAT
+ * does not report them (RSRQ/SINR on GSM, for instance); `sinr` is in dB.
+ */
+struct LinkSample
+{
+  unsigned long time;
+  int rssi;
+  int rsrp;
+  int rsrq;
+  int sinr;
+  int reg;
+  unsigned long rtt;
+};
+
+void captureBytes(uint8_t direction, const uint8_t *data, size_t length);
+
+/**
+ * The modem UART, handing every byte read or written to captureBytes() as well,
+ * which returns at once while UART capture is off.
+ */
+class CaptureSerial : public HardwareSerial
+{
+public:
+  CaptureSerial(int uart) : HardwareSerial(uart) {}
+
+  int read()
+  {
+    int c = HardwareSerial::read();
+    if (c >= 0)
+    {
+      uint8_t value = c;
+      captureBytes(CAPTURE_RX, &value, 1);
+    }
+    return c;
+  }
+  size_t read(uint8_t *buffer, size_t size)
+  {
+    size_t got = HardwareSerial::read(buffer, size);
+    captureBytes(CAPTURE_RX, buffer, got);
+    return got;
+  }
+  size_t read(char *buffer, size_t size) { return read((uint8_t *)buffer, size); }
+  size_t readBytes(uint8_t *buffer, size_t length)
+  {
+    size_t got = HardwareSerial::readBytes(buffer, length);
+    captureBytes(CAPTURE_RX, buffer, got);
+    return got;
+  }
+  size_t readBytes(char *buffer, size_t length) { return readBytes((uint8_t *)buffer, length); }
+
+  using HardwareSerial::write;
+  size_t write(uint8_t value)
+  {
+    captureBytes(CAPTURE_TX, &value, 1);
+    return HardwareSerial::write(value);
+  }
+  size_t write(const uint8_t *buffer, size_t size)
+  {
+    captureBytes(CAPTURE_TX, buffer, size);
+    return HardwareSerial::write(buffer, size);
+  }
+  // for data that must not reach the card, such as a private key
+  size_t writeUncaptured(const uint8_t *buffer, size_t size) { return HardwareSerial::write(buffer, size); }
+};
+
+CaptureSerial LTE_Serial(2);
 Audio audio;
+Preferences prefs;
 
-const String DEVICE_ID = "1";
+String DEVICE_ID = DEFAULT_DEVICE_ID;
+String CLIENT_ID = DEFAULT_CLIENT_ID;
+String APN = DEFAULT_APN;
+String BROKER_HOST = DEFAULT_BROKER_HOST;
+unsigned int BROKER_PORT = DEFAULT_BROKER_PORT;
+String TOPIC_SUB = "";
+String TOPIC_INFO = "";
+String RELAY_KEY = DEFAULT_RELAY_KEY;
+bool CLEAN_SESSION = DEFAULT_CLEAN_SESSION;
+unsigned int KEEPALIVE = DEFAULT_KEEPALIVE;
+
+/**
+ * Maps the PLMN prefix of a SIM (MCC + MNC, as found at the start of the IMSI)
+ * to the operator name reported by AT+COPS and its data APN.
+ */
+struct ApnEntry
+{
+  const char *plmn;
+  const char *name;
+  const char *apn;
+};
+
+const ApnEntry APN_TABLE[] = {
+    {"40410", "airtel", "airtelgprs.com"},
+    {"40431", "airtel", "airtelgprs.com"},
+    {"40440", "airtel", "airtelgprs.com"},
+    {"40445", "airtel", "airtelgprs.com"},
+    {"40449", "airtel", "airtelgprs.com"},
+    {"40470", "airtel", "airtelgprs.com"},
+    {"40490", "airtel", "airtelgprs.com"},
+    {"40492", "airtel", "airtelgprs.com"},
+    {"40493", "airtel", "airtelgprs.com"},
+    {"40494", "airtel", "airtelgprs.com"},
+    {"40495", "airtel", "airtelgprs.com"},
+    {"40496", "airtel", "airtelgprs.com"},
+    {"40497", "airtel", "airtelgprs.com"},
+    {"40498", "airtel", "airtelgprs.com"},
+    {"40551", "airtel", "airtelgprs.com"},
+    {"40584", "jio", "jionet"},
+    {"40585", "jio", "jionet"},
+    {"40586", "jio", "jionet"},
+    {"40587", "jio", "jionet"},
+    {"40411", "vi", "www"},
+    {"40420", "vi", "www"},
+    {"40427", "vi", "www"},
+    {"40443", "vi", "www"},
+    {"40446", "vi", "www"},
+    {"40484", "vi", "www"},
+    {"40486", "vi", "www"},
+    {"40404", "idea", "www"},
+    {"40422", "idea", "www"},
+    {"40424", "idea", "www"},
+    {"40478", "idea", "www"},
+    {"40434", "bsnl", "bsnlnet"},
+    {"40438", "bsnl", "bsnlnet"},
+    {"40451", "bsnl", "bsnlnet"},
+    {"40453", "bsnl", "bsnlnet"},
+    {"40455", "bsnl", "bsnlnet"},
+    {"40457", "bsnl", "bsnlnet"},
+    {"40458", "bsnl", "bsnlnet"},
+    {"40459", "bsnl", "bsnlnet"},
+    {"40462", "bsnl", "bsnlnet"},
+    {"40464", "bsnl", "bsnlnet"},
+    {"40466", "bsnl", "bsnlnet"},
+    {"40471", "bsnl", "bsnlnet"},
+    {"40472", "bsnl", "bsnlnet"},
+    {"40473", "bsnl", "bsnlnet"},
+    {"40474", "bsnl", "bsnlnet"},
+    {"40475", "bsnl", "bsnlnet"},
+    {"40476", "bsnl", "bsnlnet"},
+    {"40477", "bsnl", "bsnlnet"},
+    {"40479", "bsnl", "bsnlnet"},
+    {"40480", "bsnl", "bsnlnet"},
+    {"40481", "bsnl", "bsnlnet"},
+};
+
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+/**
+ * Arduino Client over TLS socket SSL_CLIENT_ID of the modem in buffer access mode
+ * (AT+QSSLOPEN/QSSLSEND/QSSLRECV), so PubSubClient runs on the ESP32 while the UART
+ * stays free for the other AT commands. Received data waits in the modem until a
+ * +QSSLURC "recv" announces it, or until the next SSL_POLL_INTERVAL poll in case the
+ * URC was swallowed by another command's response.
+ */
+class ModemSslClient : public Client
+{
+public:
+  int connect(IPAddress ip, uint16_t port) { return connect(ip.toString().c_str(), port); }
+  int connect(const char *host, uint16_t port);
+  size_t write(uint8_t value) { return write(&value, 1); }
+  size_t write(const uint8_t *buffer, size_t size);
+  int available();
+  int read();
+  int read(uint8_t *buffer, size_t size);
+  int peek();
+  void flush() {}
+  void stop();
+  uint8_t connected();
+  operator bool() { return connected(); }
+
+private:
+  uint8_t rx[SSL_RX_CHUNK];
+  size_t rxHead = 0;
+  size_t rxTail = 0;
+  unsigned long lastPoll = 0;
+  String urcLine = "";
+  bool fill();
+};
+#endif
+
+// radio access modes tried in order by attachToNetwork(), see AT+QCFG="nwscanmode"
+const int RAT_SCAN_MODES[] = {0, 3, 1}; // automatic, LTE only, GSM only
+
+// AT commands pre-formatted once at boot by loadProvisioning()
+String cmdSetAPN = "";
+String cmdSession = "";
+String cmdKeepalive = "";
+String cmdOpenBroker = "";
+String cmdConnectBroker = "";
+String cmdSubscribe = "";
+String cmdPublishInfoQos0 = "";
+String cmdPublishInfoQos1 = "";
 
 unsigned long startTime = 0;
 unsigned int duration = 0;
@@ -43,8 +819,253 @@ int buttonState = HIGH;
 int lastButtonState = HIGH;
 char findJson[400];
 
+// MQTT messages that arrived while a synchronous query was reading the UART, or
+// that were not dispatched yet; a message still arriving is given up on after
+// AT_TIMEOUT from `partialSince`
+String pendingURC = "";
+bool partialWaiting = false;
+unsigned long partialSince = 0;
+
+// TLS socket state, kept from the +QSSLURC reports wherever they are read
+bool sslOpen = false;
+bool sslDataPending = false;
+
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+ModemSslClient modemSsl;
+PubSubClient mqtt(modemSsl);
+// messages from the PubSubClient callback, dispatched by receiveATCommand(1)
+String mqttInbox[MQTT_INBOX_SLOTS];
+unsigned int mqttInboxHead = 0;
+unsigned int mqttInboxCount = 0;
+#endif
+
+// MQTTBENCH run: publishing one message per loop() pass, then waiting for its ECHO probe
+bool benchPublishing = false;
+bool benchEchoPending = false;
+unsigned long benchStartedAt = 0;
+unsigned long benchEchoSentAt = 0;
+unsigned int benchCount = 0;
+unsigned int benchSent = 0;
+unsigned int benchSize = 0;
+int benchQos = 0;
+unsigned int benchFailed = 0;
+unsigned long benchMs = 0;
+String benchPad = "";
+
+LinkSample linkHistory[LINK_HISTORY];
+unsigned int linkHead = 0;
+unsigned int linkCount = 0;
+LinkQuality linkQuality = LINK_UNKNOWN;
+unsigned long lastLinkSample = 0;
+unsigned long lastPublishRtt = 0;
+bool statusPending = false;
+unsigned long statusRequestedAt = 0;
+
+// COMMAND_LIMITS state: tokens spent and when one was last refilled, commands
+// waiting for commandLoop(), and requests shed or answered by a queued one
+uint8_t commandSpent[COMMAND_LIMIT_COUNT];
+unsigned long commandRefilledAt[COMMAND_LIMIT_COUNT];
+bool commandQueued[COMMAND_LIMIT_COUNT];
+String commandQueue[COMMAND_QUEUE_SIZE];
+uint8_t commandQueueHead = 0;
+uint8_t commandQueueCount = 0;
+unsigned long commandShed[COMMAND_LIMIT_COUNT];
+unsigned long commandsCoalesced = 0;
+
+String otaUrl = "";
+String otaSha256 = "";
+String otaSignature = "";
+uint32_t otaSize = 0;
+uint32_t otaOffset = 0;
+const esp_partition_t *otaPartition = nullptr;
+bool otaActive = false;
+bool otaReady = false;
+String httpSessionUrl = "";
+unsigned int otaFailures = 0;
+
+// ranged GET the modem is working on: the sink it belongs to, when it was sent and
+// the +QHTTPGET report once it arrives, see httpGetRange()
+HttpSink httpOwner = nullptr;
+unsigned long httpSentAt = 0;
+bool httpAnswered = false;
+int httpError = 0;
+int httpStatus = 0;
+
+// console ring: producers reserve slots by advancing `logHead`, the drain task frees
+// them by advancing `logTail`; messages that do not fit are counted in `logDropped`
+LogSlot logSlots[LOG_SLOTS];
+std::atomic<uint32_t> logHead(0);
+std::atomic<uint32_t> logTail(0);
+std::atomic<uint32_t> logDropped(0);
+
+// UART capture: the main task collects bytes in `captureStage` and moves each run
+// into `captureRing` as one record, the capture task writes the ring to the SD card
+std::atomic<bool> captureOn(false);
+bool captureFromBoot = false;
+CaptureRecord captureStaged = {};
+uint8_t captureStage[CAPTURE_STAGE];
+bool captureGap = false;
+uint8_t captureRing[CAPTURE_RING];
+std::atomic<uint32_t> captureHead(0);
+std::atomic<uint32_t> captureTail(0);
+std::atomic<uint32_t> captureDropped(0);
+uint32_t captureFile = 0;
+
+// survive a panic or watchdog reset, but not a power cycle
+RTC_NOINIT_ATTR char crashLog[CRASH_LOG_SIZE];
+RTC_NOINIT_ATTR uint32_t crashLogHead;
+RTC_NOINIT_ATTR uint32_t crashLogMagic;
+RTC_NOINIT_ATTR uint32_t lastStage;
+
+uint32_t bootCount = 0;
+uint32_t unhealthyBoots = 0;
+bool safeMode = false;
+esp_reset_reason_t resetReason = ESP_RST_UNKNOWN;
+uint32_t crashStage = STAGE_BOOT;
+String crashLogText = "";
+
+EventGroupHandle_t bootEvents;
+unsigned long bootStageStart[BOOT_STAGES];
+unsigned long bootStageTime[BOOT_STAGES];
+unsigned long bootArmedMs = 0;
+bool bootHealthy = false;
+String crashReport = "";
+
+// wall clock as an offset from millis(), valid once timeSynced is set
+int64_t epochOffsetMs = 0;
+bool timeSynced = false;
+unsigned long lastTimeSync = 0;
+long lastClockSkewMs = 0;
+long lastAlertLatencyMs = 0;
+
+// GNSS session and assistance data, `agnssTime` is the Unix time of the last injection
+unsigned long gnssStart = 0;
+unsigned long gnssSearchStart = 0;
+unsigned long lastGnssPoll = 0;
+unsigned long ttffMs = 0;
+bool gnssFixed = false;
+bool gnssAided = false;
+uint32_t agnssTime = 0;
+uint32_t agnssValidity = AGNSS_VALIDITY_S;
+unsigned long lastAgnssAttempt = 0;
+unsigned long lastColdTtffMs = 0;
+unsigned long lastAidedTtffMs = 0;
+// last cell tower estimate, see cellPosition()
+CellEstimate cellEstimate = {};
+// set while the last published position is not from GNSS, so the first fix replaces it
+bool locationPending = false;
+
+// FNV-1a hashes of recently handled message IDs, oldest overwritten first
+uint32_t seenAlerts[SEEN_ALERT_SLOTS];
+unsigned int seenAlertHead = 0;
+bool seenAlertsDirty = false;
+
+// highest "seq" of the alerts taken from the broker, kept with the seen IDs, and a
+// pending request to replay the alerts after `catchupFrom`
+uint32_t alertSeq = 0;
+uint32_t catchupFrom = 0;
+bool catchupPending = false;
+unsigned long lastCatchupAttempt = 0;
+
+// event journal: records waiting in RAM for flushJournal() take their sequence number
+// when they are written
+JournalRecord journalBuffer[JOURNAL_BUFFER];
+unsigned int journalCount = 0;
+unsigned long journalOldest = 0;
+uint32_t journalSeq = 0;
+uint32_t journalDropped = 0;
+bool journalReady = false;
+
+// receipts of recent alerts; `receiptActive` is the one sounding now, -1 when none
+AlertReceipt receipts[RECEIPT_SLOTS];
+int receiptActive = -1;
+
+// ESP-NOW relay: frames queued by the WiFi task, and rebroadcasts waiting out their jitter
+const uint8_t RELAY_BROADCAST[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+bool relayReady = false;
+QueueHandle_t relayQueue = NULL;
+RelayFrame relayOutbox[RELAY_PENDING];
+unsigned long relayDue[RELAY_PENDING];
+bool relayWaiting[RELAY_PENDING];
+uint32_t relaySent = 0;
+uint32_t relayAccepted = 0;
+uint32_t relayRejected = 0;
+volatile uint32_t relayOverflows = 0;
+uint8_t relayLastHops = 0;
+// newest origin time accepted and when, the reference for relayFresh() without a clock
+uint32_t relayNewestTime = 0;
+unsigned long relayNewestAt = 0;
+bool brokerDown = false;
+unsigned long brokerDownSince = 0;
+
+bool sdReady = false;
+bool i2sReady = false;
+AlertOutput alertOutput = OUTPUT_NONE;
+bool alertStarted = false;
+String alertSpeech = "";
+unsigned long lastSpeech = 0;
+unsigned long lastAlertStartMs = 0;
+
+// WAV clip being fed to the I2S DMA ring, one ADPCM block (or raw chunk) at a time
+File pcmFile;
+uint16_t pcmFormat = 0;
+uint16_t pcmChannels = 1;
+uint16_t pcmBlockAlign = 0;
+uint32_t pcmRate = 0;
+uint32_t pcmDataLeft = 0;
+uint8_t pcmBlock[PCM_MAX_BLOCK];
+int16_t pcmSamples[PCM_MAX_SAMPLES];
+int16_t pcmStage[PCM_STAGE_FRAMES * 2];
+size_t pcmSampleCount = 0;
+size_t pcmSamplePos = 0;
+bool pcmPlaying = false;
+bool pcmDriverReady = false;
+bool pcmOwnsPins = false;
+
+const int16_t IMA_STEPS[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+const int8_t IMA_INDEX_STEP[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+CachedClip cachedClips[CLIP_CACHE_SLOTS];
+unsigned int cachedClipCount = 0;
+uint32_t clipUseCounter = 0;
+bool clipIndexDirty = false;
+String clipCode = "";
+String clipUrl = "";
+String clipSha256 = "";
+String clipSpeech = "";
+uint32_t clipSize = 0;
+File clipFile;
+unsigned long lastClipChunk = 0;
+unsigned int clipFailures = 0;
+
+// UFS file and SHA-256 of each CERT_ROLES credential in use, and of the set being
+// tried on this connect; the trial set becomes current once the broker accepts it
+String certFile[CERT_ROLE_COUNT];
+String certSha[CERT_ROLE_COUNT];
+String certTrialFile[CERT_ROLE_COUNT];
+String certTrialSha[CERT_ROLE_COUNT];
+// the credential a CERT command is downloading, certRole -1 when none
+int certRole = -1;
+String certUrl = "";
+String certSha256 = "";
+uint32_t certSize = 0;
+bool certApply = false;
+File certDownload;
+
+unsigned long modemBaud = BAUDRATE;
+volatile unsigned long uartOverflows = 0;
+
 void receiveATCommand(int flag);
 void sendATCommand(String command);
+int parseRegistrationStat(const String &response, const char *prefix);
+int parseResponseField(const String &response, const char *prefix, int field);
+void Publish_Message(const char *sentence);
+void restartDevice();
 
 /**
  * Toggles the state of a pin at a specified interval.
@@ -53,7 +1074,7 @@ void sendATCommand(String command);
  * connected. It is of type uint8_t, which is an 8-bit unsigned integer.
  * @param interval the time duration in milliseconds between each vibration.
  */
-void vibrate(uint8_t pin, long interval)
+void vibrate(uint8_t pin, unsigned long interval)
 {
   unsigned long currentMillis = millis();
 
@@ -68,125 +1089,719 @@ void vibrate(uint8_t pin, long interval)
 }
 
 /**
- * Sends an AT command to a device using a serial connection.
+ * Called from the UART event task when the driver reports a receive error. Overflows
+ * mean bytes were lost, so they are counted and reported in STATUS.
  * 
- * @param command a string that represents the AT command to be sent.
+ * @param error the error reported by the UART driver.
  */
-void sendATCommand(String command)
+void onModemRxError(hardwareSerial_error_t error)
 {
-  Serial.print("Query: ");
-  Serial.println(command);
-  LTE_Serial.println(command); // Sends AT command
+  if (error == UART_BUFFER_FULL_ERROR || error == UART_FIFO_OVF_ERROR)
+    uartOverflows++;
 }
 
 /**
- * Finds a pointer to the first occurrence of a '{' character in the given 
- * `response` string, or `nullptr` if no '{' character is found.
- * 
- * @param response a pointer to a character array that represents the response 
- * received from some source, such as a server or an API.
- * 
- * @return returns a pointer to the first occurrence of the character '{' in the input 
- * `response` string. If the character is found, the function returns a pointer to that
- * character. If the character is not found, the function returns a null pointer (`nullptr`).
+ * Queues one console line made of two parts, e.g. a prefix and a modem response, and
+ * returns at once. Any task may call it: slots are reserved with a compare-and-swap
+ * on `logHead`, so concurrent messages never interleave. A message that does not fit
+ * in the free slots is dropped and counted; one longer than LOG_MAX_LINE is cut.
  */
-const char *parseResponse(const char *response)
+void logWrite(const char *first, size_t firstLength, const char *second, size_t secondLength)
 {
-  const char *jsonStart = strchr(response, '{');
-  if (jsonStart)
-    return jsonStart;
-  else
-    return nullptr;
+  const size_t piece = LOG_SLOT_SIZE - 1;
+  firstLength = min(firstLength, (size_t)LOG_MAX_LINE - 2);
+  secondLength = min(secondLength, (size_t)LOG_MAX_LINE - 2 - firstLength);
+  size_t total = firstLength + secondLength + 2;
+  uint32_t count = (total + piece - 1) / piece;
+  uint32_t head = logHead.load(std::memory_order_relaxed);
+  do
+  {
+    if (head + count - logTail.load(std::memory_order_acquire) > LOG_SLOTS)
+    {
+      logDropped++;
+      return;
+    }
+  } while (!logHead.compare_exchange_weak(head, head + count, std::memory_order_relaxed));
+
+  size_t at = 0;
+  for (uint32_t i = 0; i < count; i++)
+  {
+    LogSlot &slot = logSlots[(head + i) % LOG_SLOTS];
+    size_t used = 0;
+    for (; used < piece && at < total; used++, at++)
+    {
+      if (at < firstLength)
+        slot.text[used] = first[at];
+      else if (at < firstLength + secondLength)
+        slot.text[used] = second[at - firstLength];
+      else
+        slot.text[used] = at == total - 2 ? '\r' : '\n';
+    }
+    slot.length.store(used, std::memory_order_release);
+  }
 }
 
 /**
- * Same as the `parseResponse` function, but for GPS location.
- * 
- * @param response a pointer to a character array that represents the GPS response.
- * 
- * @return returns a pointer to the start of the JSON data in the `response` string. If a comma is 
- * found in the `response` string, the function returns a pointer to the character immediately after 
- * the comma. If no comma is found, the function returns a null pointer (`nullptr`).
+ * Formats and queues one console line, see logWrite(). Used through the LOG_ERROR,
+ * LOG_WARN, LOG_INFO and LOG_DEBUG macros.
  */
-const char *parseLOCResponse(const char *response)
+void logPrintf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void logPrintf(const char *format, ...)
 {
-  const char *jsonStart = strchr(response, ',') + 1;
-  if (jsonStart)
-    return jsonStart;
-  else
-    return nullptr;
+  char line[LOG_MAX_LINE];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length >= 0)
+    logWrite(line, min((size_t)length, sizeof(line) - 1), "", 0);
 }
 
 /**
- * Processes a JSON message by parsing it, extracting the "message" field, and returning
- * it as a String.
- * 
- * @param jsonString a pointer to a character array that represents a JSON string.
- * 
- * @return a String object.
+ * Writes the queued console pieces to Serial, stopping at the first one that is
+ * still being filled in.
  */
-String processJsonMessage(const char *jsonString)
+void drainLog()
 {
-  if (jsonString)
+  uint32_t tail = logTail.load(std::memory_order_relaxed);
+  while (tail != logHead.load(std::memory_order_acquire))
   {
-    StaticJsonDocument<400> jsonDoc;
-    DeserializationError error = deserializeJson(jsonDoc, jsonString);
-    if (!error)
-    {
-      const char *message = jsonDoc["message"];
-      String temp(message);
-      if (message)
-      {
-        Serial.print("Received message: ");
-        Serial.println(message);
-      }
-      else
-        Serial.println("No message field in the JSON.");
-      return temp;
-    }
-    else
+    LogSlot &slot = logSlots[tail % LOG_SLOTS];
+    uint8_t length = slot.length.load(std::memory_order_acquire);
+    if (length == 0)
+      break;
+    Serial.write((const uint8_t *)slot.text, length);
+    slot.length.store(0, std::memory_order_relaxed);
+    logTail.store(++tail, std::memory_order_release);
+  }
+}
+
+/**
+ * Drains the console ring every LOG_DRAIN_INTERVAL ms, so slow Serial writes only
+ * ever block this task. Reports how many messages were dropped since the last pass.
+ */
+void logTask(void *)
+{
+  uint32_t reported = 0;
+  for (;;)
+  {
+    drainLog();
+    uint32_t dropped = logDropped.load();
+    if (dropped != reported)
     {
-      Serial.print("Failed to parse JSON: ");
-      Serial.println(error.c_str());
+      Serial.printf("[log] %lu messages dropped\r\n", (unsigned long)(dropped - reported));
+      reported = dropped;
     }
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_INTERVAL));
   }
-  else
-    Serial.println("No JSON part found in the response.");
-  return "";
 }
 
 /**
- * Sends an AT command to enable GGA NMEA sentences for GPS and waits for a response.
+ * Waits until the console ring is empty, so the last messages before a restart are
+ * not lost.
+ * 
+ * @param timeout the maximum time in milliseconds to wait.
  */
-void checkLOC()
+void flushLog(unsigned long timeout)
 {
-  sendATCommand("AT+QGPSGNMEA=\"GGA\"");
-  delay(1000);
-  receiveATCommand(3);
-  delay(500);
+  unsigned long start = millis();
+  while (logTail.load() != logHead.load() && millis() - start < timeout)
+    delay(LOG_DRAIN_INTERVAL);
+}
+
+void copyToCaptureRing(uint32_t at, const uint8_t *data, size_t length)
+{
+  size_t first = min(length, (size_t)(CAPTURE_RING - at % CAPTURE_RING));
+  memcpy(captureRing + at % CAPTURE_RING, data, first);
+  memcpy(captureRing, data + first, length - first);
+}
+
+void copyFromCaptureRing(uint32_t at, uint8_t *data, size_t length)
+{
+  size_t first = min(length, (size_t)(CAPTURE_RING - at % CAPTURE_RING));
+  memcpy(data, captureRing + at % CAPTURE_RING, first);
+  memcpy(data + first, captureRing, length - first);
 }
 
 /**
- * Takes coordinates as string and an integer limit, and converts it into a float value representing
- * the actual coordinates.
- * 
- * @param value a string that represents the coordinate value. It can contains * both whole numbers and
- * decimal numbers, separated by a dot (.). The numbers before the dot represent degrees, and the numbers
- * after the dot represent minutes.
- * @param limit determines whether the sent coordinates are latitude or longitude.
- * 
- * @return a float value, which is the result of converting the input string value into a coordinate
- * value.
+ * Moves the staged bytes into the capture ring as one record. A record that does not
+ * fit is dropped and counted, and the next one that does is marked with CAPTURE_GAP.
+ * Main task only, like every other use of the stage.
  */
-float actualCoord(String value, int limit)
+void flushCaptureStage()
 {
-  float a = 0;
-  float b = 0;
-  int counter1 = 1;
-  int counter2 = 10;
+  if (captureStaged.length == 0)
+    return;
+  uint32_t head = captureHead.load(std::memory_order_relaxed);
+  uint32_t size = sizeof(CaptureRecord) + captureStaged.length;
+  if (head + size - captureTail.load(std::memory_order_acquire) > CAPTURE_RING)
+  {
+    captureDropped++;
+    captureGap = true;
+  }
+  else
+  {
+    captureStaged.flags = captureGap ? CAPTURE_GAP : 0;
+    captureGap = false;
+    copyToCaptureRing(head, (const uint8_t *)&captureStaged, sizeof(CaptureRecord));
+    copyToCaptureRing(head + sizeof(CaptureRecord), captureStage, captureStaged.length);
+    captureHead.store(head + size, std::memory_order_release);
+  }
+  captureStaged.length = 0;
+}
+
+/**
+ * Adds UART traffic to the capture stage. Bytes in the same direction within
+ * CAPTURE_COALESCE_MS of the first one share a record, so a response read one byte
+ * at a time costs a copy per byte and one record rather than one each.
+ *
+ * @param direction CAPTURE_RX or CAPTURE_TX.
+ * @param data the bytes read from or written to the modem.
+ * @param length the number of bytes.
+ */
+void captureBytes(uint8_t direction, const uint8_t *data, size_t length)
+{
+  if (!captureOn.load(std::memory_order_relaxed) || length == 0)
+    return;
+  uint32_t now = millis();
+  while (length > 0)
+  {
+    if (captureStaged.length > 0 && (direction != captureStaged.direction || captureStaged.length == CAPTURE_STAGE || now - captureStaged.time >= CAPTURE_COALESCE_MS))
+      flushCaptureStage();
+    if (captureStaged.length == 0)
+    {
+      captureStaged.time = now;
+      captureStaged.direction = direction;
+    }
+    size_t piece = min(length, (size_t)(CAPTURE_STAGE - captureStaged.length));
+    memcpy(captureStage + captureStaged.length, data, piece);
+    captureStaged.length += piece;
+    data += piece;
+    length -= piece;
+  }
+}
+
+/**
+ * Flushes a stage that has been waiting longer than CAPTURE_COALESCE_MS, so the last
+ * response before a quiet spell reaches the card without more traffic behind it.
+ */
+void captureLoop()
+{
+  if (captureStaged.length > 0 && millis() - captureStaged.time >= CAPTURE_COALESCE_MS)
+    flushCaptureStage();
+}
+
+/**
+ * Waits until the capture task has written out everything captured so far, so the
+ * traffic that led to a restart is on the card.
+ *
+ * @param timeout the maximum time in milliseconds to wait.
+ */
+void flushCapture(unsigned long timeout)
+{
+  flushCaptureStage();
+  unsigned long start = millis();
+  while (captureTail.load() != captureHead.load() && millis() - start < timeout)
+    delay(CAPTURE_DRAIN_INTERVAL);
+}
+
+String capturePath(uint32_t file)
+{
+  return CAPTURE_DIR "/" + String(file) + ".cap";
+}
+
+/**
+ * Opens the next capture file and writes its header, deleting the file that falls
+ * out of the CAPTURE_FILES window. The first part of a boot is numbered after the
+ * newest file on the card.
+ *
+ * @param part the number of files already written during this boot.
+ *
+ * @return the open file, or a closed one if the card cannot be written.
+ */
+File openCaptureFile(uint16_t part)
+{
+  if (part == 0)
+  {
+    if (!SD.exists(CAPTURE_DIR))
+      SD.mkdir(CAPTURE_DIR);
+    long newest = -1;
+    File dir = SD.open(CAPTURE_DIR);
+    for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile())
+    {
+      String name = entry.name();
+      name = name.substring(name.lastIndexOf('/') + 1);
+      if (name.endsWith(".cap") && name.toInt() > newest)
+        newest = name.toInt();
+      entry.close();
+    }
+    dir.close();
+    captureFile = newest + 1;
+  }
+  else
+    captureFile++;
+  if (captureFile >= CAPTURE_FILES)
+    SD.remove(capturePath(captureFile - CAPTURE_FILES));
+
+  File file = SD.open(capturePath(captureFile), FILE_WRITE);
+  CaptureFileHeader header = {};
+  memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_VERSION;
+  header.flags = captureFromBoot ? CAPTURE_FROM_BOOT : 0;
+  header.part = part;
+  header.boot = bootCount;
+  if (file && file.write((const uint8_t *)&header, sizeof(header)) != sizeof(header))
+    file.close();
+  return file;
+}
+
+/**
+ * Writes the capture ring to the SD card every CAPTURE_DRAIN_INTERVAL ms, whole
+ * records only, so a file never ends inside one. The ring space is released after
+ * the file is flushed. While capture is off or there is no card the records are
+ * discarded.
+ */
+void captureTask(void *)
+{
+  // bootCount and the card are known once the storage task is done
+  xEventGroupWaitBits(bootEvents, STORAGE_READY, pdFALSE, pdTRUE, portMAX_DELAY);
+  File file;
+  uint32_t fileBytes = 0;
+  uint16_t part = 0;
+  bool gap = false;
+  uint8_t record[sizeof(CaptureRecord) + CAPTURE_STAGE];
+  for (;;)
+  {
+    uint32_t tail = captureTail.load(std::memory_order_relaxed);
+    uint32_t head = captureHead.load(std::memory_order_acquire);
+    while (tail != head)
+    {
+      CaptureRecord &header = *(CaptureRecord *)record;
+      copyFromCaptureRing(tail, record, sizeof(CaptureRecord));
+      uint32_t size = sizeof(CaptureRecord) + header.length;
+      copyFromCaptureRing(tail + sizeof(CaptureRecord), record + sizeof(CaptureRecord), header.length);
+      tail += size;
+      if (!sdReady || !captureOn)
+        continue;
+      if (file && fileBytes + size > CAPTURE_FILE_BYTES)
+        file.close();
+      if (!file)
+      {
+        file = openCaptureFile(part++);
+        fileBytes = sizeof(CaptureFileHeader);
+        if (!file)
+        {
+          LOG_ERROR("Cannot write " CAPTURE_DIR ", UART capture off");
+          captureOn = false;
+          continue;
+        }
+      }
+      if (gap)
+        header.flags |= CAPTURE_GAP;
+      gap = file.write(record, size) != size;
+      if (gap)
+      {
+        captureDropped++;
+        file.close();
+      }
+      else
+        fileBytes += size;
+    }
+    if (file)
+      file.flush();
+    captureTail.store(tail, std::memory_order_release);
+    vTaskDelay(pdMS_TO_TICKS(CAPTURE_DRAIN_INTERVAL));
+  }
+}
+
+/**
+ * Handles a CAPTURE command, {"message":"CAPTURE","on":1} or "on":0. The setting is
+ * kept in NVS, so a capture covers the following boots from power-up until it is
+ * turned off.
+ *
+ * @param command the parsed command.
+ */
+void setCapture(JsonDocument &command)
+{
+  bool on = command["on"].as<int>() != 0;
+  prefs.begin(CONFIG_NAMESPACE, false);
+  prefs.putString(CAPTURE_SETTING, on ? "1" : "0");
+  prefs.end();
+  if (!on)
+    flushCaptureStage();
+  captureOn = on;
+  LOG_INFO("UART capture %s", on ? "on" : "off");
+}
+
+/**
+ * Appends a line to the RTC crash log ring, which is dumped into the crash report
+ * if the firmware resets abnormally.
+ * 
+ * @param line the text to record.
+ */
+void crashLogAppend(const String &line)
+{
+  for (unsigned int i = 0; i <= line.length(); i++)
+  {
+    crashLog[crashLogHead] = i < line.length() ? line[i] : '\n';
+    crashLogHead = (crashLogHead + 1) % CRASH_LOG_SIZE;
+  }
+}
+
+/**
+ * Records the subsystem the main task is entering and feeds the task watchdog.
+ * 
+ * @param stage the subsystem.
+ */
+void enterStage(Stage stage)
+{
+  lastStage = stage;
+  esp_task_wdt_reset();
+}
+
+/**
+ * Sends an AT command to a device using a serial connection.
+ * 
+ * @param command a string that represents the AT command to be sent.
+ */
+void sendATCommand(String command)
+{
+  LOG_TRAFFIC("Query: ", command);
+  crashLogAppend("> " + command.substring(0, 80));
+  LTE_Serial.println(command); // Sends AT command
+}
+
+/**
+ * Notes the socket reports in a piece of modem output: data waiting in the TLS
+ * socket buffer, the TLS socket closed by the peer, or the result of a ranged GET.
+ */
+void noteSocketUrc(const String &response)
+{
+  if (response.indexOf("+QSSLURC: \"recv\"") != -1)
+    sslDataPending = true;
+  if (response.indexOf("+QSSLURC: \"closed\"") != -1)
+    sslOpen = false;
+  // +QHTTPGET: <err>[,<httprspcode>,<content_length>]
+  if (httpOwner && response.indexOf("+QHTTPGET: ") != -1)
+  {
+    httpError = parseResponseField(response, "+QHTTPGET: ", 0);
+    httpStatus = parseResponseField(response, "+QHTTPGET: ", 1);
+    httpAnswered = true;
+  }
+}
+
+/**
+ * Collects everything the modem sends until the expected text or an "ERROR" result
+ * code shows up, or until the timeout expires. Any +QMTRECV message caught in the
+ * middle is kept in `pendingURC` so the receive loop still handles it, and socket
+ * reports are passed to noteSocketUrc().
+ * 
+ * @param expected the text that completes the response, e.g. "OK\r\n".
+ * @param timeout the maximum time in milliseconds to wait.
+ * 
+ * @return the raw response.
+ */
+String waitForResponse(const char *expected, unsigned long timeout)
+{
+  String response = "";
+  unsigned long start = millis();
+  while (millis() - start < timeout)
+  {
+    while (LTE_Serial.available())
+      response += (char)LTE_Serial.read();
+    if (response.indexOf(expected) != -1 || response.indexOf("ERROR") != -1)
+      break;
+    esp_task_wdt_reset();
+    delay(10);
+  }
+  if (response.indexOf("+QMTRECV:") != -1)
+  {
+    // only what has arrived; receiveATCommand(1) collects the rest of the message
+    while (LTE_Serial.available())
+      response += (char)LTE_Serial.read();
+    pendingURC += response.substring(response.indexOf("+QMTRECV:"));
+  }
+  noteSocketUrc(response);
+  LOG_TRAFFIC("Response: ", response);
+  crashLogAppend("< " + response.substring(0, 80));
+  return response;
+}
+
+/**
+ * Sends an AT command and collects everything the modem answers until the final
+ * "OK" or "ERROR" result code, or until the timeout expires.
+ * 
+ * @param command a string that represents the AT command to be sent.
+ * @param timeout the maximum time in milliseconds to wait for the final result code.
+ * 
+ * @return the raw response, including the final result code if one arrived.
+ */
+String queryATCommand(String command, unsigned long timeout)
+{
+  sendATCommand(command);
+  return waitForResponse("OK\r\n", timeout);
+}
+
+/**
+ * Checks whether the modem answers "AT" at the current baud rate.
+ */
+bool probeModem()
+{
+  return queryATCommand("AT", 500).indexOf("OK") != -1;
+}
+
+/**
+ * Polls the modem with "AT" at BAUDRATE and LTE_FAST_BAUD until it answers after
+ * power-up, instead of sleeping for a fixed time.
+ * 
+ * @param timeout the maximum time in milliseconds to wait.
+ * 
+ * @return true once the modem answered.
+ */
+bool waitForModem(unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (millis() - start < timeout)
+  {
+    if (probeModem())
+      return true;
+    LTE_Serial.updateBaudRate(LTE_FAST_BAUD);
+    if (probeModem())
+    {
+      modemBaud = LTE_FAST_BAUD;
+      return true;
+    }
+    LTE_Serial.updateBaudRate(BAUDRATE);
+  }
+  return false;
+}
+
+/**
+ * Enables RTS/CTS flow control when the lines are wired, and raises the modem UART
+ * from BAUDRATE to LTE_FAST_BAUD with AT+IPR. Falls back to BAUDRATE if the modem
+ * stops answering after the switch. A modem left at LTE_FAST_BAUD by an earlier boot
+ * is detected and kept.
+ */
+void negotiateModemUart()
+{
+  if (!probeModem())
+  {
+    LTE_Serial.updateBaudRate(LTE_FAST_BAUD);
+    if (probeModem())
+      modemBaud = LTE_FAST_BAUD;
+    else
+      LTE_Serial.updateBaudRate(BAUDRATE);
+  }
+
+  if (EC_RTS >= 0 && EC_CTS >= 0 && queryATCommand("AT+IFC=2,2", AT_TIMEOUT).indexOf("OK") != -1)
+  {
+    LTE_Serial.setPins(EC_RX, EC_TX, EC_CTS, EC_RTS);
+    LTE_Serial.setHwFlowCtrlMode(HW_FLOWCTRL_CTS_RTS, 64);
+  }
+
+  if (modemBaud == LTE_FAST_BAUD)
+    return;
+  if (queryATCommand("AT+IPR=" + String(LTE_FAST_BAUD), AT_TIMEOUT).indexOf("OK") == -1)
+    return;
+  LTE_Serial.flush();
+  LTE_Serial.updateBaudRate(LTE_FAST_BAUD);
+  delay(100);
+  if (probeModem())
+  {
+    modemBaud = LTE_FAST_BAUD;
+    return;
+  }
+  LOG_WARN("Modem silent at the fast baud rate, reverting");
+  LTE_Serial.updateBaudRate(BAUDRATE);
+  queryATCommand("AT+IPR=" + String(BAUDRATE), AT_TIMEOUT);
+}
+
+/**
+ * Finds a pointer to the first occurrence of a '{' character in the given 
+ * `response` string, or `nullptr` if no '{' character is found.
+ * 
+ * @param response a pointer to a character array that represents the response 
+ * received from some source, such as a server or an API.
+ * 
+ * @return returns a pointer to the first occurrence of the character '{' in the input 
+ * `response` string. If the character is found, the function returns a pointer to that
+ * character. If the character is not found, the function returns a null pointer (`nullptr`).
+ */
+const char *parseResponse(const char *response)
+{
+  const char *jsonStart = strchr(response, '{');
+  if (jsonStart)
+    return jsonStart;
+  else
+    return nullptr;
+}
+
+/**
+ * Same as the `parseResponse` function, but for GPS location.
+ * 
+ * @param response a pointer to a character array that represents the GPS response.
+ * 
+ * @return a pointer to the fields of the GGA sentence in `response`, starting with
+ * the UTC time, or a null pointer (`nullptr`) if there is no GGA sentence.
+ */
+const char *parseLOCResponse(const char *response)
+{
+  const char *sentence = strstr(response, "GGA,");
+  if (sentence)
+    return sentence + 4;
+  else
+    return nullptr;
+}
+
+/**
+ * Processes a JSON message by parsing it, extracting the "message" field, and returning
+ * it as a String.
+ * 
+ * @param jsonString a pointer to a character array that represents a JSON string.
+ * @param jsonDoc the document that receives the parsed message, so commands can read
+ * their other fields.
+ * 
+ * @return a String object.
+ */
+String processJsonMessage(const char *jsonString, JsonDocument &jsonDoc)
+{
+  if (jsonString)
+  {
+    DeserializationError error = deserializeJson(jsonDoc, jsonString);
+    if (!error)
+    {
+      const char *message = jsonDoc["message"];
+      String temp(message);
+      if (message)
+        LOG_INFO("Received message: %s", message);
+      else
+        LOG_WARN("No message field in the JSON.");
+      return temp;
+    }
+    else
+    {
+      LOG_WARN("Failed to parse JSON: %s", error.c_str());
+    }
+  }
+  else
+    LOG_DEBUG("No JSON part found in the response.");
+  return "";
+}
+
+/**
+ * Reads one provisioning field from the parsed SD config, falling back to the value
+ * currently stored in NVS (or the compiled-in default) when the field is absent.
+ * Values found on the SD card are written back to NVS so the device keeps its
+ * identity if the card is later swapped or removed.
+ * 
+ * @param config the parsed contents of CONFIG_FILE, or an empty document.
+ * @param key the field name, used both in the JSON file and as the NVS key.
+ * @param fallback the compiled-in default.
+ * 
+ * @return the resolved value.
+ */
+String readProvisionedField(JsonDocument &config, const char *key, const char *fallback)
+{
+  String value = prefs.getString(key, fallback);
+  JsonVariant field = config[key];
+  if (field.isNull())
+    return value;
+  // numbers and booleans are accepted too, e.g. "broker_port": 8883 or "clean_session": false
+  String fromFile;
+  if (field.is<bool>())
+    fromFile = field.as<bool>() ? "1" : "0";
+  else if (field.is<long>())
+    fromFile = String(field.as<long>());
+  else
+    fromFile = field.as<const char *>();
+  if (fromFile.length() > 0 && value != fromFile)
+  {
+    value = fromFile;
+    prefs.putString(key, value);
+  }
+  return value;
+}
+
+/**
+ * Loads the device identity, topics, APN and broker endpoint from NVS and the
+ * optional CONFIG_FILE on the SD card, then builds the AT command strings that
+ * depend on them so the connect and publish paths only concatenate a length.
+ * 
+ * @param sdReady whether the SD card was mounted and CONFIG_FILE may be read.
+ */
+void loadProvisioning(bool sdReady)
+{
+  StaticJsonDocument<512> config;
+  if (sdReady && SD.exists(CONFIG_FILE))
+  {
+    File file = SD.open(CONFIG_FILE);
+    DeserializationError error = deserializeJson(config, file);
+    file.close();
+    if (error)
+    {
+      LOG_ERROR("Failed to parse " CONFIG_FILE ": %s", error.c_str());
+      config.clear();
+    }
+  }
+
+  prefs.begin(CONFIG_NAMESPACE, false);
+  DEVICE_ID = readProvisionedField(config, "device_id", DEFAULT_DEVICE_ID);
+  CLIENT_ID = readProvisionedField(config, "client_id", DEFAULT_CLIENT_ID);
+  APN = readProvisionedField(config, "apn", DEFAULT_APN);
+  BROKER_HOST = readProvisionedField(config, "broker_host", DEFAULT_BROKER_HOST);
+  BROKER_PORT = readProvisionedField(config, "broker_port", String(DEFAULT_BROKER_PORT).c_str()).toInt();
+  TOPIC_SUB = readProvisionedField(config, "topic_sub", ("AWS/CIER/SUB/" + DEVICE_ID).c_str());
+  TOPIC_INFO = readProvisionedField(config, "topic_info", ("AWS/CIER/INFO/" + DEVICE_ID).c_str());
+  RELAY_KEY = readProvisionedField(config, "relay_key", DEFAULT_RELAY_KEY);
+  CLEAN_SESSION = readProvisionedField(config, "clean_session", String(DEFAULT_CLEAN_SESSION).c_str()).toInt() != 0;
+  KEEPALIVE = readProvisionedField(config, "keepalive", String(DEFAULT_KEEPALIVE).c_str()).toInt();
+  captureOn = sdReady && readProvisionedField(config, CAPTURE_SETTING, "0").toInt() != 0;
+  prefs.end();
+
+  if (APN.length() > 0)
+    cmdSetAPN = "AT+QICSGP=1,1,\"" + APN + "\",\"\",\"\",0";
+  cmdSession = "AT+QMTCFG=\"session\",0," + String(CLEAN_SESSION ? 1 : 0);
+  cmdKeepalive = "AT+QMTCFG=\"keepalive\",0," + String(KEEPALIVE);
+  cmdOpenBroker = "AT+QMTOPEN=0,\"" + BROKER_HOST + "\"," + String(BROKER_PORT);
+  cmdConnectBroker = "AT+QMTCONN=0,\"" + CLIENT_ID + "\"";
+  cmdSubscribe = "AT+QMTSUB=0,1,\"" + TOPIC_SUB + "\",1";
+  cmdPublishInfoQos0 = "AT+QMTPUBEX=0,0,0,0,\"" + TOPIC_INFO + "\",";
+  cmdPublishInfoQos1 = "AT+QMTPUBEX=0,1,1,0,\"" + TOPIC_INFO + "\",";
+
+  LOG_INFO("Provisioned as device %s (%s)", DEVICE_ID.c_str(), CLIENT_ID.c_str());
+}
+
+/**
+ * Reads the current GGA sentence from the GNSS engine and publishes the device
+ * position, falling back to the serving cell when there is no fix.
+ */
+void checkLOC()
+{
+  String response = queryATCommand("AT+QGPSGNMEA=\"GGA\"", AT_TIMEOUT);
+  Publish_Message(parseLOCResponse(response.c_str()));
+}
+
+/**
+ * Takes coordinates as string and an integer limit, and converts it into a float value representing
+ * the actual coordinates.
+ * 
+ * @param value a string that represents the coordinate value. It can contains * both whole numbers and
+ * decimal numbers, separated by a dot (.). The numbers before the dot represent degrees, and the numbers
+ * after the dot represent minutes.
+ * @param limit determines whether the sent coordinates are latitude or longitude.
+ * 
+ * @return a float value, which is the result of converting the input string value into a coordinate
+ * value.
+ */
+float actualCoord(String value, int limit)
+{
+  float a = 0;
+  float b = 0;
+  int counter1 = 1;
+  int counter2 = 10;
   int flag1 = 0;
   int flag2 = 0;
-  for (int i = 0; i < value.length(); i++)
+  for (int i = 0; i < (int)value.length(); i++)
   {
     float temp = float(value[i] - '0');
     if (i < limit)
@@ -216,344 +1831,4195 @@ float actualCoord(String value, int limit)
       flag1 = 0;
     }
   }
-  return a + (b / 60.0);
+  return a + (b / 60.0);
+}
+
+/**
+ * Counts the days from 1970-01-01 to a civil date in the proleptic Gregorian calendar.
+ */
+int64_t daysFromCivil(int year, int month, int day)
+{
+  year -= month <= 2;
+  int64_t era = (year >= 0 ? year : year - 399) / 400;
+  int64_t yearOfEra = year - era * 400;
+  int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+  int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+  return era * 146097 + dayOfEra - 719468;
+}
+
+/**
+ * Converts a modem clock reading such as +QLTS: "2024/01/15,10:23:45+22,0" or
+ * +CCLK: "24/01/15,15:53:45+22" into Unix seconds.
+ * 
+ * @param response the raw modem response.
+ * @param local whether the reading is local time, in which case the quarter-hour
+ * zone offset is removed.
+ * 
+ * @return the Unix time in seconds, or -1 if the clock is unset or unreadable.
+ */
+int64_t parseModemTime(const String &response, bool local)
+{
+  int quote = response.indexOf('"');
+  if (quote == -1)
+    return -1;
+  int year, month, day, hour, minute, second, zone = 0;
+  char sign = '+';
+  if (sscanf(response.c_str() + quote + 1, "%d/%d/%d,%d:%d:%d%c%d", &year, &month, &day, &hour, &minute, &second, &sign, &zone) < 6)
+    return -1;
+  if (year < 100)
+    year += 2000;
+  // an unsynchronized modem RTC reports its 1980 epoch
+  if (year < 2020)
+    return -1;
+  int64_t seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+  if (local)
+    seconds -= (sign == '-' ? -1 : 1) * zone * 15 * 60;
+  return seconds;
+}
+
+/**
+ * Returns the current Unix time in milliseconds, or 0 before the first sync.
+ */
+int64_t epochMillis()
+{
+  return timeSynced ? (int64_t)millis() + epochOffsetMs : 0;
+}
+
+/**
+ * Sets the wall clock from the network: NITZ time via AT+QLTS first, then the modem
+ * RTC via AT+CCLK, and NTP through the modem as a last resort. On a resync the drift
+ * of the previous offset is kept in `lastClockSkewMs`.
+ * 
+ * @return true if a valid time was obtained.
+ */
+bool syncTime()
+{
+  lastTimeSync = millis();
+  int64_t seconds = parseModemTime(queryATCommand("AT+QLTS=1", AT_TIMEOUT), false);
+  if (seconds < 0)
+    seconds = parseModemTime(queryATCommand("AT+CCLK?", AT_TIMEOUT), true);
+  if (seconds < 0)
+  {
+    queryATCommand("AT+QNTP=1,\"" NTP_SERVER "\",123", AT_TIMEOUT);
+    if (waitForResponse("+QNTP: 0", NTP_TIMEOUT).indexOf("+QNTP: 0") != -1)
+      seconds = parseModemTime(queryATCommand("AT+CCLK?", AT_TIMEOUT), true);
+  }
+  if (seconds < 0)
+  {
+    LOG_WARN("Network time unavailable");
+    return false;
+  }
+  int64_t offset = seconds * 1000 - (int64_t)millis();
+  if (timeSynced)
+    lastClockSkewMs = (long)(epochOffsetMs - offset);
+  epochOffsetMs = offset;
+  timeSynced = true;
+  LOG_INFO("Clock synced, skew %ld ms", lastClockSkewMs);
+  return true;
+}
+
+/**
+ * Resyncs the clock every TIME_RESYNC_INTERVAL, or every TIME_RETRY_INTERVAL while
+ * no time has been obtained yet.
+ */
+void timeLoop()
+{
+  unsigned long period = timeSynced ? TIME_RESYNC_INTERVAL : TIME_RETRY_INTERVAL;
+  if (millis() - lastTimeSync >= period)
+    syncTime();
+}
+
+/**
+ * Checks the optional "issued" and "expires" Unix timestamps of a message. The
+ * delay since "issued" is kept as the delivery latency. Without a synced clock
+ * nothing is treated as expired, so alerts are never lost to a missing time source.
+ * 
+ * @param message the parsed MQTT message.
+ * 
+ * @return true if the message expired before it arrived.
+ */
+bool alertExpired(JsonDocument &message)
+{
+  if (!timeSynced)
+    return false;
+  uint32_t issued = message["issued"] | 0UL;
+  uint32_t expires = message["expires"] | 0UL;
+  int64_t now = epochMillis();
+  if (issued > 0)
+    lastAlertLatencyMs = (long)(now - (int64_t)issued * 1000);
+  return expires > 0 && now / 1000 > expires;
+}
+
+/**
+ * Reads the integer that follows the n-th comma after `prefix` in a response.
+ * 
+ * @param response the raw modem response.
+ * @param prefix the response prefix, e.g. "+QCSQ: ".
+ * @param field the zero-based index of the comma-separated field after the prefix.
+ * 
+ * @return the field value, or -999 if the prefix or field is missing.
+ */
+int parseResponseField(const String &response, const char *prefix, int field)
+{
+  int pos = response.indexOf(prefix);
+  if (pos == -1)
+    return -999;
+  pos += strlen(prefix);
+  for (int i = 0; i < field; i++)
+  {
+    pos = response.indexOf(',', pos);
+    if (pos == -1)
+      return -999;
+    pos++;
+  }
+  if (pos >= (int)response.length() || !(isDigit(response[pos]) || response[pos] == '-'))
+    return -999;
+  return response.substring(pos).toInt();
+}
+
+/**
+ * Returns a comma-separated field of a response line as text, without quotes.
+ * 
+ * @param line the response line, e.g. what follows "+QENG: ".
+ * @param field the zero-based index of the field.
+ * 
+ * @return the field, or an empty string if the line has fewer fields.
+ */
+String responseText(const String &line, int field)
+{
+  int start = 0;
+  for (int i = 0; i < field; i++)
+  {
+    start = line.indexOf(',', start);
+    if (start == -1)
+      return "";
+    start++;
+  }
+  int end = line.indexOf(',', start);
+  String text = end == -1 ? line.substring(start) : line.substring(start, end);
+  text.replace("\"", "");
+  text.trim();
+  return text;
+}
+
+/**
+ * Classifies the link from the newest sample. RSRP/SINR are used when the modem
+ * is on LTE, otherwise the CSQ-derived RSSI.
+ * 
+ * @param sample the sample to classify.
+ * 
+ * @return the link quality class.
+ */
+LinkQuality classifyLink(const LinkSample &sample)
+{
+  if (sample.reg != 1 && sample.reg != 5)
+    return LINK_POOR;
+  if (sample.rsrp != -999)
+  {
+    if (sample.rsrp < -110 || (sample.sinr != -999 && sample.sinr < 0))
+      return LINK_POOR;
+    if (sample.rsrp < -100)
+      return LINK_FAIR;
+    return LINK_GOOD;
+  }
+  if (sample.rssi == -999 || sample.rssi < -95)
+    return LINK_POOR;
+  if (sample.rssi < -85)
+    return LINK_FAIR;
+  return LINK_GOOD;
+}
+
+/**
+ * Configures the MQTT packet timeout and retry count of the modem for the current
+ * link quality. Applied before every AT+QMTOPEN and again whenever sampleLink()
+ * moves the link to another class.
+ */
+void configureMqttTimers()
+{
+  if (linkQuality == LINK_POOR)
+    queryATCommand("AT+QMTCFG=\"timeout\",0,20,5,0", AT_TIMEOUT);
+  else
+    queryATCommand("AT+QMTCFG=\"timeout\",0,5,3,0", AT_TIMEOUT);
+}
+
+/**
+ * Samples signal quality, registration state and the last publish round trip into
+ * the `linkHistory` ring buffer, then updates `linkQuality`.
+ */
+void sampleLink()
+{
+  LinkSample sample;
+  sample.time = millis();
+  int csq = parseResponseField(queryATCommand("AT+CSQ", AT_TIMEOUT), "+CSQ: ", 0);
+  sample.rssi = (csq >= 0 && csq <= 31) ? -113 + 2 * csq : -999;
+
+  // +QCSQ: "LTE",<rssi>,<rsrp>,<sinr>,<rsrq>, SINR as 0-250 for -20 to +30 dB
+  String qcsq = queryATCommand("AT+QCSQ", AT_TIMEOUT);
+  if (qcsq.indexOf("\"LTE\"") != -1)
+  {
+    sample.rsrp = parseResponseField(qcsq, "+QCSQ: ", 2);
+    int sinr = parseResponseField(qcsq, "+QCSQ: ", 3);
+    sample.sinr = sinr == -999 ? -999 : sinr / 5 - 20;
+    sample.rsrq = parseResponseField(qcsq, "+QCSQ: ", 4);
+  }
+  else
+  {
+    sample.rsrp = -999;
+    sample.sinr = -999;
+    sample.rsrq = -999;
+  }
+  sample.reg = parseRegistrationStat(queryATCommand("AT+CEREG?", AT_TIMEOUT), "+CEREG: ");
+  if (sample.reg != 1 && sample.reg != 5)
+    sample.reg = parseRegistrationStat(queryATCommand("AT+CGREG?", AT_TIMEOUT), "+CGREG: ");
+  sample.rtt = lastPublishRtt;
+
+  linkHistory[linkHead] = sample;
+  linkHead = (linkHead + 1) % LINK_HISTORY;
+  if (linkCount < LINK_HISTORY)
+    linkCount++;
+  lastLinkSample = sample.time;
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_AT
+  LinkQuality previous = linkQuality;
+  linkQuality = classifyLink(sample);
+  // the first classification is applied by openSession()
+  if (previous != LINK_UNKNOWN && linkQuality != previous)
+    configureMqttTimers();
+#else
+  linkQuality = classifyLink(sample);
+#endif
+}
+
+/**
+ * Samples the link when the current sampling period has elapsed. Poor links are
+ * sampled more often so recovery is noticed quickly.
+ */
+void monitorLink()
+{
+  unsigned long period = linkQuality == LINK_POOR ? LINK_SAMPLE_POOR : LINK_SAMPLE_GOOD;
+  if (linkCount == 0 || millis() - lastLinkSample >= period)
+    sampleLink();
+}
+
+/**
+ * Returns how long to wait for a PUBACK given the current link quality.
+ */
+unsigned long publishAckTimeout()
+{
+  return linkQuality == LINK_POOR ? PUBACK_TIMEOUT_POOR : PUBACK_TIMEOUT_GOOD;
+}
+
+/**
+ * Publishes a payload through the modem's MQTT stack and, for QoS1, waits for the
+ * PUBACK to measure the round trip.
+ * 
+ * @param command the AT+QMTPUBEX command up to the length, e.g. cmdPublishInfoQos1.
+ * @param payload the serialized JSON payload.
+ * @param qos the MQTT QoS level the command asks for, 0 or 1.
+ * 
+ * @return true if the modem accepted the message (and acknowledged it for QoS1).
+ */
+bool publishViaModem(const String &command, const String &payload, int qos)
+{
+  sendATCommand(command + String(payload.length()));
+  if (waitForResponse(">", AT_TIMEOUT).indexOf(">") == -1)
+    return false;
+  unsigned long sent = millis();
+  sendATCommand(payload);
+  String response = waitForResponse(qos ? "+QMTPUBEX: 0,1," : "+QMTPUBEX: 0,0,", publishAckTimeout());
+  if (qos && response.indexOf("+QMTPUBEX: 0,1,0") != -1)
+  {
+    lastPublishRtt = millis() - sent;
+    return true;
+  }
+  return qos == 0 && response.indexOf("+QMTPUBEX: 0,0,0") != -1;
+}
+
+/**
+ * Publishes a payload on the INFO topic. PubSubClient only publishes at QoS0, so on
+ * that transport the round trip is the time until the modem took the packet.
+ * 
+ * @param payload the serialized JSON payload.
+ * @param qos the MQTT QoS level, 0 or 1.
+ * 
+ * @return true if the message went out (and was acknowledged for QoS1 over AT).
+ */
+bool publishInfo(const String &payload, int qos)
+{
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  (void)qos;
+  unsigned long sent = millis();
+  if (!mqtt.publish(TOPIC_INFO.c_str(), payload.c_str()))
+    return false;
+  lastPublishRtt = millis() - sent;
+  return true;
+#else
+  return publishViaModem(qos ? cmdPublishInfoQos1 : cmdPublishInfoQos0, payload, qos);
+#endif
+}
+
+/**
+ * Adds an event to the journal. Only the RAM buffer is touched, so this is safe on
+ * the alert path; when the buffer is full the event is counted in `journalDropped`.
+ * 
+ * @param type the JournalEvent.
+ * @param code the first detail, see JournalEvent.
+ * @param value the second detail.
+ * @param text a short label, cut to JOURNAL_TEXT_SIZE characters.
+ */
+void journal(uint8_t type, uint8_t code, int32_t value, const char *text)
+{
+  if (journalCount == JOURNAL_BUFFER)
+  {
+    journalDropped++;
+    return;
+  }
+  JournalRecord &record = journalBuffer[journalCount++];
+  memset(&record, 0, sizeof(record));
+  record.time = timeSynced ? (uint32_t)(epochMillis() / 1000) : 0;
+  record.uptime = millis();
+  record.type = type;
+  record.code = code;
+  record.value = value;
+  strncpy(record.text, text, JOURNAL_TEXT_SIZE);
+  if (journalCount == 1)
+    journalOldest = millis();
+}
+
+String journalPath(uint32_t file, const char *extension)
+{
+  return JOURNAL_DIR "/" + String(file) + extension;
+}
+
+/**
+ * Finds the newest journal file and continues its sequence numbers.
+ */
+void loadJournal()
+{
+  if (!SD.exists(JOURNAL_DIR))
+    SD.mkdir(JOURNAL_DIR);
+  long newest = -1;
+  File dir = SD.open(JOURNAL_DIR);
+  for (File entry = dir.openNextFile(); entry; entry = dir.openNextFile())
+  {
+    String name = entry.name();
+    name = name.substring(name.lastIndexOf('/') + 1);
+    if (name.endsWith(".bin") && name.toInt() > newest)
+      newest = name.toInt();
+    entry.close();
+  }
+  dir.close();
+  // a record cut short by a reset is not counted; the next write goes over it
+  if (newest >= 0)
+  {
+    File file = SD.open(journalPath(newest, ".bin"));
+    journalSeq = newest * JOURNAL_FILE_RECORDS + file.size() / sizeof(JournalRecord);
+    file.close();
+  }
+  journalReady = true;
+}
+
+/**
+ * Opens a journal file for writing at a position of its own choosing, creating it
+ * when it does not exist yet. Append mode would ignore the seek.
+ */
+File openJournalFile(uint32_t file, const char *extension)
+{
+  String path = journalPath(file, extension);
+  return SD.open(path, SD.exists(path) ? "r+" : FILE_WRITE);
+}
+
+/**
+ * Appends the buffered events to the journal in one pass, starting a new file every
+ * JOURNAL_FILE_RECORDS records and deleting the one that falls out of the window.
+ * Records and index entries are written at the offset their sequence number gives,
+ * so a short write is overwritten by the next one instead of shifting the rest, and
+ * an index entry is only written once its record is on the card. Events stay
+ * buffered while the card cannot be written.
+ */
+void flushJournal()
+{
+  if (!journalReady || journalCount == 0)
+    return;
+  File data;
+  File index;
+  unsigned int written = 0;
+  for (; written < journalCount; written++)
+  {
+    JournalRecord &record = journalBuffer[written];
+    uint32_t file = journalSeq / JOURNAL_FILE_RECORDS;
+    if (!data || journalSeq % JOURNAL_FILE_RECORDS == 0)
+    {
+      data.close();
+      index.close();
+      if (journalSeq % JOURNAL_FILE_RECORDS == 0 && file >= JOURNAL_FILES)
+      {
+        SD.remove(journalPath(file - JOURNAL_FILES, ".bin"));
+        SD.remove(journalPath(file - JOURNAL_FILES, ".idx"));
+      }
+      data = openJournalFile(file, ".bin");
+      index = openJournalFile(file, ".idx");
+      if (!data || !index || !data.seek((journalSeq % JOURNAL_FILE_RECORDS) * sizeof(record)))
+        break;
+    }
+    record.seq = journalSeq;
+    if (data.write((const uint8_t *)&record, sizeof(record)) != sizeof(record))
+      break;
+    if (journalSeq % JOURNAL_INDEX_STRIDE == 0)
+    {
+      JournalIndexEntry entry = {record.seq, record.time};
+      if (index.seek((journalSeq % JOURNAL_FILE_RECORDS) / JOURNAL_INDEX_STRIDE * sizeof(entry)))
+        index.write((const uint8_t *)&entry, sizeof(entry));
+    }
+    journalSeq++;
+  }
+  data.close();
+  index.close();
+  memmove(journalBuffer, journalBuffer + written, (journalCount - written) * sizeof(JournalRecord));
+  journalCount -= written;
+  if (journalCount > 0)
+    journalOldest = millis();
+}
+
+/**
+ * Writes the journal buffer once JOURNAL_BATCH events are waiting or the oldest has
+ * waited JOURNAL_FLUSH_INTERVAL.
+ */
+void journalLoop()
+{
+  if (journalCount >= JOURNAL_BATCH || (journalCount > 0 && millis() - journalOldest >= JOURNAL_FLUSH_INTERVAL))
+    flushJournal();
+}
+
+/**
+ * Returns the sequence number of the oldest record still on the card.
+ */
+uint32_t oldestJournalSeq()
+{
+  if (journalSeq == 0)
+    return 0;
+  uint32_t newest = (journalSeq - 1) / JOURNAL_FILE_RECORDS;
+  return newest >= JOURNAL_FILES - 1 ? (newest - JOURNAL_FILES + 1) * JOURNAL_FILE_RECORDS : 0;
+}
+
+/**
+ * Looks up in the index files where records from a Unix time onwards start.
+ * 
+ * @param time the Unix time in seconds.
+ * @param oldest the oldest record on the card.
+ * 
+ * @return the first record of the last stride that began at or before `time`.
+ */
+uint32_t seekJournal(uint32_t time, uint32_t oldest)
+{
+  uint32_t found = oldest;
+  for (uint32_t file = oldest / JOURNAL_FILE_RECORDS; file * JOURNAL_FILE_RECORDS < journalSeq; file++)
+  {
+    File index = SD.open(journalPath(file, ".idx"));
+    JournalIndexEntry entry;
+    while (index && index.read((uint8_t *)&entry, sizeof(entry)) == sizeof(entry))
+    {
+      if (entry.time > time)
+      {
+        index.close();
+        return found;
+      }
+      if (entry.time != 0)
+        found = entry.seq;
+    }
+    index.close();
+  }
+  return found;
+}
+
+/**
+ * Handles a LOG command, e.g. {"message":"LOG","seq":120} or
+ * {"message":"LOG","from":1718000000,"to":1718003600}. Up to JOURNAL_REPLY_RECORDS
+ * records are published as [seq, time, uptime, type, code, value, text], with "NEXT"
+ * the "seq" that asks for the following page while there is one. Records without a
+ * synced time are left out of a time range.
+ * 
+ * @param command the parsed command.
+ */
+void queryJournal(JsonDocument &command)
+{
+  flushJournal();
+  uint32_t oldest = oldestJournalSeq();
+  bool ranged = !command["from"].isNull() || !command["to"].isNull();
+  uint32_t from = command["from"] | 0UL;
+  uint32_t to = command["to"] | 0xFFFFFFFFUL;
+  uint32_t seq = max((uint32_t)(command["seq"] | 0UL), oldest);
+  if (from > 0)
+    seq = max(seq, seekJournal(from, oldest));
+
+  String output = "";
+  StaticJsonDocument<JOURNAL_DOC_SIZE> doc;
+  // by pointer, JOURNAL_DOC_SIZE leaves no room for a copy of an id of any length
+  doc["DEVICE_ID"] = DEVICE_ID.c_str();
+  JsonArray list = doc.createNestedArray("LOG");
+  File data;
+  uint32_t open = 0xFFFFFFFF;
+  unsigned int added = 0;
+  unsigned int scanned = 0;
+  bool done = false;
+  for (; journalReady && seq < journalSeq && added < JOURNAL_REPLY_RECORDS && scanned < JOURNAL_SCAN_LIMIT; seq++, scanned++)
+  {
+    uint32_t file = seq / JOURNAL_FILE_RECORDS;
+    if (file != open)
+    {
+      data.close();
+      data = SD.open(journalPath(file, ".bin"));
+      open = file;
+    }
+    JournalRecord record;
+    if (!data || !data.seek((seq % JOURNAL_FILE_RECORDS) * sizeof(record)) || data.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+      break;
+    if (ranged && record.time > to)
+    {
+      done = true;
+      break;
+    }
+    if (ranged && (record.time == 0 || record.time < from))
+      continue;
+    char text[JOURNAL_TEXT_SIZE + 1];
+    memcpy(text, record.text, JOURNAL_TEXT_SIZE);
+    text[JOURNAL_TEXT_SIZE] = 0;
+    JsonArray entry = list.createNestedArray();
+    entry.add(record.seq);
+    entry.add(record.time);
+    entry.add(record.uptime);
+    entry.add(record.type);
+    entry.add(record.code);
+    entry.add(record.value);
+    entry.add(text);
+    added++;
+  }
+  data.close();
+  if (!done && seq < journalSeq)
+    doc["NEXT"] = seq;
+  doc["DROPPED"] = journalDropped;
+  serializeJson(doc, output);
+  publishInfo(output, 1);
+}
+
+/**
+ * Opens the receipt of an alert that is about to sound, in a slot that holds nothing
+ * unpublished or, failing that, the oldest one.
+ * 
+ * @param id the alert's "id", or its code when it has none.
+ * @param latency ms from "issued" to arrival, -1 if unknown.
+ * @param hops 0 for an alert from the broker, otherwise the relay hops it took.
+ */
+void openReceipt(const String &id, long latency, uint8_t hops)
+{
+  int slot = -1;
+  for (int i = 0; i < RECEIPT_SLOTS; i++)
+  {
+    if (!receipts[i].pending && !receipts[i].sending && i != receiptActive)
+    {
+      slot = i;
+      break;
+    }
+    if (slot == -1 || receipts[i].receivedAt < receipts[slot].receivedAt)
+      slot = i;
+  }
+  AlertReceipt &receipt = receipts[slot];
+  receipt.id = id;
+  receipt.receivedAt = millis();
+  receipt.receivedUnix = timeSynced ? (uint32_t)(epochMillis() / 1000) : 0;
+  receipt.latency = latency;
+  receipt.startMs = -1;
+  receipt.ackMs = -1;
+  receipt.gesture = ACK_NONE;
+  receipt.hops = hops;
+  receipt.output = "-";
+  receipt.pending = false;
+  receipt.sending = false;
+  receiptActive = slot;
+  journal(JOURNAL_ALERT, hops, latency, id.c_str());
+}
+
+void markReceiptPending(AlertReceipt &receipt)
+{
+  if (!receipt.pending)
+  {
+    receipt.pending = true;
+    receipt.pendingSince = millis();
+  }
+}
+
+/**
+ * Records that the active alert became audible, and on which output.
+ */
+void receiptSounding()
+{
+  if (receiptActive == -1 || receipts[receiptActive].startMs != -1)
+    return;
+  AlertReceipt &receipt = receipts[receiptActive];
+  receipt.startMs = millis() - receipt.receivedAt;
+  receipt.output = alertOutput == OUTPUT_PCM ? "P" : alertOutput == OUTPUT_I2S ? "I" : "M";
+  markReceiptPending(receipt);
+  journal(JOURNAL_PLAYBACK, alertOutput, receipt.startMs, receipt.id.c_str());
+}
+
+/**
+ * Records how and when the user stopped the active alert, and closes its receipt.
+ */
+void receiptAcknowledged(uint8_t gesture)
+{
+  if (receiptActive == -1)
+    return;
+  AlertReceipt &receipt = receipts[receiptActive];
+  receipt.ackMs = millis() - receipt.receivedAt;
+  receipt.gesture = gesture;
+  markReceiptPending(receipt);
+  journal(JOURNAL_ACK, gesture, receipt.ackMs, receipt.id.c_str());
+  receiptActive = -1;
+}
+
+/**
+ * Appends up to RECEIPT_BATCH changed receipts to a payload, each as
+ * [id, received, latency, start, ack, gesture, output, hops], and marks them in
+ * flight until finishReceipts() learns whether the publish went through. An alert
+ * acknowledged before its receipt went out is sent once, with both times.
+ * 
+ * @return the number of receipts added.
+ */
+int addReceipts(JsonDocument &doc)
+{
+  int added = 0;
+  JsonArray list;
+  for (int i = 0; i < RECEIPT_SLOTS && added < RECEIPT_BATCH; i++)
+  {
+    AlertReceipt &receipt = receipts[i];
+    if (!receipt.pending || receipt.sending)
+      continue;
+    if (added == 0)
+      list = doc.createNestedArray("RECEIPTS");
+    JsonArray entry = list.createNestedArray();
+    entry.add(receipt.id);
+    entry.add(receipt.receivedUnix);
+    entry.add(receipt.latency);
+    entry.add(receipt.startMs);
+    entry.add(receipt.ackMs);
+    entry.add(receipt.gesture);
+    entry.add(receipt.output);
+    entry.add(receipt.hops);
+    receipt.sending = true;
+    added++;
+  }
+  return added;
+}
+
+/**
+ * Settles the receipts added to a publish. Those that failed wait another
+ * RECEIPT_FLUSH_DELAY before receiptLoop() retries them.
+ */
+void finishReceipts(bool published)
+{
+  for (int i = 0; i < RECEIPT_SLOTS; i++)
+  {
+    if (!receipts[i].sending)
+      continue;
+    receipts[i].sending = false;
+    if (published)
+      receipts[i].pending = false;
+    else
+      receipts[i].pendingSince = millis();
+  }
+}
+
+/**
+ * Publishes changed receipts on their own once a full batch is waiting, or once one
+ * has waited RECEIPT_FLUSH_DELAY without another publish carrying it. The delay lets
+ * the start and the acknowledgement of an alert go out together.
+ */
+void receiptLoop()
+{
+  int waiting = 0;
+  bool due = false;
+  for (int i = 0; i < RECEIPT_SLOTS; i++)
+  {
+    if (!receipts[i].pending)
+      continue;
+    waiting++;
+    if (millis() - receipts[i].pendingSince >= RECEIPT_FLUSH_DELAY)
+      due = true;
+  }
+  if (!due && waiting < RECEIPT_BATCH)
+    return;
+  StaticJsonDocument<RECEIPT_DOC_SIZE> doc;
+  doc["DEVICE_ID"] = DEVICE_ID;
+  addReceipts(doc);
+  String output = "";
+  serializeJson(doc, output);
+  finishReceipts(publishInfo(output, 1));
+}
+
+/**
+ * Returns the fix quality field of a GGA sentence, or 0 when there is no fix or the
+ * sentence is missing.
+ */
+int ggaFixQuality(const String &response)
+{
+  int at = response.indexOf("GGA,");
+  if (at == -1)
+    return 0;
+  // the quality follows time, latitude, N/S, longitude and E/W
+  for (int i = 0; i < 6; i++)
+  {
+    at = response.indexOf(',', at + 1);
+    if (at == -1)
+      return 0;
+  }
+  return response.substring(at + 1).toInt();
+}
+
+/**
+ * Loads the timestamp and validity of the last assistance data injection, and the
+ * last first-fix times with and without it.
+ */
+void loadAgnssState()
+{
+  prefs.begin(AGNSS_NAMESPACE, true);
+  agnssTime = prefs.getUInt("time", 0);
+  agnssValidity = prefs.getUInt("valid", AGNSS_VALIDITY_S);
+  lastColdTtffMs = prefs.getULong("ttff_cold", 0);
+  lastAidedTtffMs = prefs.getULong("ttff_aided", 0);
+  prefs.end();
+}
+
+/**
+ * Checks whether the assistance data has outlived its validity. Without a synced
+ * clock the age is unknown and the data is left alone.
+ */
+bool agnssStale()
+{
+  if (!timeSynced)
+    return false;
+  return agnssTime == 0 || epochMillis() / 1000 - agnssTime >= agnssValidity;
+}
+
+/**
+ * Starts a GNSS session and restarts the time-to-first-fix measurement.
+ * 
+ * @param aided whether assistance data was injected for this session.
+ */
+void startGnss(bool aided)
+{
+  queryATCommand("AT+QGPS=1", AT_TIMEOUT);
+  gnssStart = millis();
+  gnssSearchStart = gnssStart;
+  gnssAided = aided;
+  gnssFixed = false;
+  ttffMs = 0;
+}
+
+/**
+ * Has the modem download fresh assistance data over the active PDP context and
+ * restarts the GNSS session so the engine picks it up. The injection time is kept
+ * in NVS so a reboot does not repeat a download that is still valid.
+ * 
+ * @return true if the modem accepted the request.
+ */
+bool injectAssistance()
+{
+  lastAgnssAttempt = millis();
+  queryATCommand("AT+QGPSEND", AT_TIMEOUT);
+  bool accepted = queryATCommand("AT+QAGPS=1", AGNSS_TIMEOUT).indexOf("OK") != -1;
+  startGnss(accepted);
+  if (!accepted)
+  {
+    LOG_WARN("AGNSS download failed");
+    return false;
+  }
+  agnssTime = epochMillis() / 1000;
+  agnssValidity = AGNSS_VALIDITY_S;
+  prefs.begin(AGNSS_NAMESPACE, false);
+  prefs.putUInt("time", agnssTime);
+  prefs.putUInt("valid", agnssValidity);
+  prefs.end();
+  return true;
+}
+
+/**
+ * Stores the first-fix time of the current session, kept apart for aided and cold
+ * sessions so the gain from assistance data can be compared.
+ */
+void recordFirstFix()
+{
+  ttffMs = millis() - gnssStart;
+  if (gnssAided)
+    lastAidedTtffMs = ttffMs;
+  else
+    lastColdTtffMs = ttffMs;
+  prefs.begin(AGNSS_NAMESPACE, false);
+  prefs.putULong(gnssAided ? "ttff_aided" : "ttff_cold", ttffMs);
+  prefs.end();
+  journal(JOURNAL_FIX, gnssAided, ttffMs, "");
+  LOG_INFO("First fix after %lu ms (%s)", ttffMs, gnssAided ? "aided" : "cold");
+}
+
+/**
+ * The GGA poll interval: GNSS_TRACK_INTERVAL with a fix. Without one it starts at
+ * GNSS_POLL_INTERVAL and doubles for every GNSS_SEARCH_WINDOW the search has gone
+ * on, up to GNSS_TRACK_INTERVAL, so a device indoors stops querying every 2 s.
+ */
+unsigned long gnssPollInterval()
+{
+  if (gnssFixed)
+    return GNSS_TRACK_INTERVAL;
+  unsigned long windows = min((millis() - gnssSearchStart) / GNSS_SEARCH_WINDOW, (unsigned long)GNSS_MAX_BACKOFF);
+  return min((unsigned long)GNSS_POLL_INTERVAL << windows, (unsigned long)GNSS_TRACK_INTERVAL);
+}
+
+/**
+ * Polls the GGA sentence at gnssPollInterval(): quickly until the first fix, backing
+ * off while there is none, and every GNSS_TRACK_INTERVAL to notice a lost fix, which
+ * starts a new search. While there is no fix and the assistance data is stale,
+ * fresh data is injected at most every AGNSS_RETRY_INTERVAL; a tracking engine keeps
+ * its own ephemeris current. The first fix after a position without GNSS is
+ * published to replace it.
+ */
+void gnssLoop()
+{
+  if (millis() - lastGnssPoll < gnssPollInterval())
+    return;
+  lastGnssPoll = millis();
+  String response = queryATCommand("AT+QGPSGNMEA=\"GGA\"", AT_TIMEOUT);
+  bool fixed = ggaFixQuality(response) > 0;
+  if (fixed && ttffMs == 0)
+    recordFirstFix();
+  if (gnssFixed && !fixed)
+    gnssSearchStart = millis();
+  gnssFixed = fixed;
+  if (gnssFixed && locationPending)
+    Publish_Message(parseLOCResponse(response.c_str()));
+  if (!gnssFixed && agnssStale() && millis() - lastAgnssAttempt >= AGNSS_RETRY_INTERVAL)
+    injectAssistance();
+}
+
+/**
+ * Reads the identity of a cell from an AT+QENG line. The serving cell reports
+ *   "servingcell",<state>,"LTE",<is_tdd>,<mcc>,<mnc>,<cellid>,<pcid>,<earfcn>,<band>,
+ *     <ul_bw>,<dl_bw>,<tac>,<rsrp>,...
+ *   "servingcell",<state>,"GSM",<mcc>,<mnc>,<lac>,<cellid>,<bsic>,<arfcn>,...
+ * and a GSM neighbour "neighbourcell","GSM",<mcc>,<mnc>,<lac>,<cellid>,...
+ * LTE neighbours only carry their physical cell id, so they cannot be looked up.
+ * 
+ * @param line the text after "+QENG: ".
+ * @param cell receives the identity.
+ * 
+ * @return true when the line names a cell with a global identity.
+ */
+bool parseCellId(const String &line, CellId &cell)
+{
+  bool serving = responseText(line, 0) == "servingcell";
+  String rat = responseText(line, serving ? 2 : 1);
+  cell.lte = rat == "LTE";
+  if (!cell.lte && rat != "GSM")
+    return false;
+  if (!serving && cell.lte)
+    return false;
+  int mcc = serving ? (cell.lte ? 4 : 3) : 2;
+  cell.mcc = responseText(line, mcc).toInt();
+  cell.mnc = responseText(line, mcc + 1).toInt();
+  cell.area = strtoul(responseText(line, serving && cell.lte ? 12 : mcc + 2).c_str(), NULL, 16);
+  cell.cell = strtoul(responseText(line, serving && cell.lte ? 6 : mcc + 3).c_str(), NULL, 16);
+  // a modem that is still searching reports "-" for the fields
+  return cell.mcc != 0 && cell.cell != 0;
+}
+
+/**
+ * Collects the serving cell and, on GSM, the neighbours that have a global identity.
+ * 
+ * @param cells receives the cells, the serving cell first.
+ * @param limit the capacity of `cells`.
+ * 
+ * @return the number of cells, 0 when the modem is not camped on a cell.
+ */
+int queryCells(CellId *cells, int limit)
+{
+  String response = queryATCommand("AT+QENG=\"servingcell\"", CELL_QUERY_TIMEOUT);
+  int at = response.indexOf("+QENG: ");
+  if (at == -1 || !parseCellId(response.substring(at + 7, response.indexOf('\r', at)), cells[0]))
+    return 0;
+  int count = 1;
+  if (cells[0].lte)
+    return count;
+  response = queryATCommand("AT+QENG=\"neighbourcell\"", CELL_QUERY_TIMEOUT);
+  for (at = response.indexOf("+QENG: "); at != -1 && count < limit; at = response.indexOf("+QENG: ", at + 7))
+  {
+    if (parseCellId(response.substring(at + 7, response.indexOf('\r', at)), cells[count]))
+      count++;
+  }
+  return count;
+}
+
+/**
+ * Orders a CELL_DB_FILE record against a cell identity.
+ * 
+ * @return negative, zero or positive as the record sorts before, at or after the cell.
+ */
+int compareCell(const CellRecord &record, const CellId &cell)
+{
+  if (record.mcc != cell.mcc)
+    return record.mcc < cell.mcc ? -1 : 1;
+  if (record.mnc != cell.mnc)
+    return record.mnc < cell.mnc ? -1 : 1;
+  if (record.area != cell.area)
+    return record.area < cell.area ? -1 : 1;
+  if (record.cell != cell.cell)
+    return record.cell < cell.cell ? -1 : 1;
+  return 0;
+}
+
+/**
+ * Finds a cell in CELL_DB_FILE by binary search, so even a whole country's table
+ * costs about twenty record reads.
+ * 
+ * @param table the open table.
+ * @param cell the cell to look for.
+ * @param record receives the matching record.
+ * 
+ * @return true if the cell is in the table.
+ */
+bool lookupCell(File &table, const CellId &cell, CellRecord &record)
+{
+  uint32_t low = 0;
+  uint32_t high = table.size() / sizeof(CellRecord);
+  while (low < high)
+  {
+    uint32_t mid = low + (high - low) / 2;
+    if (!table.seek(mid * sizeof(CellRecord)) || table.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+      return false;
+    int order = compareCell(record, cell);
+    if (order == 0)
+      return true;
+    if (order < 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return false;
+}
+
+/**
+ * Returns the distance between two points in metres, flat-earth approximation that
+ * is good enough across a few cells.
+ */
+float cellDistance(double lat1, double lon1, double lat2, double lon2)
+{
+  double x = (lon2 - lon1) * cos((lat1 + lat2) * M_PI / 360);
+  double y = lat2 - lat1;
+  return sqrt(x * x + y * y) * 111195.0;
+}
+
+/**
+ * Estimates the position from the cells the modem hears: the centroid of the cells
+ * found in CELL_DB_FILE weighted by the inverse square of their range, so small
+ * cells count most. The device is within range of every cell, which bounds the
+ * error by the distance from the centroid to a cell plus that cell's range; the
+ * accuracy is the tightest of these bounds.
+ * 
+ * @param estimate receives the cells heard and, when any is in the table, the position.
+ */
+void estimateCellPosition(CellEstimate &estimate)
+{
+  estimate.valid = true;
+  estimate.time = millis();
+  estimate.found = 0;
+  CellId cells[CELL_NEIGHBOURS + 1];
+  estimate.count = queryCells(cells, CELL_NEIGHBOURS + 1);
+  if (estimate.count == 0)
+    return;
+  estimate.serving = cells[0];
+
+  if (!sdReady)
+    return;
+  File table = SD.open(CELL_DB_FILE);
+  if (!table)
+    return;
+  double lat[CELL_NEIGHBOURS + 1];
+  double lon[CELL_NEIGHBOURS + 1];
+  float range[CELL_NEIGHBOURS + 1];
+  double latSum = 0;
+  double lonSum = 0;
+  double weightSum = 0;
+  int found = 0;
+  for (int i = 0; i < estimate.count; i++)
+  {
+    CellRecord record;
+    if (!lookupCell(table, cells[i], record))
+      continue;
+    lat[found] = record.lat / 1e6;
+    lon[found] = record.lon / 1e6;
+    range[found] = record.range > 0 ? record.range : CELL_DEFAULT_RANGE;
+    double weight = 1.0 / ((double)range[found] * range[found]);
+    latSum += lat[found] * weight;
+    lonSum += lon[found] * weight;
+    weightSum += weight;
+    found++;
+  }
+  table.close();
+  if (found == 0)
+    return;
+
+  double latitude = latSum / weightSum;
+  double longitude = lonSum / weightSum;
+  float accuracy = range[0] + cellDistance(latitude, longitude, lat[0], lon[0]);
+  for (int i = 1; i < found; i++)
+    accuracy = min(accuracy, range[i] + cellDistance(latitude, longitude, lat[i], lon[i]));
+  estimate.found = found;
+  estimate.lat = latitude;
+  estimate.lon = longitude;
+  estimate.accuracy = max(accuracy, (float)CELL_MIN_ACCURACY);
+}
+
+/**
+ * Adds the cell tower estimate to a position message, querying the modem only when
+ * the last estimate is older than CELL_CACHE_TTL, so a burst of LOC requests from a
+ * device without a fix costs one round of AT+QENG. The serving cell identity is
+ * always added as CELL so the backend can resolve it when the table does not have it.
+ * 
+ * @param doc the position message being built.
+ * 
+ * @return true if LAT, LONG and ACC were set.
+ */
+bool cellPosition(JsonDocument &doc)
+{
+  if (!cellEstimate.valid || millis() - cellEstimate.time >= CELL_CACHE_TTL)
+    estimateCellPosition(cellEstimate);
+  if (cellEstimate.count == 0)
+    return false;
+  JsonObject serving = doc.createNestedObject("CELL");
+  serving["RAT"] = cellEstimate.serving.lte ? "LTE" : "GSM";
+  serving["MCC"] = cellEstimate.serving.mcc;
+  serving["MNC"] = cellEstimate.serving.mnc;
+  serving["AREA"] = cellEstimate.serving.area;
+  serving["CID"] = cellEstimate.serving.cell;
+  if (cellEstimate.found == 0)
+    return false;
+  doc["LAT"] = cellEstimate.lat;
+  doc["LONG"] = cellEstimate.lon;
+  doc["ACC"] = cellEstimate.accuracy;
+  doc["CELLS"] = cellEstimate.found;
+  return true;
+}
+
+/**
+ * Publishes the device position to the INFO topic: the GNSS position when the GGA
+ * sentence has a fix, otherwise the estimate from cellPosition(), so the reply does
+ * not wait for the GNSS engine. ACC is the accuracy radius in metres and SRC says
+ * where the position came from. Until a GNSS position has been sent,
+ * `locationPending` lets gnssLoop() replace the estimate as soon as there is a fix.
+ * 
+ * @param sentence the GGA fields as returned by parseLOCResponse(), or a null
+ * pointer if the modem returned no sentence.
+ */
+void Publish_Message(const char *sentence)
+{
+  String output = "";
+  StaticJsonDocument<LOCATION_DOC_SIZE + RECEIPT_DOC_SIZE> doc;
+  //                            <ddmm.mmmmm> <0ddmm,mmmmm>
+  //+QGPSNMEA: $GPGGA,141009.00,2824.04883,N,07721.32483,E,0,00,99.99,179.9,M,,M,,*7E
+  String gga = sentence ? sentence : "";
+  String Lat = responseText(gga, 1);
+  String Long = responseText(gga, 3);
+  int source = LOCATION_NONE;
+
+  doc["DEVICE_ID"] = DEVICE_ID;
+  if (responseText(gga, 5).toInt() > 0 && Lat.length() > 0 && Long.length() > 0)
+  {
+    //always send 2 with lat and 3 with long for proper parsing
+    float LLat = actualCoord(Lat, 2);
+    float LLong = actualCoord(Long, 3);
+    if (responseText(gga, 2) == "S")
+      LLat = LLat * (-1);
+    if (responseText(gga, 4) == "W")
+      LLong = LLong * (-1);
+    doc["LAT"] = LLat;
+    doc["LONG"] = LLong;
+    doc["ACC"] = max(1, (int)(responseText(gga, 7).toFloat() * GNSS_UERE + 0.5f));
+    source = LOCATION_GNSS;
+  }
+  else if (cellPosition(doc))
+    source = LOCATION_CELL;
+  doc["SRC"] = source == LOCATION_GNSS ? "GNSS" : source == LOCATION_CELL ? "CELL" : "NONE";
+  // the button reply carries the receipt of the alert it stopped
+  addReceipts(doc);
+
+  serializeJson(doc, output);
+  finishReceipts(publishInfo(output, 1));
+  locationPending = source != LOCATION_GNSS;
+  journal(JOURNAL_LOCATION, source, doc["ACC"].as<int>(), "");
+}
+
+/**
+ * Publishes a JSON payload to an MQTT topic using AT commands when the device is booted
+ * or asked for its STATUS. The payload carries the newest link sample and the averages
+ * over `linkHistory`.
+ */
+void Publish_LIVE_NOW()
+{
+  String output = "";
+  StaticJsonDocument<1344> doc;
+
+  doc["DEVICE_ID"] = DEVICE_ID;
+  doc["STATUS"] = "ACTIVE";
+
+  if (linkCount > 0)
+  {
+    const LinkSample &last = linkHistory[(linkHead + LINK_HISTORY - 1) % LINK_HISTORY];
+    long rsrpSum = 0;
+    int rsrpCount = 0;
+    unsigned long rttMax = 0;
+    for (unsigned int i = 0; i < linkCount; i++)
+    {
+      if (linkHistory[i].rsrp != -999)
+      {
+        rsrpSum += linkHistory[i].rsrp;
+        rsrpCount++;
+      }
+      if (linkHistory[i].rtt > rttMax)
+        rttMax = linkHistory[i].rtt;
+    }
+    JsonObject link = doc.createNestedObject("LINK");
+    link["QUALITY"] = (int)linkQuality;
+    link["RSSI"] = last.rssi;
+    link["RSRP"] = last.rsrp;
+    link["RSRQ"] = last.rsrq;
+    link["SINR"] = last.sinr;
+    link["REG"] = last.reg;
+    link["RTT"] = last.rtt;
+    link["RTT_MAX"] = rttMax;
+    if (rsrpCount > 0)
+      link["RSRP_AVG"] = rsrpSum / rsrpCount;
+    link["SAMPLES"] = linkCount;
+  }
+  if (timeSynced)
+  {
+    doc["TIME"] = (uint32_t)(epochMillis() / 1000);
+    doc["SKEW"] = lastClockSkewMs;
+    doc["LATENCY"] = lastAlertLatencyMs;
+  }
+  JsonObject gnss = doc.createNestedObject("GNSS");
+  gnss["FIX"] = gnssFixed;
+  gnss["TTFF"] = ttffMs;
+  gnss["AIDED"] = gnssAided;
+  gnss["TTFF_COLD"] = lastColdTtffMs;
+  gnss["TTFF_AIDED"] = lastAidedTtffMs;
+  if (timeSynced && agnssTime > 0)
+    gnss["AGE"] = (uint32_t)(epochMillis() / 1000 - agnssTime);
+  JsonObject boot = doc.createNestedObject("BOOT");
+  for (int i = 0; i < BOOT_STAGES; i++)
+    boot[BOOT_STAGE_NAMES[i]] = bootStageTime[i];
+  boot["ARMED"] = bootArmedMs;
+  doc["AUDIO_START"] = lastAlertStartMs;
+  if (relayReady)
+  {
+    JsonObject relay = doc.createNestedObject("RELAY");
+    relay["TX"] = relaySent;
+    relay["RX"] = relayAccepted;
+    relay["BAD"] = relayRejected;
+    relay["DROP"] = relayOverflows;
+    relay["HOPS"] = relayLastHops;
+  }
+  if (journalReady)
+  {
+    JsonObject log = doc.createNestedObject("JOURNAL");
+    log["SEQ"] = journalSeq;
+    log["DROP"] = journalDropped;
+  }
+  doc["BOOTS"] = bootCount;
+  doc["SAFE"] = safeMode;
+  doc["BAUD"] = modemBaud;
+  doc["UART_OVF"] = uartOverflows;
+  doc["LOG_DROP"] = logDropped.load();
+  if (captureOn || captureDropped.load() > 0)
+  {
+    JsonObject capture = doc.createNestedObject("CAPTURE");
+    capture["ON"] = captureOn.load();
+    capture["FILE"] = captureFile;
+    capture["DROP"] = captureDropped.load();
+  }
+  JsonObject limits = doc.createNestedObject("SHED");
+  for (int i = 0; i < COMMAND_LIMIT_COUNT; i++)
+  {
+    if (commandShed[i] > 0)
+      limits[COMMAND_LIMITS[i].code] = commandShed[i];
+  }
+  doc["COALESCED"] = commandsCoalesced;
+  JsonObject certs = doc.createNestedObject("CERTS");
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+    certs[CERT_ROLES[i].setting] = certSha[i].substring(0, 8);
+
+  serializeJson(doc, output);
+  publishInfo(output, linkQuality == LINK_GOOD ? 0 : 1);
+  statusPending = false;
+}
+
+/**
+ * Handles a STATUS request. On a poor link the reply is deferred and repeated
+ * requests within STATUS_COALESCE_WINDOW are answered by a single publish.
+ */
+void requestStatus()
+{
+  if (linkQuality != LINK_POOR)
+  {
+    Publish_LIVE_NOW();
+    return;
+  }
+  if (!statusPending)
+  {
+    statusPending = true;
+    statusRequestedAt = millis();
+  }
+}
+
+/**
+ * Publishes the MQTTBENCH report and ends the run.
+ * 
+ * @param echoMs the round trip of the ECHO probe, -1 if it did not come back.
+ */
+void finishMqttBench(long echoMs)
+{
+  String output = "";
+  StaticJsonDocument<256> doc;
+  doc["DEVICE_ID"] = DEVICE_ID;
+  JsonObject bench = doc.createNestedObject("MQTTBENCH");
+  bench["TRANSPORT"] = MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB ? "PUBSUB" : "AT";
+  bench["COUNT"] = benchCount;
+  bench["SIZE"] = benchSize;
+  bench["QOS"] = benchQos;
+  bench["FAILED"] = benchFailed;
+  bench["MS"] = benchMs;
+  bench["ECHO"] = echoMs;
+  serializeJson(doc, output);
+  publishInfo(output, 1);
+  benchEchoPending = false;
+}
+
+/**
+ * Handles an MQTTBENCH command: publishes "count" INFO messages of about "size"
+ * bytes at "qos" to time the uplink, then sends an ECHO probe to the device's own SUB
+ * topic to time the broker-to-device path an alert takes. The messages go out one
+ * per loop() pass from mqttBenchLoop(), so alerts and other commands are served in
+ * between and MS is the uplink time under the device's normal work. The report goes
+ * out when the probe returns or after MQTT_ECHO_TIMEOUT. Run it on both
+ * MQTT_TRANSPORT builds to compare them; the echo needs the device policy to allow
+ * publishing on its SUB topic.
+ * 
+ * @param command the parsed command.
+ */
+void startMqttBench(JsonDocument &command)
+{
+  if (benchPublishing || benchEchoPending)
+    return;
+  benchCount = constrain(command["count"] | 20, 1, MQTT_BENCH_MAX_COUNT);
+  benchSize = constrain(command["size"] | 256, 32, MQTT_BENCH_MAX_SIZE);
+  benchQos = (command["qos"] | 0) ? 1 : 0;
+  benchFailed = 0;
+  benchSent = 0;
+
+  int padding = (int)benchSize - (int)DEVICE_ID.length() - 40;
+  benchPad = "";
+  while ((int)benchPad.length() < padding)
+    benchPad += 'x';
+  benchStartedAt = millis();
+  benchPublishing = true;
+}
+
+/**
+ * Sends the ECHO probe that ends an MQTTBENCH run.
+ */
+void sendBenchProbe()
+{
+  String probe = "{\"message\":\"ECHO\"}";
+  benchEchoSentAt = millis();
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  bool sent = mqtt.publish(TOPIC_SUB.c_str(), probe.c_str());
+#else
+  bool sent = publishViaModem("AT+QMTPUBEX=0,0,0,0,\"" + TOPIC_SUB + "\",", probe, 0);
+#endif
+  if (sent)
+    benchEchoPending = true;
+  else
+    finishMqttBench(-1);
+}
+
+/**
+ * Publishes the next MQTTBENCH message, sends the probe after the last one, and
+ * gives up on a probe that did not return within MQTT_ECHO_TIMEOUT.
+ */
+void mqttBenchLoop()
+{
+  if (benchPublishing)
+  {
+    if (!publishInfo("{\"DEVICE_ID\":\"" + DEVICE_ID + "\",\"BENCH\":" + String(benchSent) + ",\"PAD\":\"" + benchPad + "\"}", benchQos))
+      benchFailed++;
+    if (++benchSent < benchCount)
+      return;
+    benchPublishing = false;
+    benchMs = millis() - benchStartedAt;
+    benchPad = "";
+    sendBenchProbe();
+    return;
+  }
+  if (benchEchoPending && millis() - benchEchoSentAt >= MQTT_ECHO_TIMEOUT)
+    finishMqttBench(-1);
+}
+
+/**
+ * Decodes one mono IMA-ADPCM block as laid out in WAV files: a 4-byte header with
+ * the first sample and step index, then two samples per byte, low nibble first.
+ * 
+ * @param in the block, possibly shorter than the block size at the end of the file.
+ * @param length the number of bytes in the block.
+ * @param out receives up to (length - 4) * 2 + 1 samples.
+ * 
+ * @return the number of samples decoded.
+ */
+size_t decodeImaBlock(const uint8_t *in, size_t length, int16_t *out)
+{
+  if (length < 4)
+    return 0;
+  int predictor = (int16_t)(in[0] | (in[1] << 8));
+  int index = constrain((int)in[2], 0, 88);
+  size_t count = 0;
+  out[count++] = predictor;
+  for (size_t i = 4; i < length; i++)
+  {
+    for (int shift = 0; shift <= 4; shift += 4)
+    {
+      int nibble = (in[i] >> shift) & 0x0F;
+      int step = IMA_STEPS[index];
+      int diff = step >> 3;
+      if (nibble & 4)
+        diff += step;
+      if (nibble & 2)
+        diff += step >> 1;
+      if (nibble & 1)
+        diff += step >> 2;
+      predictor = constrain(predictor + ((nibble & 8) ? -diff : diff), -32768, 32767);
+      index = constrain(index + IMA_INDEX_STEP[nibble], 0, 88);
+      out[count++] = predictor;
+    }
+  }
+  return count;
+}
+
+/**
+ * Opens a WAV clip and positions it at the start of its samples. 16-bit PCM (mono
+ * or stereo) and mono IMA-ADPCM with blocks up to PCM_MAX_BLOCK bytes are accepted.
+ * 
+ * @param path the file on the SD card.
+ * 
+ * @return true if the file is a supported WAV clip.
+ */
+bool openPcmClip(const String &path)
+{
+  File file = SD.open(path);
+  if (!file)
+    return false;
+  uint8_t header[16];
+  if (file.read(header, 12) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+  {
+    file.close();
+    return false;
+  }
+  uint16_t format = 0;
+  uint16_t bits = 0;
+  while (file.read(header, 8) == 8)
+  {
+    uint32_t size = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+    if (memcmp(header, "fmt ", 4) == 0 && size >= 16 && file.read(header, 16) == 16)
+    {
+      format = header[0] | (header[1] << 8);
+      pcmChannels = header[2] | (header[3] << 8);
+      pcmRate = header[4] | (header[5] << 8) | (header[6] << 16) | ((uint32_t)header[7] << 24);
+      pcmBlockAlign = header[12] | (header[13] << 8);
+      bits = header[14] | (header[15] << 8);
+      size -= 16;
+    }
+    else if (memcmp(header, "data", 4) == 0)
+    {
+      bool pcm = format == WAVE_FORMAT_PCM && bits == 16 && (pcmChannels == 1 || pcmChannels == 2);
+      bool adpcm = format == WAVE_FORMAT_IMA_ADPCM && bits == 4 && pcmChannels == 1 && pcmBlockAlign > 4 && pcmBlockAlign <= PCM_MAX_BLOCK;
+      if (!pcm && !adpcm)
+        break;
+      pcmFormat = format;
+      pcmDataLeft = size;
+      pcmSampleCount = 0;
+      pcmSamplePos = 0;
+      pcmFile = file;
+      return true;
+    }
+    // chunks are padded to an even size
+    file.seek(file.position() + size + (size & 1));
+  }
+  file.close();
+  return false;
+}
+
+/**
+ * Reads and decodes the next block of the open clip into `pcmSamples`.
+ * 
+ * @return false at the end of the clip.
+ */
+bool refillPcm()
+{
+  size_t want = pcmFormat == WAVE_FORMAT_IMA_ADPCM ? pcmBlockAlign : PCM_MAX_BLOCK;
+  want = min((uint32_t)want, pcmDataLeft);
+  size_t got = want > 0 ? pcmFile.read(pcmBlock, want) : 0;
+  if (got == 0)
+    return false;
+  pcmDataLeft -= got;
+  if (pcmFormat == WAVE_FORMAT_IMA_ADPCM)
+    pcmSampleCount = decodeImaBlock(pcmBlock, got, pcmSamples);
+  else
+  {
+    pcmSampleCount = got / (2 * pcmChannels) * pcmChannels;
+    memcpy(pcmSamples, pcmBlock, pcmSampleCount * 2);
+  }
+  pcmSamplePos = 0;
+  return pcmSampleCount > 0;
+}
+
+/**
+ * Moves decoded samples into the I2S DMA ring until it is full, duplicating mono
+ * samples to both channels. Never blocks.
+ * 
+ * @return false once the whole clip has been queued.
+ */
+bool pcmLoop()
+{
+  while (true)
+  {
+    if (pcmSamplePos >= pcmSampleCount && !refillPcm())
+      return false;
+    size_t frames = min((size_t)PCM_STAGE_FRAMES, (pcmSampleCount - pcmSamplePos) / pcmChannels);
+    for (size_t i = 0; i < frames; i++)
+    {
+      const int16_t *frame = pcmSamples + pcmSamplePos + i * pcmChannels;
+      pcmStage[2 * i] = frame[0];
+      pcmStage[2 * i + 1] = frame[pcmChannels - 1];
+    }
+    size_t written = 0;
+    i2s_write(PCM_I2S_PORT, pcmStage, frames * 4, &written, 0);
+    pcmSamplePos += written / 4 * pcmChannels;
+    if (written < frames * 4)
+      return true;
+  }
+}
+
+/**
+ * Stops feeding the PCM clip once all of it is queued. Up to PCM_DMA_BUFFERS *
+ * PCM_DMA_FRAMES frames are still in the DMA ring and play out; with
+ * tx_desc_auto_clear the driver sends silence once the ring runs dry, so it is not
+ * zeroed here.
+ */
+void finishPcm()
+{
+  if (pcmPlaying)
+    pcmFile.close();
+  pcmPlaying = false;
+}
+
+/**
+ * Stops the PCM clip at once and silences the DMA ring.
+ */
+void stopPcm()
+{
+  finishPcm();
+  if (pcmDriverReady)
+    i2s_zero_dma_buffer(PCM_I2S_PORT);
+}
+
+/**
+ * Starts a pre-transcoded clip: the .wav next to an .mp3 alert, or the file itself
+ * when it is a WAV (as cached clips may be). The DMA ring is filled before
+ * returning, so the first sample goes out at once.
+ * 
+ * @param file the clip as named in ALERT_CLIPS or the clip cache.
+ * 
+ * @return true if a WAV clip is playing.
+ */
+bool startPcmClip(const char *file)
+{
+  String path = file;
+  bool opened = false;
+  if (path.endsWith(".mp3"))
+    opened = openPcmClip(path.substring(0, path.length() - 4) + ".wav");
+  if (!opened && !openPcmClip(path))
+    return false;
+
+  if (!pcmDriverReady)
+  {
+    i2s_config_t config = {};
+    config.mode = I2S_MODE_MASTER | I2S_MODE_TX;
+    config.sample_rate = pcmRate;
+    config.bits_per_sample = I2S_BITS_PER_SAMPLE_16BIT;
+    config.channel_format = I2S_CHANNEL_FMT_RIGHT_LEFT;
+    config.communication_format = I2S_COMM_FORMAT_STAND_I2S;
+    config.dma_buf_count = PCM_DMA_BUFFERS;
+    config.dma_buf_len = PCM_DMA_FRAMES;
+    config.tx_desc_auto_clear = true;
+    pcmDriverReady = i2s_driver_install(PCM_I2S_PORT, &config, 0, NULL) == ESP_OK;
+    if (!pcmDriverReady)
+    {
+      pcmFile.close();
+      return false;
+    }
+  }
+  // the amplifier pins are shared with the MP3 decoder on I2S_NUM_0
+  i2s_pin_config_t pins = {I2S_PIN_NO_CHANGE, I2S_BCLK, I2S_LRC, I2S_DOUT, I2S_PIN_NO_CHANGE};
+  i2s_set_pin(PCM_I2S_PORT, &pins);
+  pcmOwnsPins = true;
+  i2s_set_clk(PCM_I2S_PORT, pcmRate, I2S_BITS_PER_SAMPLE_16BIT, I2S_CHANNEL_STEREO);
+  i2s_zero_dma_buffer(PCM_I2S_PORT);
+  pcmPlaying = true;
+  // a clip that fits in the DMA ring is queued whole here
+  if (!pcmLoop())
+    finishPcm();
+  return true;
+}
+
+/**
+ * Makes the modem speak a line through its own codec with AT+QTTS. The text comes
+ * from the broker and from peers, so only printable ASCII and whole UTF-8
+ * characters are kept: control characters become spaces, so a CR or LF cannot end
+ * the command and start another, quotes and stray bytes are dropped, and the text
+ * is truncated to TTS_MAX_TEXT bytes without splitting a character.
+ * 
+ * @param text the line to speak.
+ */
+void speakViaModem(const String &text)
+{
+  String line = "";
+  unsigned int i = 0;
+  while (i < text.length())
+  {
+    uint8_t c = text[i];
+    unsigned int size = c < 0x80 ? 1 : c >= 0xC2 && c <= 0xDF ? 2 : c >= 0xE0 && c <= 0xEF ? 3 : c >= 0xF0 && c <= 0xF4 ? 4 : 0;
+    for (unsigned int k = 1; k < size; k++)
+    {
+      if (i + k >= text.length() || ((uint8_t)text[i + k] & 0xC0) != 0x80)
+        size = 0;
+    }
+    if (size == 0)
+    {
+      i++;
+      continue;
+    }
+    if (line.length() + size > TTS_MAX_TEXT)
+      break;
+    if (size > 1)
+      line += text.substring(i, i + size);
+    else if (c < 0x20)
+      line += ' ';
+    else if (c != '"' && c != 0x7F)
+      line += (char)c;
+    i += size;
+  }
+  sendATCommand("AT+QTTS=2,\"" + line + "\"");
+  lastSpeech = millis();
+}
+
+/**
+ * Switches an active alert to the modem voice path and speaks its line.
+ * 
+ * @param speech the line to speak, repeated until the user stops the alert.
+ */
+void fallBackToModem(const String &speech)
+{
+  LOG_INFO("Voicing alert through the modem");
+  if (alertOutput == OUTPUT_I2S)
+    audio.stopSong();
+  else if (alertOutput == OUTPUT_PCM)
+    stopPcm();
+  alertOutput = OUTPUT_MODEM;
+  alertSpeech = speech;
+  speakViaModem(alertSpeech);
+  receiptSounding();
+}
+
+/**
+ * Starts an alert: the clip from the SD card through I2S when that chain is up,
+ * preferring a pre-transcoded WAV over the MP3 decoder, otherwise the modem voice.
+ * A clip that does not start within ALERT_START_DEADLINE is replaced by the modem
+ * voice from loop().
+ * 
+ * @param clip the alert to sound.
+ * @param text optional free text from the MQTT payload, spoken instead of the
+ * default line when the modem voice is used.
+ */
+void playAlert(const AlertClip &clip, const char *text)
+{
+  mainFlag = 1;
+  flagChangeTime = millis();
+  alertStarted = false;
+  alertSpeech = text ? text : clip.speech;
+  if (sdReady && startPcmClip(clip.file))
+  {
+    alertOutput = OUTPUT_PCM;
+    alertStarted = true;
+    lastAlertStartMs = millis() - flagChangeTime;
+    receiptSounding();
+  }
+  else
+  {
+    if (pcmOwnsPins)
+    {
+      // route the amplifier pins back to the decoder's I2S port
+      audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
+      pcmOwnsPins = false;
+    }
+    if (sdReady && i2sReady && audio.connecttoFS(SD, clip.file))
+      alertOutput = OUTPUT_I2S;
+    else
+      fallBackToModem(alertSpeech);
+  }
+  vibrate(VibraMotor, 2000);
+}
+
+/**
+ * Starts a free-text alert, which is always spoken by the modem.
+ * 
+ * @param text the line to speak.
+ */
+void speakAlert(const char *text)
+{
+  mainFlag = 1;
+  flagChangeTime = millis();
+  alertStarted = true;
+  fallBackToModem(text);
+  vibrate(VibraMotor, 2000);
+}
+
+/**
+ * Keeps the active alert sounding: feeds the decoder, enforces the start deadline
+ * of the SD clip and repeats the modem voice.
+ */
+void alertLoop()
+{
+  if (alertOutput == OUTPUT_I2S)
+  {
+    audio.loop();
+    if (!alertStarted && audio.isRunning())
+    {
+      alertStarted = true;
+      lastAlertStartMs = millis() - flagChangeTime;
+      receiptSounding();
+    }
+    if (!alertStarted && millis() - flagChangeTime >= ALERT_START_DEADLINE)
+      fallBackToModem(alertSpeech);
+  }
+  else if (alertOutput == OUTPUT_PCM)
+  {
+    if (pcmPlaying && !pcmLoop())
+      finishPcm();
+  }
+  else if (alertOutput == OUTPUT_MODEM && millis() - lastSpeech >= TTS_REPEAT_INTERVAL)
+    speakViaModem(alertSpeech);
+}
+
+/**
+ * Silences whichever output is sounding the alert.
+ */
+void stopAlert()
+{
+  if (alertOutput == OUTPUT_I2S)
+    audio.stopSong();
+  else if (alertOutput == OUTPUT_PCM)
+    stopPcm();
+  else if (alertOutput == OUTPUT_MODEM)
+    sendATCommand("AT+QTTS=0");
+  alertOutput = OUTPUT_NONE;
+}
+
+/**
+ * Persists the current download so it resumes after a link drop or a reboot.
+ */
+void saveOtaState()
+{
+  prefs.begin(OTA_NAMESPACE, false);
+  prefs.putString("url", otaUrl);
+  prefs.putString("sha256", otaSha256);
+  prefs.putString("sig", otaSignature);
+  prefs.putUInt("size", otaSize);
+  prefs.putUInt("offset", otaOffset);
+  prefs.end();
+}
+
+/**
+ * Abandons the current update and forgets its persisted state.
+ * 
+ * @param reason printed to the console.
+ */
+void abortOta(const char *reason)
+{
+  LOG_ERROR("OTA aborted: %s", reason);
+  journal(JOURNAL_ERROR, 0, otaOffset, reason);
+  otaActive = false;
+  otaReady = false;
+  prefs.begin(OTA_NAMESPACE, false);
+  prefs.clear();
+  prefs.end();
+}
+
+/**
+ * Starts an update requested over MQTT, e.g.
+ * {"message":"OTA","url":"https://host/fw.bin","size":912384,"sha256":"<hex>","sig":"<hex DER>"}.
+ * A request for the image that is already being downloaded resumes it instead of
+ * starting over.
+ * 
+ * @param command the parsed MQTT message.
+ */
+void startOta(JsonDocument &command)
+{
+  const char *url = command["url"];
+  const char *sha256 = command["sha256"];
+  const char *sig = command["sig"];
+  uint32_t size = command["size"] | 0;
+  if (!url || !sha256 || !sig || size == 0 || strlen(sha256) != 64)
+  {
+    LOG_ERROR("OTA command is missing url, size, sha256 or sig");
+    return;
+  }
+  otaPartition = esp_ota_get_next_update_partition(NULL);
+  if (!otaPartition || size > otaPartition->size)
+  {
+    LOG_ERROR("OTA image does not fit the update partition");
+    return;
+  }
+  if (otaSha256 != sha256 || otaUrl != url)
+    otaOffset = 0;
+  otaUrl = url;
+  otaSha256 = sha256;
+  otaSignature = sig;
+  otaSize = size;
+  otaActive = true;
+  otaReady = false;
+  otaFailures = 0;
+  saveOtaState();
+  LOG_INFO("OTA started at offset %lu", (unsigned long)otaOffset);
+}
+
+/**
+ * Restores an update that was interrupted by a reboot.
+ */
+void resumeOta()
+{
+  prefs.begin(OTA_NAMESPACE, true);
+  otaUrl = prefs.getString("url", "");
+  otaSha256 = prefs.getString("sha256", "");
+  otaSignature = prefs.getString("sig", "");
+  otaSize = prefs.getUInt("size", 0);
+  otaOffset = prefs.getUInt("offset", 0);
+  prefs.end();
+  otaPartition = esp_ota_get_next_update_partition(NULL);
+  otaActive = otaUrl.length() > 0 && otaSize > 0 && otaPartition;
+  if (otaActive)
+  {
+    LOG_INFO("Resuming OTA at offset %lu", (unsigned long)otaOffset);
+  }
+}
+
+/**
+ * Configures the modem HTTP(S) client and sets the URL for the following requests.
+ * 
+ * @param url the URL to download from.
+ * 
+ * @return true if the modem accepted the URL.
+ */
+bool openHttpSession(const String &url)
+{
+  queryATCommand("AT+QHTTPCFG=\"contextid\",1", AT_TIMEOUT);
+  queryATCommand("AT+QHTTPCFG=\"requestheader\",1", AT_TIMEOUT);
+  queryATCommand("AT+QHTTPCFG=\"responseheader\",0", AT_TIMEOUT);
+  if (url.startsWith("https://"))
+    queryATCommand("AT+QHTTPCFG=\"sslctxid\",1", AT_TIMEOUT);
+  sendATCommand("AT+QHTTPURL=" + String(url.length()) + ",30");
+  if (waitForResponse("CONNECT", AT_TIMEOUT).indexOf("CONNECT") == -1)
+    return false;
+  LTE_Serial.print(url);
+  if (waitForResponse("OK\r\n", AT_TIMEOUT).indexOf("OK") == -1)
+    return false;
+  httpSessionUrl = url;
+  return true;
+}
+
+/**
+ * Tells whether the modem HTTP client has nothing for `sink` to do yet: another
+ * sink's request is in flight, or the response to its own has not arrived.
+ */
+bool httpPending(HttpSink sink)
+{
+  if (!httpOwner)
+    return false;
+  if (httpOwner != sink)
+    return true;
+  return !httpAnswered && millis() - httpSentAt < OTA_HTTP_TIMEOUT * 1000UL + AT_TIMEOUT;
+}
+
+/**
+ * Downloads one byte range with a ranged GET, one step per call so loop() keeps
+ * receiving alerts while the server answers. The first call sends the request and
+ * returns HTTP_PENDING; the +QHTTPGET report is picked up by noteSocketUrc() from
+ * whoever reads the UART next. Once it has arrived, the call with the same
+ * arguments streams the body from AT+QHTTPREAD into `sink` in OTA_READ_BUFFER
+ * pieces, which takes only as long as the UART transfer. The HTTP session is
+ * reopened on the next request after any failure, since a link drop may have torn
+ * it down.
+ * 
+ * @param url the URL to download from.
+ * @param offset the first byte of the range.
+ * @param length the number of bytes in the range.
+ * @param total the size of the whole resource; a plain 200 is accepted when the
+ * range covers all of it.
+ * @param sink receives the data with its offset in the resource, and identifies
+ * the transfer between calls.
+ * 
+ * @return HTTP_COMPLETE once the whole range was handed to `sink`, HTTP_PENDING
+ * while the request is in flight or another sink's is, HTTP_FAILED otherwise.
+ */
+HttpResult httpGetRange(const String &url, uint32_t offset, uint32_t length, uint32_t total, HttpSink sink)
+{
+  if (httpPending(sink))
+    return HTTP_PENDING;
+  if (!httpOwner)
+  {
+    if (httpSessionUrl != url && !openHttpSession(url))
+      return HTTP_FAILED;
+    httpSessionUrl = "";
+
+    int hostStart = url.indexOf("://") + 3;
+    int pathStart = url.indexOf('/', hostStart);
+    String host = url.substring(hostStart, pathStart == -1 ? url.length() : pathStart);
+    String path = pathStart == -1 ? "/" : url.substring(pathStart);
+    String request = "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nRange: bytes=" +
+                     String(offset) + "-" + String(offset + length - 1) + "\r\nConnection: keep-alive\r\n\r\n";
+
+    sendATCommand("AT+QHTTPGET=" + String(OTA_HTTP_TIMEOUT) + "," + String(request.length()));
+    if (waitForResponse("CONNECT", AT_TIMEOUT).indexOf("CONNECT") == -1)
+      return HTTP_FAILED;
+    httpOwner = sink;
+    httpAnswered = false;
+    httpSentAt = millis();
+    LTE_Serial.print(request);
+    // a fast server may answer along with the OK
+    waitForResponse("OK\r\n", AT_TIMEOUT);
+    return HTTP_PENDING;
+  }
+
+  httpOwner = nullptr;
+  bool whole = offset == 0 && length == total;
+  if (!httpAnswered || httpError != 0 || !(httpStatus == 206 || (httpStatus == 200 && whole)))
+    return HTTP_FAILED;
+
+  // read up to the CONNECT line only, the body follows right behind it
+  sendATCommand("AT+QHTTPREAD=" + String(OTA_HTTP_TIMEOUT));
+  String header = "";
+  unsigned long start = millis();
+  while (!header.endsWith("CONNECT\r\n") && !header.endsWith("ERROR\r\n") && millis() - start < AT_TIMEOUT)
+  {
+    if (!LTE_Serial.available())
+    {
+      delay(1);
+      continue;
+    }
+    header += (char)LTE_Serial.read();
+  }
+  if (!header.endsWith("CONNECT\r\n"))
+    return HTTP_FAILED;
+  uint8_t buffer[OTA_READ_BUFFER];
+  uint32_t received = 0;
+  while (received < length)
+  {
+    size_t wanted = min((uint32_t)sizeof(buffer), length - received);
+    size_t got = LTE_Serial.readBytes(buffer, wanted);
+    if (got == 0 || !sink(offset + received, buffer, got))
+      return HTTP_FAILED;
+    received += got;
+    esp_task_wdt_reset();
+  }
+  if (waitForResponse("+QHTTPREAD:", AT_TIMEOUT).indexOf("+QHTTPREAD: 0") == -1)
+    return HTTP_FAILED;
+  httpSessionUrl = url;
+  return HTTP_COMPLETE;
+}
+
+/**
+ * HttpSink that writes image data into the update partition.
+ */
+bool writeOtaData(uint32_t offset, const uint8_t *data, size_t length)
+{
+  return esp_partition_write(otaPartition, offset, data, length) == ESP_OK;
+}
+
+/**
+ * Downloads the next OTA_CHUNK_SIZE bytes of the image into the update partition,
+ * erasing them when the request goes out.
+ * 
+ * @return the httpGetRange() result for the chunk.
+ */
+HttpResult fetchOtaChunk()
+{
+  uint32_t length = min((uint32_t)OTA_CHUNK_SIZE, otaSize - otaOffset);
+  if (!httpOwner && esp_partition_erase_range(otaPartition, otaOffset, (length + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE) != ESP_OK)
+    return HTTP_FAILED;
+  return httpGetRange(otaUrl, otaOffset, length, otaSize, writeOtaData);
+}
+
+/**
+ * Converts a hex string into bytes.
+ * 
+ * @return the number of bytes written to `out`, or 0 on malformed input.
+ */
+size_t hexToBytes(const String &hex, uint8_t *out, size_t capacity)
+{
+  if (hex.length() % 2 != 0 || hex.length() / 2 > capacity)
+    return 0;
+  for (size_t i = 0; i < hex.length() / 2; i++)
+  {
+    char pair[3] = {hex[2 * i], hex[2 * i + 1], 0};
+    char *end;
+    out[i] = strtoul(pair, &end, 16);
+    if (*end != 0)
+      return 0;
+  }
+  return hex.length() / 2;
+}
+
+/**
+ * Compares a SHA-256 digest with its expected hex form.
+ */
+bool digestMatches(const uint8_t *digest, const String &hex)
+{
+  uint8_t expected[32];
+  return hexToBytes(hex, expected, sizeof(expected)) == sizeof(expected) && memcmp(digest, expected, sizeof(expected)) == 0;
+}
+
+/**
+ * Checks a release signature, ECDSA under OTA_PUBLIC_KEY, over a SHA-256 digest.
+ * 
+ * @param digest the 32-byte digest that was signed.
+ * @param signature the DER signature in hex.
+ * 
+ * @return true if the signature is valid.
+ */
+bool releaseSigned(const uint8_t *digest, const String &signature)
+{
+  uint8_t bytes[80];
+  size_t length = hexToBytes(signature, bytes, sizeof(bytes));
+  const char *key = OTA_PUBLIC_KEY;
+  mbedtls_pk_context pk;
+  mbedtls_pk_init(&pk);
+  bool valid = length > 0 && strlen(key) > 0 &&
+               mbedtls_pk_parse_public_key(&pk, (const unsigned char *)key, strlen(key) + 1) == 0 &&
+               mbedtls_pk_verify(&pk, MBEDTLS_MD_SHA256, digest, 32, bytes, length) == 0;
+  mbedtls_pk_free(&pk);
+  return valid;
+}
+
+/**
+ * Hashes the downloaded image in the update partition and checks it against the
+ * expected SHA-256 and the release signature.
+ * 
+ * @return true if both the digest and the signature match.
+ */
+bool verifyOtaImage()
+{
+  uint8_t buffer[OTA_READ_BUFFER];
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  for (uint32_t pos = 0; pos < otaSize; pos += sizeof(buffer))
+  {
+    size_t length = min((uint32_t)sizeof(buffer), otaSize - pos);
+    esp_partition_read(otaPartition, pos, buffer, length);
+    mbedtls_sha256_update(&sha, buffer, length);
+  }
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+
+  if (!digestMatches(digest, otaSha256))
+  {
+    LOG_ERROR("OTA image SHA-256 mismatch");
+    return false;
+  }
+
+  bool valid = releaseSigned(digest, otaSignature);
+  if (!valid)
+    LOG_ERROR("OTA image signature rejected");
+  return valid;
+}
+
+/**
+ * Advances a pending update by one chunk at a time, verifies the image once it is
+ * complete, and switches the boot partition after the device has been idle for
+ * OTA_IDLE_BEFORE_SWAP so a restart never interrupts an alert.
+ */
+void otaLoop()
+{
+  if (!otaActive)
+    return;
+  if (otaReady)
+  {
+    if (millis() - flagChangeTime >= OTA_IDLE_BEFORE_SWAP)
+    {
+      prefs.begin(OTA_NAMESPACE, false);
+      prefs.clear();
+      prefs.end();
+      if (esp_ota_set_boot_partition(otaPartition) == ESP_OK)
+      {
+        LOG_INFO("OTA complete, restarting into the new image");
+        restartDevice();
+      }
+      abortOta("boot partition switch failed");
+    }
+    return;
+  }
+
+  if (httpPending(writeOtaData))
+    return;
+  HttpResult result = fetchOtaChunk();
+  if (result == HTTP_PENDING)
+    return;
+  if (result == HTTP_FAILED)
+  {
+    if (++otaFailures >= OTA_MAX_FAILURES)
+      abortOta("too many failed chunks");
+    return;
+  }
+  otaFailures = 0;
+  otaOffset += min((uint32_t)OTA_CHUNK_SIZE, otaSize - otaOffset);
+  saveOtaState();
+  if (otaOffset < otaSize)
+    return;
+  if (verifyOtaImage())
+    otaReady = true;
+  else
+    abortOta("verification failed");
+}
+
+/**
+ * Finds the cached clip that overrides or extends the alert with the given code.
+ * 
+ * @return the index into `cachedClips`, or -1.
+ */
+int findCachedClip(const String &code)
+{
+  for (unsigned int i = 0; i < cachedClipCount; i++)
+  {
+    if (cachedClips[i].code == code)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Tells whether a message code plays an alert, a built-in or cached clip or TTS,
+ * rather than running a command.
+ */
+bool isAlertCode(const String &code)
+{
+  if (code == "TTS" || findCachedClip(code) != -1)
+    return true;
+  for (const AlertClip &clip : ALERT_CLIPS)
+  {
+    if (code == clip.code)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * The file of a cached clip: <sha256>.wav for a WAV, which startPcmClip() plays
+ * without the decoder, <sha256>.mp3 otherwise.
+ */
+String cachedClipFile(const String &sha256)
+{
+  String wav = CLIP_DIR "/" + sha256 + ".wav";
+  return SD.exists(wav) ? wav : CLIP_DIR "/" + sha256 + ".mp3";
+}
+
+/**
+ * Loads the clip index from the SD card. An index.tmp left by an interrupted save is
+ * used when index.json itself is missing.
+ */
+void loadClipIndex()
+{
+  if (!SD.exists(CLIP_DIR))
+    SD.mkdir(CLIP_DIR);
+  if (!SD.exists(CLIP_INDEX) && SD.exists(CLIP_INDEX_TMP))
+    SD.rename(CLIP_INDEX_TMP, CLIP_INDEX);
+  File file = SD.open(CLIP_INDEX);
+  if (!file)
+    return;
+  DynamicJsonDocument index(4096);
+  DeserializationError error = deserializeJson(index, file);
+  file.close();
+  if (error)
+  {
+    LOG_ERROR("Failed to parse " CLIP_INDEX ": %s", error.c_str());
+    return;
+  }
+  cachedClipCount = 0;
+  for (JsonVariant item : index.as<JsonArray>())
+  {
+    if (cachedClipCount == CLIP_CACHE_SLOTS)
+      break;
+    CachedClip &entry = cachedClips[cachedClipCount];
+    entry.code = (const char *)item["code"];
+    entry.sha256 = (const char *)item["sha256"];
+    entry.speech = (const char *)item["speech"];
+    entry.size = item["size"];
+    entry.used = item["used"];
+    entry.file = cachedClipFile(entry.sha256);
+    if (entry.used > clipUseCounter)
+      clipUseCounter = entry.used;
+    if (SD.exists(entry.file))
+      cachedClipCount++;
+  }
+}
+
+/**
+ * Writes the clip index to index.tmp and renames it over index.json, so an alert
+ * lookup after a power cut sees either the old or the new table.
+ */
+void saveClipIndex()
+{
+  DynamicJsonDocument index(4096);
+  JsonArray items = index.to<JsonArray>();
+  for (unsigned int i = 0; i < cachedClipCount; i++)
+  {
+    JsonObject item = items.createNestedObject();
+    item["code"] = cachedClips[i].code;
+    item["sha256"] = cachedClips[i].sha256;
+    item["speech"] = cachedClips[i].speech;
+    item["size"] = cachedClips[i].size;
+    item["used"] = cachedClips[i].used;
+  }
+  File file = SD.open(CLIP_INDEX_TMP, FILE_WRITE);
+  if (!file)
+    return;
+  serializeJson(index, file);
+  file.close();
+  SD.remove(CLIP_INDEX);
+  SD.rename(CLIP_INDEX_TMP, CLIP_INDEX);
+  clipIndexDirty = false;
+}
+
+/**
+ * Checks whether any cached entry refers to the clip file with this hash.
+ */
+bool clipFileInUse(const String &sha256)
+{
+  for (unsigned int i = 0; i < cachedClipCount; i++)
+  {
+    if (cachedClips[i].sha256 == sha256)
+      return true;
+  }
+  return false;
+}
+
+/**
+ * Removes one entry from the cache table, and its file once no other code uses it.
+ */
+void removeCachedClip(unsigned int slot)
+{
+  String sha256 = cachedClips[slot].sha256;
+  String file = cachedClips[slot].file;
+  cachedClips[slot] = cachedClips[--cachedClipCount];
+  if (!clipFileInUse(sha256))
+    SD.remove(file);
+}
+
+/**
+ * Evicts the least recently played clips until a new file of `size` bytes and one
+ * more entry fit within CLIP_CACHE_BYTES and CLIP_CACHE_SLOTS. Entries sharing the
+ * new file are never evicted.
+ */
+void evictClips(const String &sha256, uint32_t size)
+{
+  while (true)
+  {
+    uint32_t total = size;
+    int oldest = -1;
+    for (unsigned int i = 0; i < cachedClipCount; i++)
+    {
+      // shared files are counted once per entry, which only makes eviction eager
+      total += cachedClips[i].size;
+      if (cachedClips[i].sha256 != sha256 && (oldest == -1 || cachedClips[i].used < cachedClips[oldest].used))
+        oldest = i;
+    }
+    if ((total <= CLIP_CACHE_BYTES && cachedClipCount < CLIP_CACHE_SLOTS) || oldest == -1)
+      return;
+    LOG_INFO("Evicting clip %s", cachedClips[oldest].code.c_str());
+    removeCachedClip(oldest);
+  }
+}
+
+/**
+ * Points an alert code at a verified clip file, replacing any previous entry for
+ * the same code, and saves the index.
+ */
+void linkClip(const String &code, const String &sha256, uint32_t size, const String &speech)
+{
+  int existing = findCachedClip(code);
+  if (existing != -1)
+  {
+    String previous = cachedClips[existing].sha256;
+    String previousFile = cachedClips[existing].file;
+    cachedClips[existing] = cachedClips[--cachedClipCount];
+    if (previous != sha256 && !clipFileInUse(previous))
+      SD.remove(previousFile);
+  }
+  evictClips(sha256, size);
+  if (cachedClipCount == CLIP_CACHE_SLOTS)
+  {
+    LOG_WARN("Clip cache is full");
+    return;
+  }
+  CachedClip &entry = cachedClips[cachedClipCount++];
+  entry.code = code;
+  entry.sha256 = sha256;
+  entry.file = cachedClipFile(sha256);
+  entry.speech = speech;
+  entry.size = size;
+  entry.used = ++clipUseCounter;
+  saveClipIndex();
+  LOG_INFO("Clip linked for alert %s", code.c_str());
+}
+
+/**
+ * Persists the pending clip download, or clears it when `clipUrl` is empty.
+ */
+void saveClipState()
+{
+  prefs.begin(CLIP_NAMESPACE, false);
+  if (clipUrl.length() == 0)
+    prefs.clear();
+  else
+  {
+    prefs.putString("code", clipCode);
+    prefs.putString("url", clipUrl);
+    prefs.putString("sha256", clipSha256);
+    prefs.putString("speech", clipSpeech);
+    prefs.putUInt("size", clipSize);
+  }
+  prefs.end();
+}
+
+/**
+ * Queues a clip download requested over MQTT, e.g.
+ * {"message":"CLIP","code":"6","url":"https://host/TSUNAMI.mp3","size":48213,"sha256":"<hex>","speech":"Tsunami alert."}.
+ * A clip whose content is already cached is linked without downloading it again.
+ * 
+ * @param command the parsed MQTT message.
+ */
+void startClipDownload(JsonDocument &command)
+{
+  const char *code = command["code"];
+  const char *url = command["url"];
+  const char *sha256 = command["sha256"];
+  const char *speech = command["speech"] | "Emergency alert.";
+  uint32_t size = command["size"] | 0;
+  if (!sdReady || !code || !url || !sha256 || strlen(sha256) != 64 || size == 0 || size > CLIP_CACHE_BYTES)
+  {
+    LOG_WARN("CLIP command rejected");
+    return;
+  }
+  if (clipFileInUse(sha256))
+  {
+    linkClip(code, sha256, size, speech);
+    return;
+  }
+  if (clipUrl.length() > 0 && clipSha256 != sha256)
+  {
+    LOG_WARN("Another clip download is in progress");
+    return;
+  }
+  clipCode = code;
+  clipUrl = url;
+  clipSha256 = sha256;
+  clipSpeech = speech;
+  clipSize = size;
+  clipFailures = 0;
+  saveClipState();
+}
+
+/**
+ * Restores a clip download that was interrupted by a reboot.
+ */
+void resumeClipDownload()
+{
+  prefs.begin(CLIP_NAMESPACE, true);
+  clipCode = prefs.getString("code", "");
+  clipUrl = prefs.getString("url", "");
+  clipSha256 = prefs.getString("sha256", "");
+  clipSpeech = prefs.getString("speech", "");
+  clipSize = prefs.getUInt("size", 0);
+  prefs.end();
+}
+
+/**
+ * HttpSink that appends clip data to the partial file on the SD card.
+ */
+bool writeClipData(uint32_t, const uint8_t *data, size_t length)
+{
+  return clipFile.write(data, length) == length;
+}
+
+/**
+ * Hashes a finished download, then renames it to its content address and links it.
+ * A RIFF file is named .wav and anything else .mp3, see cachedClipFile().
+ * 
+ * @param partial the path of the downloaded file.
+ */
+void finishClipDownload(const String &partial)
+{
+  uint8_t buffer[OTA_READ_BUFFER];
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  File file = SD.open(partial);
+  size_t got;
+  bool wav = false;
+  bool first = true;
+  while ((got = file.read(buffer, sizeof(buffer))) > 0)
+  {
+    if (first)
+      wav = got >= 4 && memcmp(buffer, "RIFF", 4) == 0;
+    first = false;
+    mbedtls_sha256_update(&sha, buffer, got);
+  }
+  file.close();
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+
+  if (!digestMatches(digest, clipSha256))
+  {
+    LOG_ERROR("Clip SHA-256 mismatch");
+    SD.remove(partial);
+  }
+  else if (SD.rename(partial, CLIP_DIR "/" + clipSha256 + (wav ? ".wav" : ".mp3")))
+    linkClip(clipCode, clipSha256, clipSize, clipSpeech);
+  clipUrl = "";
+  saveClipState();
+}
+
+/**
+ * Downloads at most one CLIP_CHUNK_SIZE piece of the pending clip every
+ * CLIP_CHUNK_INTERVAL, so the transfer stays in the background of alert traffic.
+ * The size of the partial file is the resume point. Also flushes LRU updates to
+ * the index.
+ */
+void clipLoop()
+{
+  if (clipIndexDirty)
+    saveClipIndex();
+  if (clipUrl.length() == 0 || httpPending(writeClipData))
+    return;
+  if (httpOwner != writeClipData && millis() - lastClipChunk < CLIP_CHUNK_INTERVAL)
+    return;
+
+  String partial = CLIP_DIR "/" + clipSha256 + ".part";
+  clipFile = SD.open(partial, FILE_APPEND);
+  if (!clipFile)
+    return;
+  uint32_t offset = clipFile.size();
+  uint32_t length = offset < clipSize ? min((uint32_t)CLIP_CHUNK_SIZE, clipSize - offset) : 0;
+  HttpResult result = length == 0 ? HTTP_COMPLETE : httpGetRange(clipUrl, offset, length, clipSize, writeClipData);
+  clipFile.close();
+  if (result == HTTP_PENDING)
+    return;
+  lastClipChunk = millis();
+
+  if (result == HTTP_FAILED)
+  {
+    if (++clipFailures >= CLIP_MAX_FAILURES)
+    {
+      LOG_WARN("Clip download abandoned");
+      SD.remove(partial);
+      clipUrl = "";
+      saveClipState();
+    }
+    return;
+  }
+  clipFailures = 0;
+  if (offset + length >= clipSize)
+    finishClipDownload(partial);
+}
+
+/**
+ * Loads the UFS file and hash of each credential in use. Until the first rotation
+ * these are the CERT_ROLES file names loaded with the vendor tools, hash unknown.
+ * The set is one NVS value, "<file> <sha>" per role and line, written at once by
+ * commitCerts(); the per-role keys of earlier firmware are read when it is absent.
+ */
+void loadCertState()
+{
+  prefs.begin(CERT_NAMESPACE, true);
+  String set = prefs.getString(CERT_SET_KEY, "");
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    certFile[i] = prefs.getString(CERT_ROLES[i].setting, CERT_ROLES[i].file);
+    certSha[i] = prefs.getString((String(CERT_ROLES[i].setting) + "_sha").c_str(), "");
+  }
+  prefs.end();
+
+  int start = 0;
+  for (int i = 0; set.length() > 0 && i < CERT_ROLE_COUNT; i++)
+  {
+    int end = set.indexOf('\n', start);
+    String line = set.substring(start, end == -1 ? set.length() : end);
+    int space = line.indexOf(' ');
+    if (space <= 0)
+      break;
+    certFile[i] = line.substring(0, space);
+    certSha[i] = line.substring(space + 1);
+    if (end == -1)
+      break;
+    start = end + 1;
+  }
+}
+
+/**
+ * Hashes a file on the SD card.
+ * 
+ * @param path the file to hash.
+ * @param size receives the file size.
+ * 
+ * @return the SHA-256 in lowercase hex, or an empty string if the file cannot be read.
+ */
+String sha256File(const String &path, uint32_t &size)
+{
+  File file = SD.open(path);
+  if (!file)
+    return "";
+  uint8_t buffer[OTA_READ_BUFFER];
+  uint8_t digest[32];
+  mbedtls_sha256_context sha;
+  mbedtls_sha256_init(&sha);
+  mbedtls_sha256_starts(&sha, 0);
+  size = file.size();
+  size_t got;
+  while ((got = file.read(buffer, sizeof(buffer))) > 0)
+    mbedtls_sha256_update(&sha, buffer, got);
+  file.close();
+  mbedtls_sha256_finish(&sha, digest);
+  mbedtls_sha256_free(&sha);
+
+  char hex[65];
+  for (int i = 0; i < 32; i++)
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  return hex;
+}
+
+/**
+ * Returns the size of a file in the modem UFS, or -1 if there is no such file.
+ */
+int ufsFileSize(const String &name)
+{
+  // +QFLST: "UFS:<name>",<size>
+  int size = parseResponseField(queryATCommand("AT+QFLST=\"UFS:" + name + "\"", AT_TIMEOUT), "+QFLST: ", 1);
+  return size < 0 ? -1 : size;
+}
+
+/**
+ * Copies a file from the SD card into the modem UFS with AT+QFUPL, replacing any
+ * file of that name. The contents bypass the UART capture, which records a
+ * placeholder line in their place: one of the files is the device's private key.
+ * 
+ * @param path the file on the SD card.
+ * @param name the UFS file name.
+ * 
+ * @return true if the modem stored the whole file.
+ */
+bool uploadCert(const String &path, const String &name)
+{
+  File file = SD.open(path);
+  if (!file)
+    return false;
+  uint32_t size = file.size();
+  queryATCommand("AT+QFDEL=\"UFS:" + name + "\"", AT_TIMEOUT);
+  sendATCommand("AT+QFUPL=\"UFS:" + name + "\"," + String(size) + "," + String(CERT_UPLOAD_TIMEOUT));
+  if (waitForResponse("CONNECT", AT_TIMEOUT).indexOf("CONNECT") == -1)
+  {
+    file.close();
+    return false;
+  }
+  String placeholder = "<" + String(size) + " bytes of " + name + " not captured>\r\n";
+  captureBytes(CAPTURE_TX, (const uint8_t *)placeholder.c_str(), placeholder.length());
+  uint8_t buffer[256];
+  size_t got;
+  while ((got = file.read(buffer, sizeof(buffer))) > 0)
+    LTE_Serial.writeUncaptured(buffer, got);
+  file.close();
+  // +QFUPL: <upload_size>,<checksum>
+  String response = waitForResponse("OK\r\n", CERT_UPLOAD_TIMEOUT * 1000UL);
+  return parseResponseField(response, "+QFUPL: ", 0) == (int)size;
+}
+
+/**
+ * Uploads the credentials in CERT_DIR whose hash differs from the ones in use, as
+ * the trial set for this connect. Each goes to a UFS name of its own so the files
+ * in use are never overwritten, and a file already in UFS under its name with the
+ * right size is not sent again. The set is all or nothing: a client certificate
+ * without its new key would only fail the handshake.
+ * 
+ * @return true if a trial set was staged.
+ */
+bool stageCerts()
+{
+  bool staged = false;
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+    certTrialFile[i] = "";
+  if (!sdReady)
+    return false;
+
+  prefs.begin(CERT_NAMESPACE, true);
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    String path = String(CERT_DIR "/") + CERT_ROLES[i].file;
+    if (!SD.exists(path))
+      continue;
+    uint32_t size = 0;
+    String sha = sha256File(path, size);
+    String rejected = prefs.getString((String(CERT_ROLES[i].setting) + "_bad").c_str(), "");
+    if (sha.length() == 0 || sha == certSha[i] || sha == rejected || size > CERT_MAX_SIZE)
+      continue;
+    String name = String(CERT_ROLES[i].setting) + "_" + sha.substring(0, 8) + ".pem";
+    if (ufsFileSize(name) != (int)size && !uploadCert(path, name))
+    {
+      LOG_ERROR("Upload of %s failed, keeping the current credentials", path.c_str());
+      for (int j = 0; j < CERT_ROLE_COUNT; j++)
+        certTrialFile[j] = "";
+      prefs.end();
+      return false;
+    }
+    LOG_INFO("Staged %s as UFS:%s", path.c_str(), name.c_str());
+    certTrialFile[i] = name;
+    certTrialSha[i] = sha;
+    staged = true;
+  }
+  prefs.end();
+  return staged;
+}
+
+/**
+ * Points the broker SSL context at the credentials in use, or at the trial set
+ * where it has one.
+ * 
+ * @param trial whether to use the trial set.
+ */
+void applyCerts(bool trial)
+{
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    const String &name = trial && certTrialFile[i].length() > 0 ? certTrialFile[i] : certFile[i];
+    queryATCommand("AT+QSSLCFG=\"" + String(CERT_ROLES[i].setting) + "\"," + String(SSL_CONTEXT_ID) + ",\"UFS:" + name + "\"", AT_TIMEOUT);
+  }
+}
+
+/**
+ * Makes the trial set current after the broker accepted it, and deletes the files
+ * it replaced from UFS. The whole set goes to NVS in one write before anything is
+ * deleted, so a reset part way leaves either the old set or the new one in use,
+ * never a certificate of one with the key of the other or a name of a deleted file.
+ */
+void commitCerts()
+{
+  String replaced[CERT_ROLE_COUNT];
+  String set = "";
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    if (certTrialFile[i].length() > 0 && certFile[i] != certTrialFile[i])
+      replaced[i] = certFile[i];
+    if (certTrialFile[i].length() > 0)
+    {
+      certFile[i] = certTrialFile[i];
+      certSha[i] = certTrialSha[i];
+      certTrialFile[i] = "";
+    }
+    set += certFile[i] + " " + certSha[i] + "\n";
+  }
+  prefs.begin(CERT_NAMESPACE, false);
+  bool saved = prefs.putString(CERT_SET_KEY, set) == set.length();
+  prefs.end();
+  if (!saved)
+  {
+    // the old files stay, NVS may still name them after a restart
+    LOG_ERROR("Could not save the new TLS credentials");
+    return;
+  }
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    if (replaced[i].length() > 0)
+      queryATCommand("AT+QFDEL=\"UFS:" + replaced[i] + "\"", AT_TIMEOUT);
+  }
+  LOG_INFO("New TLS credentials in use");
+}
+
+/**
+ * Records the hashes of a trial set the broker refused while the old set still
+ * worked, so it is not tried again until the files in CERT_DIR change.
+ */
+void rejectCerts()
+{
+  prefs.begin(CERT_NAMESPACE, false);
+  for (int i = 0; i < CERT_ROLE_COUNT; i++)
+  {
+    if (certTrialFile[i].length() == 0)
+      continue;
+    prefs.putString((String(CERT_ROLES[i].setting) + "_bad").c_str(), certTrialSha[i]);
+    queryATCommand("AT+QFDEL=\"UFS:" + certTrialFile[i] + "\"", AT_TIMEOUT);
+    certTrialFile[i] = "";
+  }
+  prefs.end();
+  journal(JOURNAL_ERROR, 0, 0, "cert");
+  LOG_ERROR("Broker refused the new TLS credentials, keeping the old ones");
+}
+
+/**
+ * HttpSink that writes a credential to its partial file on the SD card.
+ */
+bool writeCertData(uint32_t, const uint8_t *data, size_t length)
+{
+  return certDownload.write(data, length) == length;
+}
+
+/**
+ * Starts downloading a credential into CERT_DIR for the next broker connect, e.g.
+ * {"message":"CERT","role":"clientcert","url":"https://host/client.pem","size":1224,"sha256":"<hex>","sig":"<hex DER>"}.
+ * `sig` is the release signature over the SHA-256, as for OTA, so only a credential
+ * signed with the release key is ever offered to the broker. certLoop() fetches it;
+ * with "apply":true the device restarts to connect with it at once, send it on the
+ * last file of a set.
+ * 
+ * @param command the parsed MQTT message.
+ */
+void fetchCert(JsonDocument &command)
+{
+  const char *role = command["role"];
+  const char *url = command["url"];
+  const char *sha256 = command["sha256"];
+  const char *sig = command["sig"];
+  uint32_t size = command["size"] | 0;
+  int index = -1;
+  for (int i = 0; role && i < CERT_ROLE_COUNT; i++)
+  {
+    if (strcmp(role, CERT_ROLES[i].setting) == 0)
+      index = i;
+  }
+  uint8_t digest[32];
+  if (!sdReady || index == -1 || !url || !sha256 || !sig || hexToBytes(sha256, digest, sizeof(digest)) != sizeof(digest) || size == 0 || size > CERT_MAX_SIZE)
+  {
+    LOG_WARN("CERT command rejected");
+    return;
+  }
+  if (!releaseSigned(digest, sig))
+  {
+    LOG_ERROR("CERT %s signature rejected", role);
+    journal(JOURNAL_ERROR, 0, 0, "cert sig");
+    return;
+  }
+  if (certRole != -1)
+  {
+    LOG_WARN("CERT command rejected, a download is in progress");
+    return;
+  }
+
+  if (!SD.exists(CERT_DIR))
+    SD.mkdir(CERT_DIR);
+  String partial = String(CERT_DIR "/") + CERT_ROLES[index].file + ".part";
+  SD.remove(partial);
+  certDownload = SD.open(partial, FILE_WRITE);
+  if (!certDownload)
+    return;
+  certRole = index;
+  certUrl = url;
+  certSha256 = sha256;
+  certSha256.toLowerCase();
+  certSize = size;
+  certApply = command["apply"] | false;
+}
+
+/**
+ * Advances the download a CERT command started, in the background like clipLoop()
+ * and one request at a time with the other HTTP transfers. A finished file replaces
+ * the one in CERT_DIR only when its SHA-256 matches the signed one.
+ */
+void certLoop()
+{
+  if (certRole == -1 || httpPending(writeCertData))
+    return;
+  HttpResult result = httpGetRange(certUrl, 0, certSize, certSize, writeCertData);
+  if (result == HTTP_PENDING)
+    return;
+  certDownload.close();
+  const char *role = CERT_ROLES[certRole].setting;
+  String path = String(CERT_DIR "/") + CERT_ROLES[certRole].file;
+  String partial = path + ".part";
+  certRole = -1;
+
+  uint32_t received = 0;
+  if (result != HTTP_COMPLETE || sha256File(partial, received) != certSha256 || received != certSize)
+  {
+    LOG_ERROR("CERT %s download failed", role);
+    SD.remove(partial);
+    return;
+  }
+  SD.remove(path);
+  SD.rename(partial, path);
+  LOG_INFO("CERT %s stored for the next connect", role);
+  if (certApply)
+    restartDevice();
+}
+
+/**
+ * Hashes a message ID with 32-bit FNV-1a. Zero marks an empty slot, so it is
+ * never returned.
+ */
+uint32_t hashAlertId(const String &id)
+{
+  uint32_t hash = 2166136261UL;
+  for (unsigned int i = 0; i < id.length(); i++)
+  {
+    hash ^= (uint8_t)id[i];
+    hash *= 16777619UL;
+  }
+  return hash == 0 ? 1 : hash;
+}
+
+/**
+ * Records a message ID unless it was seen among the last SEEN_ALERT_SLOTS IDs. The
+ * lookup is a bounded scan of a fixed array, so its cost does not depend on traffic;
+ * the table is persisted later by saveSeenAlerts() to keep flash writes off the
+ * alert path.
+ * 
+ * @param id the "id" field of the message.
+ * 
+ * @return true if the ID is new, false for a duplicate.
+ */
+bool rememberAlertId(const String &id)
+{
+  uint32_t hash = hashAlertId(id);
+  for (unsigned int i = 0; i < SEEN_ALERT_SLOTS; i++)
+  {
+    if (seenAlerts[i] == hash)
+      return false;
+  }
+  seenAlerts[seenAlertHead] = hash;
+  seenAlertHead = (seenAlertHead + 1) % SEEN_ALERT_SLOTS;
+  seenAlertsDirty = true;
+  return true;
+}
+
+/**
+ * Notes the "seq" of an alert from the broker. The backend numbers the alerts of
+ * each device's topic; a jump past the next number means some were lost while the
+ * session was up, and a catch-up is requested from the last one seen before it.
+ * 
+ * @param seq the sequence number, 0 when the message has none.
+ */
+void noteAlertSeq(uint32_t seq)
+{
+  if (seq == 0)
+    return;
+  if (alertSeq > 0 && seq > alertSeq + 1)
+  {
+    LOG_WARN("Alerts %lu to %lu missing, requesting a catch-up", (unsigned long)alertSeq + 1, (unsigned long)seq - 1);
+    catchupFrom = catchupPending ? min(catchupFrom, alertSeq) : alertSeq;
+    catchupPending = true;
+  }
+  if (seq > alertSeq)
+  {
+    alertSeq = seq;
+    seenAlertsDirty = true;
+  }
+}
+
+/**
+ * Asks the backend to replay the alerts numbered after `catchupFrom`. Replays go
+ * through the usual dedup and expiry checks, so ones already handled or stale are
+ * dropped. A failed publish is retried every CATCHUP_RETRY_INTERVAL by loop().
+ */
+void requestCatchup()
+{
+  String output = "";
+  StaticJsonDocument<JSON_OBJECT_SIZE(3) + 48> doc;
+  doc["DEVICE_ID"] = DEVICE_ID;
+  doc["CATCHUP"] = catchupFrom;
+  doc["CLEAN"] = CLEAN_SESSION;
+  serializeJson(doc, output);
+  lastCatchupAttempt = millis();
+  catchupPending = !publishInfo(output, 1);
+}
+
+/**
+ * Restores the recently seen IDs so broker redeliveries after a reboot are dropped too.
+ */
+void loadSeenAlerts()
+{
+  prefs.begin(DEDUP_NAMESPACE, true);
+  if (prefs.getBytes("seen", seenAlerts, sizeof(seenAlerts)) != sizeof(seenAlerts))
+    memset(seenAlerts, 0, sizeof(seenAlerts));
+  seenAlertHead = prefs.getUInt("head", 0) % SEEN_ALERT_SLOTS;
+  alertSeq = prefs.getUInt("seq", 0);
+  prefs.end();
+}
+
+/**
+ * Writes the recently seen IDs to NVS if they changed.
+ */
+void saveSeenAlerts()
+{
+  if (!seenAlertsDirty)
+    return;
+  prefs.begin(DEDUP_NAMESPACE, false);
+  prefs.putBytes("seen", seenAlerts, sizeof(seenAlerts));
+  prefs.putUInt("head", seenAlertHead);
+  prefs.putUInt("seq", alertSeq);
+  prefs.end();
+  seenAlertsDirty = false;
+}
+
+/**
+ * Restarts the device once the state loop() would have saved later is on flash and
+ * card: the seen alert IDs and seq, the buffered journal events, the console log
+ * and the UART capture.
+ */
+void restartDevice()
+{
+  saveSeenAlerts();
+  flushJournal();
+  flushLog(1000);
+  flushCapture(1000);
+  ESP.restart();
+}
+
+/**
+ * Computes the truncated HMAC that authenticates a relay frame.
+ * 
+ * @param frame the frame, with `time`, `payload` and `length` filled in.
+ * @param tag receives RELAY_TAG_SIZE bytes.
+ */
+void signRelayFrame(const RelayFrame &frame, uint8_t *tag)
+{
+  uint8_t message[sizeof(frame.time) + RELAY_MAX_PAYLOAD];
+  uint8_t digest[32];
+  memcpy(message, &frame.time, sizeof(frame.time));
+  memcpy(message + sizeof(frame.time), frame.payload, frame.length);
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                  (const unsigned char *)RELAY_KEY.c_str(), RELAY_KEY.length(),
+                  message, sizeof(frame.time) + frame.length, digest);
+  memcpy(tag, digest, RELAY_TAG_SIZE);
+}
+
+/**
+ * Checks the origin time of an authenticated relay frame, so a recorded frame cannot
+ * be played back once it has left the dedup table. Without a wall clock the newest
+ * origin time accepted so far, aged by millis(), stands in for it; until the first
+ * frame there is nothing to compare with.
+ * 
+ * @param time the origin time from the frame.
+ * 
+ * @return true if the frame is at most RELAY_MAX_AGE old and not from the future.
+ */
+bool relayFresh(uint32_t time)
+{
+  uint32_t now = time;
+  if (timeSynced)
+    now = epochMillis() / 1000;
+  else if (relayNewestTime != 0)
+    now = relayNewestTime + (millis() - relayNewestAt) / 1000;
+  if (time == 0 || time + RELAY_MAX_AGE < now || time > now + RELAY_MAX_SKEW)
+    return false;
+  if (time > relayNewestTime)
+  {
+    relayNewestTime = time;
+    relayNewestAt = millis();
+  }
+  return true;
+}
+
+/**
+ * ESP-NOW receive callback. It runs in the WiFi task, so it only checks the framing
+ * and queues a copy for relayLoop().
+ */
+void onRelayReceive(const uint8_t *, const uint8_t *data, int length)
+{
+  if (length < RELAY_HEADER_SIZE + RELAY_TAG_SIZE || length > (int)sizeof(RelayFrame) || data[0] != RELAY_MAGIC)
+    return;
+  RelayFrame frame;
+  memcpy(&frame, data, length);
+  if (RELAY_HEADER_SIZE + RELAY_TAG_SIZE + frame.length != length)
+    return;
+  if (xQueueSend(relayQueue, &frame, 0) != pdTRUE)
+    relayOverflows++;
+}
+
+/**
+ * Brings up the radio in station mode on RELAY_CHANNEL, without joining a network,
+ * and registers the broadcast peer. Does nothing until a relay key is provisioned.
+ * 
+ * @return true if the relay is running.
+ */
+bool initRelay()
+{
+  if (RELAY_KEY.length() == 0)
+    return false;
+  relayQueue = xQueueCreate(RELAY_QUEUE_DEPTH, sizeof(RelayFrame));
+  WiFi.mode(WIFI_STA);
+  WiFi.disconnect();
+  // the long-range PHY only talks to other ESP32s, which is all the relay needs
+  esp_wifi_set_protocol(WIFI_IF_STA, WIFI_PROTOCOL_LR);
+  esp_wifi_set_channel(RELAY_CHANNEL, WIFI_SECOND_CHAN_NONE);
+  if (esp_now_init() != ESP_OK)
+  {
+    LOG_ERROR("ESP-NOW init failed, relay off");
+    return false;
+  }
+  esp_now_peer_info_t peer = {};
+  memcpy(peer.peer_addr, RELAY_BROADCAST, ESP_NOW_ETH_ALEN);
+  peer.channel = RELAY_CHANNEL;
+  peer.ifidx = WIFI_IF_STA;
+  peer.encrypt = false;
+  if (esp_now_add_peer(&peer) != ESP_OK)
+  {
+    LOG_ERROR("ESP-NOW peer setup failed, relay off");
+    return false;
+  }
+  esp_now_register_recv_cb(onRelayReceive);
+  relayReady = true;
+  LOG_INFO("ESP-NOW relay listening");
+  return true;
+}
+
+/**
+ * Queues a frame for rebroadcast after a random delay, so that neighbours which heard
+ * the same frame do not all transmit at once. The oldest waiting frame is replaced
+ * when every slot is taken.
+ */
+void scheduleRelay(const RelayFrame &frame)
+{
+  int slot = 0;
+  for (int i = 0; i < RELAY_PENDING; i++)
+  {
+    if (!relayWaiting[i])
+    {
+      slot = i;
+      break;
+    }
+    if (relayDue[i] < relayDue[slot])
+      slot = i;
+  }
+  relayOutbox[slot] = frame;
+  relayDue[slot] = millis() + random(RELAY_JITTER_MIN, RELAY_JITTER_MAX + 1);
+  relayWaiting[slot] = true;
+}
+
+/**
+ * Starts the flood of an alert that arrived from the broker.
+ * 
+ * @param message the parsed alert, re-serialized into the frame.
+ * 
+ * @return false if the relay is off, the clock is not set (peers could not tell the
+ * frame from a replay) or the alert does not fit in one frame.
+ */
+bool relayAlert(JsonDocument &message)
+{
+  if (!relayReady || !timeSynced)
+    return false;
+  RelayFrame frame;
+  size_t length = measureJson(message);
+  if (length >= RELAY_MAX_PAYLOAD)
+  {
+    LOG_WARN("Alert too long to relay");
+    return false;
+  }
+  frame.magic = RELAY_MAGIC;
+  frame.ttl = RELAY_TTL;
+  frame.hops = 0;
+  frame.time = epochMillis() / 1000;
+  frame.length = serializeJson(message, frame.payload, sizeof(frame.payload));
+  signRelayFrame(frame, frame.tag);
+  // peers key alerts without an id on the payload, so echoes of this one are dropped too
+  if (message["id"].isNull())
+    rememberAlertId(frame.payload);
+  scheduleRelay(frame);
+  return true;
+}
+
+/**
+ * Names a reset reason for the crash report.
+ */
+const char *resetReasonName(esp_reset_reason_t reason)
+{
+  switch (reason)
+  {
+  case ESP_RST_PANIC:
+    return "PANIC";
+  case ESP_RST_INT_WDT:
+    return "INT_WDT";
+  case ESP_RST_TASK_WDT:
+    return "TASK_WDT";
+  case ESP_RST_WDT:
+    return "WDT";
+  case ESP_RST_BROWNOUT:
+    return "BROWNOUT";
+  case ESP_RST_SW:
+    return "SW";
+  case ESP_RST_POWERON:
+    return "POWERON";
+  default:
+    return "OTHER";
+  }
+}
+
+/**
+ * Builds the crash report for an abnormal reset from the reset reason, the stage the
+ * previous run was in, the core dump summary and the RTC log ring. The report is kept
+ * in NVS until uploaded, and the full core dump is copied to the SD card.
+ * 
+ * @param reason the reset reason.
+ */
+void captureCrash(esp_reset_reason_t reason)
+{
+  StaticJsonDocument<256> summary;
+  summary["boot"] = bootCount;
+  summary["reason"] = resetReasonName(reason);
+  summary["stage"] = crashStage < sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) ? STAGE_NAMES[crashStage] : "?";
+
+  size_t dumpAddress = 0;
+  size_t dumpSize = 0;
+  if (esp_core_dump_image_get(&dumpAddress, &dumpSize) == ESP_OK)
+  {
+    esp_core_dump_summary_t dump;
+    if (esp_core_dump_get_summary(&dump) == ESP_OK)
+    {
+      summary["task"] = dump.exc_task;
+      summary["pc"] = String(dump.exc_pc, HEX);
+      String backtrace = "";
+      for (uint32_t i = 0; i < dump.exc_bt_info.depth; i++)
+        backtrace += String(dump.exc_bt_info.bt[i], HEX) + " ";
+      summary["bt"] = backtrace;
+    }
+    if (sdReady)
+    {
+      if (!SD.exists(CRASH_DIR))
+        SD.mkdir(CRASH_DIR);
+      File core = SD.open(CRASH_DIR "/" + String(bootCount) + ".core", FILE_WRITE);
+      uint8_t buffer[OTA_READ_BUFFER];
+      for (size_t pos = 0; core && pos < dumpSize; pos += sizeof(buffer))
+      {
+        size_t length = min(sizeof(buffer), dumpSize - pos);
+        spi_flash_read(dumpAddress + pos, buffer, length);
+        core.write(buffer, length);
+      }
+      core.close();
+    }
+    esp_core_dump_image_erase();
+  }
+
+  crashReport = "";
+  serializeJson(summary, crashReport);
+  crashReport += "\n" + crashLogText;
+  if (sdReady)
+  {
+    if (!SD.exists(CRASH_DIR))
+      SD.mkdir(CRASH_DIR);
+    File file = SD.open(CRASH_DIR "/" + String(bootCount) + ".txt", FILE_WRITE);
+    file.print(crashReport);
+    file.close();
+  }
+  prefs.begin(DIAG_NAMESPACE, false);
+  prefs.putString("report", crashReport);
+  prefs.end();
+  LOG_ERROR("Crash captured: %s", crashReport.substring(0, crashReport.indexOf('\n')).c_str());
+}
+
+/**
+ * Runs first in setup(): snapshots the stage and log ring left by the previous run
+ * before this boot starts overwriting them, and arms the task watchdog for the main
+ * task.
+ */
+void initDiagnostics()
+{
+  resetReason = esp_reset_reason();
+  if (crashLogMagic != CRASH_LOG_MAGIC || resetReason == ESP_RST_POWERON || resetReason == ESP_RST_BROWNOUT)
+  {
+    memset(crashLog, 0, sizeof(crashLog));
+    crashLogHead = 0;
+    lastStage = STAGE_BOOT;
+    crashLogMagic = CRASH_LOG_MAGIC;
+  }
+  crashLogHead %= CRASH_LOG_SIZE;
+  crashStage = lastStage;
+  // oldest bytes of the ring first
+  for (uint32_t i = 0; i < CRASH_LOG_SIZE; i++)
+  {
+    char c = crashLog[(crashLogHead + i) % CRASH_LOG_SIZE];
+    if (c != 0)
+      crashLogText += c;
+  }
+
+  esp_task_wdt_init(WDT_TIMEOUT_S, true);
+  esp_task_wdt_add(NULL);
+  enterStage(STAGE_BOOT);
+}
+
+/**
+ * Counts boots, captures a crash report after an abnormal reset, and enters safe mode
+ * after BOOT_LOOP_LIMIT boots in a row that never became healthy.
+ */
+void recordBoot()
+{
+  prefs.begin(DIAG_NAMESPACE, false);
+  bootCount = prefs.getUInt("boots", 0) + 1;
+  unhealthyBoots = prefs.getUInt("unhealthy", 0) + 1;
+  prefs.putUInt("boots", bootCount);
+  prefs.putUInt("unhealthy", unhealthyBoots);
+  crashReport = prefs.getString("report", "");
+  prefs.end();
+
+  if (resetReason == ESP_RST_PANIC || resetReason == ESP_RST_INT_WDT || resetReason == ESP_RST_TASK_WDT || resetReason == ESP_RST_WDT)
+    captureCrash(resetReason);
+  crashLogText = "";
+
+  safeMode = unhealthyBoots > BOOT_LOOP_LIMIT;
+  if (safeMode)
+  {
+    LOG_ERROR("Boot loop detected, entering safe mode");
+    esp_ota_img_states_t state;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &state) == ESP_OK && state == ESP_OTA_IMG_PENDING_VERIFY)
+      esp_ota_mark_app_invalid_rollback_and_reboot();
+  }
+}
+
+/**
+ * Marks this boot healthy once the device has been receiving for HEALTHY_UPTIME: the
+ * boot-loop counter is reset and a freshly swapped OTA image is kept. Receiving means
+ * subscribed to the broker; an image that cannot reach it, even one kept up by the
+ * relay, is left to roll back.
+ */
+void markHealthy()
+{
+  if (bootHealthy || bootArmedMs == 0 || brokerDown || millis() - bootArmedMs < HEALTHY_UPTIME)
+    return;
+  bootHealthy = true;
+  prefs.begin(DIAG_NAMESPACE, false);
+  prefs.putUInt("unhealthy", 0);
+  prefs.end();
+  esp_ota_mark_app_valid_cancel_rollback();
+}
+
+/**
+ * Publishes a pending crash report on the INFO topic and forgets it once the broker
+ * acknowledged it. Only the summary and the last CRASH_UPLOAD_LOG bytes of the log
+ * are sent; the full report and core dump stay on the SD card.
+ */
+void uploadCrashReport()
+{
+  if (crashReport.length() == 0)
+    return;
+  int split = crashReport.indexOf('\n');
+  String log = split == -1 ? "" : crashReport.substring(split + 1);
+  if (log.length() > CRASH_UPLOAD_LOG)
+    log = log.substring(log.length() - CRASH_UPLOAD_LOG);
+
+  DynamicJsonDocument doc(1536);
+  doc["DEVICE_ID"] = DEVICE_ID;
+  JsonObject crash = doc.createNestedObject("CRASH");
+  StaticJsonDocument<256> summary;
+  deserializeJson(summary, crashReport.substring(0, split));
+  crash["summary"] = summary;
+  crash["log"] = log;
+  String output = "";
+  serializeJson(doc, output);
+  if (!publishInfo(output, 1))
+    return;
+  crashReport = "";
+  prefs.begin(DIAG_NAMESPACE, false);
+  prefs.remove("report");
+  prefs.end();
+}
+
+/**
+ * Returns the COMMAND_LIMITS entry of a message code, or -1 if it is not limited.
+ */
+int commandLimit(const String &code)
+{
+  for (int i = 0; i < COMMAND_LIMIT_COUNT; i++)
+  {
+    if (code == COMMAND_LIMITS[i].code)
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * Takes a token from a command's bucket, after crediting the tokens refilled since
+ * the last one. A full bucket does not bank time.
+ * 
+ * @param limit the COMMAND_LIMITS entry.
+ * 
+ * @return false if the bucket is empty.
+ */
+bool takeCommandToken(int limit)
+{
+  const CommandLimit &rule = COMMAND_LIMITS[limit];
+  unsigned long now = millis();
+  if (commandSpent[limit] > 0)
+  {
+    unsigned long earned = (now - commandRefilledAt[limit]) / rule.interval;
+    if (earned >= commandSpent[limit])
+      commandSpent[limit] = 0;
+    else
+    {
+      commandSpent[limit] -= earned;
+      commandRefilledAt[limit] += earned * rule.interval;
+    }
+  }
+  if (commandSpent[limit] >= rule.burst)
+    return false;
+  if (commandSpent[limit] == 0)
+    commandRefilledAt[limit] = now;
+  commandSpent[limit]++;
+  return true;
+}
+
+/**
+ * Applies COMMAND_LIMITS to a command that is not an alert. A limited command is
+ * queued for commandLoop(), or answered by the one already queued when it is a
+ * coalesced one.
+ * 
+ * @param code the message code.
+ * @param payload the JSON of the message, queued for a command that is not coalesced.
+ * 
+ * @return true if the caller should run the command now.
+ */
+bool admitCommand(const String &code, const char *payload)
+{
+  int limit = commandLimit(code);
+  if (limit == -1)
+    return true;
+  if (commandQueued[limit])
+  {
+    commandsCoalesced++;
+    return false;
+  }
+  if (!takeCommandToken(limit))
+  {
+    commandShed[limit]++;
+    LOG_WARN("%s shed by the rate limit", code.c_str());
+    return false;
+  }
+  if (COMMAND_LIMITS[limit].coalesced)
+  {
+    commandQueued[limit] = true;
+    return false;
+  }
+  if (commandQueueCount == COMMAND_QUEUE_SIZE)
+  {
+    commandShed[limit]++;
+    LOG_WARN("%s shed, the command queue is full", code.c_str());
+    return false;
+  }
+  commandQueue[(commandQueueHead + commandQueueCount++) % COMMAND_QUEUE_SIZE] = payload;
+  return false;
+}
+
+/**
+ * Whether a broker message may be waiting to be dispatched.
+ */
+bool inboundPending()
+{
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  if (mqttInboxCount > 0)
+    return true;
+#endif
+  return pendingURC.length() > 0 || LTE_Serial.available() > 0;
+}
+
+/**
+ * Runs a command that passed admitCommand().
+ * 
+ * @param code the message code.
+ * @param command the parsed message.
+ */
+void runCommand(const String &code, JsonDocument &command)
+{
+  if (code == "LOC")
+    checkLOC();
+  else if (code == "STATUS")
+    requestStatus();
+  else if (code == "CLIP")
+    startClipDownload(command);
+  else if (code == "LOG")
+    queryJournal(command);
+  else if (code == "OTA")
+    startOta(command);
+  else if (code == "CERT")
+    fetchCert(command);
+  else if (code == "CAPTURE")
+    setCapture(command);
+  else if (code == "MQTTBENCH")
+    startMqttBench(command);
+}
+
+/**
+ * Runs one queued command per pass, and only when no broker message is waiting, so
+ * an alert behind a burst of requests is dispatched before any of them. LOC and
+ * STATUS go first, then the commands with a payload in the order they came.
+ */
+void commandLoop()
+{
+  if (inboundPending())
+    return;
+  for (int i = 0; i < COMMAND_LIMIT_COUNT; i++)
+  {
+    if (!commandQueued[i])
+      continue;
+    commandQueued[i] = false;
+    StaticJsonDocument<16> none;
+    runCommand(COMMAND_LIMITS[i].code, none);
+    return;
+  }
+  if (commandQueueCount == 0)
+    return;
+  String payload = commandQueue[commandQueueHead];
+  commandQueue[commandQueueHead] = "";
+  commandQueueHead = (commandQueueHead + 1) % COMMAND_QUEUE_SIZE;
+  commandQueueCount--;
+  StaticJsonDocument<768> command;
+  if (!deserializeJson(command, payload))
+    runCommand(command["message"] | "", command);
+}
+
+/**
+ * Acts on one message, from the broker or from a peer: drops duplicates and expired
+ * alerts, plays alerts and runs commands. Alerts are passed on to nearby devices;
+ * commands are addressed to this device alone and are only taken from the broker.
+ * 
+ * @param jsonString the JSON payload, or NULL if none was found.
+ * @param relayed the frame the message came in, or NULL for a broker message.
+ */
+void dispatchMessage(const char *jsonString, const RelayFrame *relayed)
+{
+  StaticJsonDocument<768> jsonDoc;
+  String songName = processJsonMessage(jsonString, jsonDoc);
+
+  // QoS1 redeliveries carry the same id and must not restart the siren; relayed
+  // alerts without an id are keyed on their payload, which is the same at every hop
+  JsonVariant alertId = jsonDoc["id"];
+  if (!alertId.isNull() || relayed)
+  {
+    if (!rememberAlertId(!alertId.isNull() ? alertId.as<String>() : String(jsonString)))
+    {
+      LOG_INFO("Duplicate message dropped");
+      return;
+    }
+  }
+  if (!relayed)
+    noteAlertSeq(jsonDoc["seq"] | 0UL);
+  if (alertExpired(jsonDoc))
+  {
+    LOG_INFO("Expired message dropped");
+    return;
+  }
+
+  bool isAlert = isAlertCode(songName);
+  int cached = findCachedClip(songName);
+  if (relayed && !isAlert)
+  {
+    LOG_INFO("Relayed command ignored");
+    return;
+  }
+  if (!relayed && isAlert)
+    relayAlert(jsonDoc);
+  else if (relayed && relayed->ttl > 1)
+  {
+    RelayFrame next = *relayed;
+    next.ttl--;
+    next.hops++;
+    scheduleRelay(next);
+  }
+
+  // alerts go straight through; everything else is subject to COMMAND_LIMITS
+  if (!isAlert && !admitCommand(songName, jsonString))
+    return;
+
+  if (isAlert)
+  {
+    long latency = timeSynced && !jsonDoc["issued"].isNull() ? lastAlertLatencyMs : -1;
+    openReceipt(alertId.isNull() ? songName : alertId.as<String>(), latency, relayed ? relayed->hops + 1 : 0);
+  }
+
+  if (cached != -1)
+  {
+    CachedClip &entry = cachedClips[cached];
+    entry.used = ++clipUseCounter;
+    clipIndexDirty = true;
+    AlertClip clip = {entry.code.c_str(), entry.file.c_str(), entry.speech.c_str()};
+    playAlert(clip, jsonDoc["text"]);
+  }
+  else
+  {
+    for (const AlertClip &clip : ALERT_CLIPS)
+    {
+      if (songName == clip.code)
+        playAlert(clip, jsonDoc["text"]);
+    }
+  }
+  if (songName == "TTS")
+  {
+    const char *text = jsonDoc["text"];
+    if (text)
+      speakAlert(text);
+  }
+  if (songName == "ECHO" && benchEchoPending)
+  {
+    finishMqttBench(millis() - benchEchoSentAt);
+  }
+}
+
+/**
+ * Sends the rebroadcasts whose jitter has run out and, outside of an alert, checks
+ * and dispatches the frames received from peers. Frames with a bad tag or a stale
+ * origin time are counted and dropped; the TTL is clamped so a forged header cannot
+ * widen the flood.
+ */
+void relayLoop()
+{
+  if (!relayReady)
+    return;
+  for (int i = 0; i < RELAY_PENDING; i++)
+  {
+    if (relayWaiting[i] && (long)(millis() - relayDue[i]) >= 0)
+    {
+      const RelayFrame &frame = relayOutbox[i];
+      if (esp_now_send(RELAY_BROADCAST, (const uint8_t *)&frame, RELAY_HEADER_SIZE + RELAY_TAG_SIZE + frame.length) == ESP_OK)
+        relaySent++;
+      relayWaiting[i] = false;
+    }
+  }
+
+  // like MQTT traffic, peer frames wait in the queue until playback is stopped
+  RelayFrame frame;
+  while (mainFlag == 0 && xQueueReceive(relayQueue, &frame, 0) == pdTRUE)
+  {
+    uint8_t tag[RELAY_TAG_SIZE];
+    signRelayFrame(frame, tag);
+    uint8_t diff = 0;
+    for (int i = 0; i < RELAY_TAG_SIZE; i++)
+      diff |= tag[i] ^ frame.tag[i];
+    if (diff != 0 || !relayFresh(frame.time))
+    {
+      relayRejected++;
+      continue;
+    }
+    frame.ttl = min(frame.ttl, (uint8_t)RELAY_TTL);
+    char text[RELAY_MAX_PAYLOAD + 1];
+    memcpy(text, frame.payload, frame.length);
+    text[frame.length] = '\0';
+    relayAccepted++;
+    relayLastHops = frame.hops + 1;
+    LOG_INFO("Relayed alert, hop %u", relayLastHops);
+    dispatchMessage(text, &frame);
+  }
+}
+
+/**
+ * Dispatches the +QMTRECV messages in modem output, up to RECEIVE_BURST of them,
+ * alerts first and otherwise in the order they came, so a command ahead of an alert
+ * in the same burst does not hold it up. A message ends at the CRLF after its
+ * payload. Once one of them starts an alert the rest wait in `pendingURC` until it
+ * is stopped, as the UART does otherwise, and so does a message whose end has not
+ * arrived yet.
+ * 
+ * @param buffer the modem output, earlier leftovers first.
+ */
+void dispatchFrames(const String &buffer)
+{
+  String frames[RECEIVE_BURST];
+  unsigned int count = 0;
+  int start = buffer.indexOf("+QMTRECV:");
+  int end;
+  while (start != -1 && count < RECEIVE_BURST && (end = buffer.indexOf("\r\n", start)) != -1)
+  {
+    frames[count++] = buffer.substring(start, end);
+    start = buffer.indexOf("+QMTRECV:", end);
+  }
+  String rest = start == -1 ? "" : buffer.substring(start);
+
+  if (count > 1)
+  {
+    String ordered[RECEIVE_BURST];
+    bool alert[RECEIVE_BURST];
+    unsigned int alerts = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+      StaticJsonDocument<768> jsonDoc;
+      const char *jsonString = parseResponse(frames[i].c_str());
+      alert[i] = jsonString && !deserializeJson(jsonDoc, jsonString) && isAlertCode(jsonDoc["message"] | "");
+      if (alert[i])
+        alerts++;
+    }
+    unsigned int alertAt = 0, commandAt = alerts;
+    for (unsigned int i = 0; i < count; i++)
+      ordered[alert[i] ? alertAt++ : commandAt++] = frames[i];
+    for (unsigned int i = 0; i < count; i++)
+      frames[i] = ordered[i];
+  }
+
+  unsigned int next = 0;
+  for (; next < count && mainFlag == 0; next++)
+    dispatchMessage(parseResponse(frames[next].c_str()), NULL);
+
+  bool partial = rest.length() > 0 && rest.indexOf("\r\n") == -1;
+  if (!partial)
+    partialWaiting = false;
+  else if (!partialWaiting)
+  {
+    partialWaiting = true;
+    partialSince = millis();
+  }
+  else if (millis() - partialSince >= AT_TIMEOUT)
+  {
+    LOG_WARN("Incomplete MQTT message dropped");
+    partialWaiting = false;
+    rest = "";
+  }
+  // queries run by the messages above may have put newer output in pendingURC
+  String left = "";
+  for (unsigned int i = next; i < count; i++)
+    left += frames[i] + "\r\n";
+  pendingURC = left + rest + pendingURC;
+}
+
+/**
+ * The function `receiveATCommand` receives AT commands and performs different actions based on the
+ * value of the `flag` parameter.
+ * 
+ * @param flag an integer that determines the mode of operation for the receiveATCommand function.
+ */
+void receiveATCommand(int flag)
+{
+  // flag=0 means Net configuration mode
+  if (flag == 0)
+  {
+    int simRetries = 0;
+  retry:
+    if (LTE_Serial.available())
+    {
+      String response1 = LTE_Serial.readStringUntil('\n');
+      String response2 = LTE_Serial.readString();
+      LOG_TRAFFIC("Response: ", response2);
+      if (response2 == "NO SIM")
+      {
+        if (++simRetries > SIM_RETRY_LIMIT)
+        {
+          LOG_ERROR("No SIM after retries, continuing without network");
+          journal(JOURNAL_ERROR, 0, simRetries, "no sim");
+          return;
+        }
+        LOG_WARN("Retrying query...");
+        sendATCommand("AT+CPIN?");
+        esp_task_wdt_reset();
+        delay(1000);
+        goto retry;
+      }
+    }
+  }
+
+  // flag=1 means permanent receive mode
+  else if (flag == 1)
+  {
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+    // URCs ModemSslClient::fill() came across, e.g. the result of a ranged GET
+    if (pendingURC.length() > 0)
+    {
+      String urc = pendingURC;
+      pendingURC = "";
+      LOG_TRAFFIC("Response: ", urc);
+      noteSocketUrc(urc);
+    }
+    if (mqttInboxCount > 0)
+    {
+      String message = mqttInbox[mqttInboxHead];
+      mqttInbox[mqttInboxHead] = "";
+      mqttInboxHead = (mqttInboxHead + 1) % MQTT_INBOX_SLOTS;
+      mqttInboxCount--;
+      dispatchMessage(parseResponse(message.c_str()), NULL);
+    }
+#else
+    if (LTE_Serial.available() || pendingURC.length() > 0)
+    {
+      // only what has arrived, a message cut short is completed on a later pass
+      String response2 = "";
+      response2.reserve(LTE_Serial.available());
+      while (LTE_Serial.available())
+        response2 += (char)LTE_Serial.read();
+      if (response2.length() > 0)
+      {
+        LOG_TRAFFIC("Response: ", response2);
+        noteSocketUrc(response2);
+      }
+      String buffer = pendingURC + response2;
+      pendingURC = "";
+      dispatchFrames(buffer);
+    }
+#endif
+  }
+
+}
+
+/**
+ * Extracts the registration status from a +CREG/+CGREG/+CEREG query response.
+ * 
+ * @param response the raw modem response.
+ * @param prefix the response prefix to look for, e.g. "+CEREG: ".
+ * 
+ * @return the <stat> field, or -1 if the prefix was not found.
+ */
+int parseRegistrationStat(const String &response, const char *prefix)
+{
+  int start = response.indexOf(prefix);
+  if (start == -1)
+    return -1;
+  int comma = response.indexOf(',', start);
+  if (comma == -1)
+    return -1;
+  return response.substring(comma + 1).toInt();
+}
+
+/**
+ * Checks whether the modem is attached to a packet network on any RAT.
+ * 
+ * @return true if either the LTE (CEREG) or GPRS (CGREG) registration is home (1)
+ * or roaming (5).
+ */
+bool isRegistered()
+{
+  int eps = parseRegistrationStat(queryATCommand("AT+CEREG?", AT_TIMEOUT), "+CEREG: ");
+  if (eps == 1 || eps == 5)
+    return true;
+  int gprs = parseRegistrationStat(queryATCommand("AT+CGREG?", AT_TIMEOUT), "+CGREG: ");
+  return gprs == 1 || gprs == 5;
+}
+
+/**
+ * Polls the registration state until the modem is attached or the timeout expires.
+ * 
+ * @param timeout the maximum time in milliseconds to wait for registration.
+ * 
+ * @return true if the modem registered within the timeout.
+ */
+bool waitForRegistration(unsigned long timeout)
+{
+  unsigned long start = millis();
+  while (millis() - start < timeout)
+  {
+    if (isRegistered())
+      return true;
+    delay(REG_POLL_INTERVAL);
+  }
+  return false;
+}
+
+/**
+ * Looks up the APN for the SIM's operator, first by the PLMN prefix of the IMSI
+ * and then by the operator name reported by AT+COPS.
+ * 
+ * @return the matching APN, or FALLBACK_APN if the operator is not in APN_TABLE.
+ */
+String detectOperatorAPN()
+{
+  String imsi = queryATCommand("AT+CIMI", AT_TIMEOUT);
+  for (unsigned int i = 0; i < imsi.length(); i++)
+  {
+    if (isDigit(imsi[i]))
+    {
+      imsi = imsi.substring(i);
+      break;
+    }
+  }
+  for (const ApnEntry &entry : APN_TABLE)
+  {
+    if (imsi.startsWith(entry.plmn))
+    {
+      LOG_INFO("Operator from IMSI: %s", entry.name);
+      return entry.apn;
+    }
+  }
+
+  String cops = queryATCommand("AT+COPS?", AT_TIMEOUT);
+  cops.toLowerCase();
+  for (const ApnEntry &entry : APN_TABLE)
+  {
+    if (cops.indexOf(entry.name) != -1)
+    {
+      LOG_INFO("Operator from COPS: %s", entry.name);
+      return entry.apn;
+    }
+  }
+
+  LOG_WARN("Unknown operator, using fallback APN");
+  return FALLBACK_APN;
+}
+
+/**
+ * Registers with the network, falling back through the radio access modes in
+ * RAT_SCAN_MODES and finally through every operator found by a full AT+COPS=? scan.
+ * 
+ * @return true once the modem is registered, false if every fallback failed.
+ */
+bool attachToNetwork()
+{
+  for (int mode : RAT_SCAN_MODES)
+  {
+    queryATCommand("AT+QCFG=\"nwscanmode\"," + String(mode) + ",1", AT_TIMEOUT);
+    if (waitForRegistration(REG_TIMEOUT))
+      return true;
+    LOG_WARN("No registration in scan mode %d", mode);
+  }
+  queryATCommand("AT+QCFG=\"nwscanmode\",0,1", AT_TIMEOUT);
+
+  // +COPS: (2,"airtel","airtel","40445",7),(3,"Jio 4G","Jio 4G","405857",7),,(0-4),(0-2)
+  String scan = queryATCommand("AT+COPS=?", COPS_SCAN_TIMEOUT);
+  int pos = 0;
+  while ((pos = scan.indexOf('(', pos)) != -1)
+  {
+    int end = scan.indexOf(')', pos);
+    if (end == -1)
+      break;
+    String entry = scan.substring(pos + 1, end);
+    pos = end;
+    int stat = entry.toInt();
+    int plmnStart = entry.indexOf(",\"", entry.indexOf(",\"", entry.indexOf(",\"") + 1) + 1);
+    if ((stat != 1 && stat != 2) || plmnStart == -1)
+      continue;
+    String plmn = entry.substring(plmnStart + 2, entry.indexOf('"', plmnStart + 2));
+    LOG_INFO("Trying operator %s", plmn.c_str());
+    queryATCommand("AT+COPS=1,2,\"" + plmn + "\"", COPS_SCAN_TIMEOUT);
+    if (waitForRegistration(REG_TIMEOUT))
+      return true;
+  }
+  queryATCommand("AT+COPS=0", COPS_SCAN_TIMEOUT);
+  return false;
+}
+
+/**
+ * Sends a series of AT commands to establish a connection to the network.
+ */
+void connectToNet()
+{
+  sendATCommand("AT+CPIN?");
+  delay(1000);
+  receiveATCommand(0);
+  delay(500);
+  if (!attachToNetwork())
+    LOG_ERROR("Network registration failed on every operator and RAT");
+  queryATCommand("AT+CSQ", AT_TIMEOUT);
+  if (cmdSetAPN.length() == 0)
+  {
+    APN = detectOperatorAPN();
+    cmdSetAPN = "AT+QICSGP=1,1,\"" + APN + "\",\"\",\"\",0";
+  }
+  queryATCommand(cmdSetAPN, AT_TIMEOUT);
+  if (queryATCommand("AT+QIACT=1", 150000).indexOf("OK") == -1)
+  {
+    queryATCommand("AT+QIDEACT=1", 40000);
+    queryATCommand("AT+QIACT=1", 150000);
+  }
+  queryATCommand("AT+QIACT?", AT_TIMEOUT);
+}
+
+/**
+ * Sends AT commands to power on and configure the GPS module. Needs only a responsive
+ * modem, so the boot pipeline runs it before network registration.
+ */
+void connectToGPS()
+{
+  queryATCommand("AT+QGPSPOWER=1", AT_TIMEOUT);
+  startGnss(false);
+  queryATCommand("AT+QGPSCFG=\"nmeasrc\",1", AT_TIMEOUT);
 }
 
 /**
- * Takes a JSON string as input, extracts latitude and longitude values from it, converts them
- * to proper coordinates, and publishes the message with the extracted data to an MQTT topic.
+ * Sends an AT command and waits for the URC that reports its outcome.
+ * 
+ * @param command a string that represents the AT command to be sent.
+ * @param result the URC prefix that completes the command, e.g. "+QMTOPEN:".
+ * @param timeout the maximum time in milliseconds to wait for the URC.
  * 
- * @param jsonString a pointer to a character array (string) that contains a JSON message.
+ * @return the raw response.
  */
-void Publish_Message(const char *jsonString)
+String queryATResult(String command, const char *result, unsigned long timeout)
 {
-  String output = "";
-  StaticJsonDocument<96> doc;
-  //                            <ddmm.mmmmm> <0ddmm,mmmmm>
-  //+QGPSNMEA: $GPGGA,141009.00,2824.04883,N,07721.32483,E,0,00,99.99,179.9,M,,M,,*7E
-  String Lat = "";
-  String Long = "";
-  String yaxis = "";
-  String xaxis = "";
+  sendATCommand(command);
+  String response = waitForResponse(result, timeout);
+  // the URC may have been caught before its line was complete
+  int at = response.indexOf(result);
+  if (at != -1 && response.indexOf("\r\n", at) == -1)
+    response += LTE_Serial.readStringUntil('\n');
+  return response;
+}
 
-  while (*jsonString != ',')
-    jsonString++;
-  jsonString++;
-  while (*jsonString != ',')
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+int ModemSslClient::connect(const char *host, uint16_t port)
+{
+  rxHead = rxTail = 0;
+  sslDataPending = false;
+  String command = "AT+QSSLOPEN=1," + String(SSL_CONTEXT_ID) + "," + String(SSL_CLIENT_ID) + ",\"" + host + "\"," + String(port) + ",0";
+  sslOpen = queryATResult(command, "+QSSLOPEN:", MQTT_OPEN_TIMEOUT).indexOf("+QSSLOPEN: " + String(SSL_CLIENT_ID) + ",0") != -1;
+  return sslOpen;
+}
+
+/**
+ * Sends in SSL_TX_CHUNK pieces, each one AT+QSSLSEND acknowledged with SEND OK.
+ */
+size_t ModemSslClient::write(const uint8_t *buffer, size_t size)
+{
+  size_t sent = 0;
+  while (sslOpen && sent < size)
   {
-    Lat = Lat + *jsonString;
-    jsonString++;
+    size_t chunk = min(size - sent, (size_t)SSL_TX_CHUNK);
+    sendATCommand("AT+QSSLSEND=" + String(SSL_CLIENT_ID) + "," + String((unsigned int)chunk));
+    if (waitForResponse(">", AT_TIMEOUT).indexOf(">") == -1)
+      break;
+    LTE_Serial.write(buffer + sent, chunk);
+    if (waitForResponse("SEND OK", AT_TIMEOUT).indexOf("SEND OK") == -1)
+      break;
+    sent += chunk;
   }
-  jsonString++;
-  while (*jsonString != ',')
+  return sent;
+}
+
+/**
+ * Makes sure received bytes are buffered: scans idle UART output for socket reports,
+ * then reads the socket with AT+QSSLRECV when data was announced or the poll is due.
+ * Any other URC in the idle output is kept in `pendingURC` for receiveATCommand(),
+ * as on the AT transport.
+ * 
+ * @return true if at least one byte is buffered.
+ */
+bool ModemSslClient::fill()
+{
+  if (rxHead < rxTail)
+    return true;
+  while (LTE_Serial.available())
   {
-    yaxis = yaxis + *jsonString;
-    jsonString++;
+    char c = (char)LTE_Serial.read();
+    urcLine += c;
+    if (c == '\n' || urcLine.length() > 128)
+    {
+      if (urcLine.indexOf("+QSSLURC:") != -1)
+        noteSocketUrc(urcLine);
+      else if (urcLine != "\r\n")
+        pendingURC += urcLine;
+      urcLine = "";
+    }
   }
-  jsonString++;
-  while (*jsonString != ',')
+  if (!sslOpen || (!sslDataPending && millis() - lastPoll < SSL_POLL_INTERVAL))
+    return false;
+  lastPoll = millis();
+  rxHead = rxTail = 0;
+
+  // +QSSLRECV: <length>\r\n<data>\r\n\r\nOK, read byte by byte up to the data
+  sendATCommand("AT+QSSLRECV=" + String(SSL_CLIENT_ID) + "," + String(SSL_RX_CHUNK));
+  String header = "";
+  unsigned long start = millis();
+  while (millis() - start < AT_TIMEOUT)
   {
-    Long = Long + *jsonString;
-    jsonString++;
+    if (!LTE_Serial.available())
+    {
+      delay(1);
+      continue;
+    }
+    header += (char)LTE_Serial.read();
+    if ((header.indexOf("+QSSLRECV: ") != -1 && header.endsWith("\r\n")) || header.endsWith("ERROR\r\n"))
+      break;
   }
-  jsonString++;
-  while (*jsonString != ',')
+  noteSocketUrc(header);
+  int length = parseResponseField(header, "+QSSLRECV: ", 0);
+  if (length < 0)
   {
-    xaxis = xaxis + *jsonString;
-    jsonString++;
+    sslDataPending = false;
+    return false;
   }
-  jsonString++;
+  if (length > 0)
+    rxTail = LTE_Serial.readBytes(rx, min(length, SSL_RX_CHUNK));
+  // a full read may have left more behind; a URC in the trailer sets it again
+  sslDataPending = length == SSL_RX_CHUNK;
+  waitForResponse("OK\r\n", AT_TIMEOUT);
+  return rxHead < rxTail;
+}
 
-  //always send 2 with lat and 3 with long for proper parsing
-  float LLat = actualCoord(Lat, 2);
-  float LLong = actualCoord(Long, 3);
-  if (yaxis == "S")
-    LLat = LLat * (-1);
-  if (xaxis == "W")
-    LLong = LLong * (-1);
+int ModemSslClient::available()
+{
+  fill();
+  return rxTail - rxHead;
+}
 
-  doc["DEVICE_ID"] = DEVICE_ID;
-  doc["LAT"] = LLat;
-  doc["LONG"] = LLong;
+int ModemSslClient::read()
+{
+  return fill() ? rx[rxHead++] : -1;
+}
 
-  serializeJson(doc, output);
-  int payloadSize = output.length();
-  sendATCommand("AT+QMTPUBEX=0,1,1,0,\"AWS/CIER/INFO/1\"," + String(payloadSize));
-  delay(500);
-  sendATCommand(output);
-  delay(2000);
-  receiveATCommand(0);
+int ModemSslClient::read(uint8_t *buffer, size_t size)
+{
+  if (!fill())
+    return -1;
+  size_t count = min(size, rxTail - rxHead);
+  memcpy(buffer, rx + rxHead, count);
+  rxHead += count;
+  return count;
+}
+
+int ModemSslClient::peek()
+{
+  return fill() ? rx[rxHead] : -1;
+}
+
+void ModemSslClient::stop()
+{
+  if (sslOpen)
+    queryATCommand("AT+QSSLCLOSE=" + String(SSL_CLIENT_ID) + ",10", 11000);
+  sslOpen = false;
+  rxHead = rxTail = 0;
+}
+
+uint8_t ModemSslClient::connected()
+{
+  return sslOpen || rxHead < rxTail;
 }
 
 /**
- * Publishes a JSON payload to an MQTT topic using AT commands when the device is booted.
+ * Queues a message from PubSubClient for receiveATCommand(1). The payload points into
+ * the client's packet buffer, so it is copied.
  */
-void Publish_LIVE_NOW()
+void onMqttMessage(char *, uint8_t *payload, unsigned int length)
 {
-  String output = "";
-  StaticJsonDocument<96> doc;
-
-  doc["DEVICE_ID"] = DEVICE_ID;
-  doc["STATUS"] = "ACTIVE";
+  if (mqttInboxCount == MQTT_INBOX_SLOTS)
+  {
+    LOG_WARN("MQTT inbox full, message dropped");
+    return;
+  }
+  String &slot = mqttInbox[(mqttInboxHead + mqttInboxCount) % MQTT_INBOX_SLOTS];
+  slot = "";
+  slot.concat((const char *)payload, length);
+  mqttInboxCount++;
+}
+#endif
 
-  serializeJson(doc, output);
-  int payloadSize = output.length();
+/**
+ * Marks the start or the end of a boot stage.
+ */
+void bootStageBegin(BootStage stage)
+{
+  bootStageStart[stage] = millis();
+}
 
-  sendATCommand("AT+QMTPUBEX=0,1,1,0,\"AWS/CIER/INFO/1\"," + String(payloadSize));
-  delay(500);
-  sendATCommand(output);
-  delay(2000);
-  receiveATCommand(0);
+void bootStageEnd(BootStage stage)
+{
+  bootStageTime[stage] = millis() - bootStageStart[stage];
 }
 
 /**
- * The function `receiveATCommand` receives AT commands and performs different actions based on the
- * value of the `flag` parameter.
+ * Handles a failed broker step. Without the relay the device restarts and tries again
+ * at once; with it the device stays up to take alerts from its peers, and loop()
+ * restarts it after BROKER_RETRY_INTERVAL.
  * 
- * @param flag an integer that determines the mode of operation for the receiveATCommand function.
+ * @param step the step that failed, for the log.
  */
-void receiveATCommand(int flag)
+void brokerFailed(const char *step)
 {
-  // flag=0 means Net configuration mode
-  if (flag == 0)
+  journal(JOURNAL_BROKER_DOWN, 0, 0, step);
+  if (!relayReady)
   {
-  retry:
-    if (LTE_Serial.available())
-    {
-      String response1 = LTE_Serial.readStringUntil('\n');
-      String response2 = LTE_Serial.readString();
-      Serial.print("Response: ");
-      Serial.println(response2);
-      Serial.println("");
-      if (response2 == "NO SIM")
-      {
-        Serial.println("Retrying query...");
-        sendATCommand("AT+CPIN?");
-        delay(1000);
-        goto retry;
-      }
-    }
+    LOG_ERROR("MQTT %s failed, restarting", step);
+    restartDevice();
   }
+  LOG_WARN("MQTT %s failed, listening to the relay only", step);
+  brokerDown = true;
+  brokerDownSince = millis();
+}
 
-  // flag=1 means permanent receive mode
-  else if (flag == 1)
-  {
-    if (LTE_Serial.available())
-    {
-      String response2 = LTE_Serial.readString();
-      Serial.print("Response: ");
-      Serial.println(response2);
-      Serial.println("");
+/**
+ * Opens the broker session over the SSL context configured by the caller: the TLS
+ * connection, the MQTT connect and the subscription. Each step waits for its own
+ * result instead of a fixed delay.
+ * 
+ * @return the name of the step that failed, or a null pointer on success.
+ */
+const char *openSession()
+{
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  mqtt.setServer(BROKER_HOST.c_str(), BROKER_PORT);
+  mqtt.setBufferSize(MQTT_PACKET_BUFFER);
+  mqtt.setKeepAlive(KEEPALIVE);
+  mqtt.setSocketTimeout(MQTT_CONN_TIMEOUT / 1000);
+  mqtt.setCallback(onMqttMessage);
+  if (!mqtt.connect(CLIENT_ID.c_str(), NULL, NULL, NULL, 0, false, NULL, CLEAN_SESSION))
+    return sslOpen ? "connect" : "open";
+  if (!mqtt.subscribe(TOPIC_SUB.c_str(), 1))
+    return "subscribe";
+#else
+  // classify the link first, so the timers fit it from the first packet
+  if (linkCount == 0)
+    sampleLink();
+  configureMqttTimers();
+  queryATCommand(cmdSession, AT_TIMEOUT);
+  queryATCommand(cmdKeepalive, AT_TIMEOUT);
+  queryATCommand("AT+QMTCFG=\"recv/mode\",0,0,1", AT_TIMEOUT);
+  queryATCommand("AT+QMTCFG=\"SSL\",0,1,2", AT_TIMEOUT);
 
-      const char *jsonString = parseResponse(response2.c_str());
-      String songName = processJsonMessage(jsonString);
+  // +QMTOPEN: 0,2 means the modem kept the connection across an ESP32-only reset
+  String response = queryATResult(cmdOpenBroker, "+QMTOPEN:", MQTT_OPEN_TIMEOUT);
+  if (response.indexOf("+QMTOPEN: 0,0") == -1 && response.indexOf("+QMTOPEN: 0,2") == -1)
+    return "open";
+  if (queryATResult(cmdConnectBroker, "+QMTCONN:", MQTT_CONN_TIMEOUT).indexOf("+QMTCONN: 0,0,0") == -1)
+    return "connect";
+  if (queryATResult(cmdSubscribe, "+QMTSUB:", MQTT_SUB_TIMEOUT).indexOf("+QMTSUB: 0,1,0") == -1)
+    return "subscribe";
+#endif
+  return nullptr;
+}
 
-      if (songName == "1")
-      {
-        mainFlag = 1;
-        audio.connecttoFS(SD, "/EARTHQUAKE.mp3");
-        vibrate(VibraMotor, 2000);
-      }
-      if (songName == "2")
-      {
-        mainFlag = 1;
-        audio.connecttoFS(SD, "/FLOOD.mp3");
-        vibrate(VibraMotor, 2000);
-      }
-      if (songName == "3")
-      {
-        mainFlag = 1;
-        audio.connecttoFS(SD, "/LANDSLIDE.mp3");
-        vibrate(VibraMotor, 2000);
-      }
-      if (songName == "4")
-      {
-        mainFlag = 1;
-        audio.connecttoFS(SD, "/LIGHTENINGSTRIKE.mp3");
-        vibrate(VibraMotor, 2000);
-      }
-      if (songName == "5")
-      {
-        mainFlag = 1;
-        audio.connecttoFS(SD, "/THUNDERSTORM.mp3");
-        vibrate(VibraMotor, 2000);
-      }
-      if (songName == "LOC")
-      {
-        checkLOC();
-      }
-      if (songName == "STATUS")
-      {
-        Publish_LIVE_NOW();
-      }
-    }
-  }
+/**
+ * Tears down whatever openSession() left open, so it can be called again.
+ */
+void closeSession()
+{
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  mqtt.disconnect();
+  modemSsl.stop();
+#else
+  queryATResult("AT+QMTCLOSE=0", "+QMTCLOSE:", AT_TIMEOUT);
+#endif
+}
+
+/**
+ * The function connects to AWS and enters into a receive state permanently. Changed
+ * credentials in CERT_DIR are uploaded and tried first; if the broker refuses them,
+ * the session is opened again with the old set, and the new one is only rejected
+ * when the old one works, so a network failure never discards it. A failed open,
+ * connect or subscribe restarts the device, see brokerFailed(). The AWS boot stage
+ * and the armed time are only recorded once the subscription is in place, so both
+ * stay 0 in STATUS while the broker is down.
+ */
+void connectToAWS()
+{
+  unsigned long start = millis();
+  bool trial = stageCerts();
+  applyCerts(trial);
+  queryATCommand("AT+QSSLCFG=\"seclevel\",2,2", AT_TIMEOUT);
+  queryATCommand("AT+QSSLCFG=\"sslversion\",2,4", AT_TIMEOUT);
+  queryATCommand("AT+QSSLCFG=\"ciphersuite\",2,0xFFFF", AT_TIMEOUT);
+  queryATCommand("AT+QSSLCFG=\"ignorelocaltime\",2,1", AT_TIMEOUT);
 
-  // flag=2 means AWS configuration mode
-  else if (flag == 2)
+  const char *failed = openSession();
+  if (failed && trial)
   {
-    if (LTE_Serial.available())
-    {
-      String response1 = LTE_Serial.readStringUntil('\n');
-      String response2 = LTE_Serial.readString();
-      Serial.print("Response: ");
-      Serial.println(response2);
-      Serial.println("");
-      if (response2 == "ERROR")
-      {
-        ESP.restart();
-      }
-      if (response2.indexOf("+QMTSUB: 0,1,0,1") != -1)
-      {
-        Serial.println("Received the desired message!");
-      }
-      else
-      {
-        // If no data is received, print "retry"
-        Serial.println("retry");
-        delay(1000); // Adjust delay as needed
-      }
-    }
+    LOG_WARN("MQTT %s failed with the new credentials, trying the old ones", failed);
+    closeSession();
+    applyCerts(false);
+    failed = openSession();
+    if (!failed)
+      rejectCerts();
+  }
+  else if (trial)
+    commitCerts();
+  if (failed)
+  {
+    brokerFailed(failed);
+    return;
   }
+  // armed once subscribed: from here on an alert reaches the device
+  bootStageEnd(BOOT_AWS);
+  bootArmedMs = millis();
+  LOG_INFO("Entering into Receive state permanantly.....");
+  journal(JOURNAL_CONNECT, MQTT_TRANSPORT, millis() - start, "");
 
-  //flag=3 means publishing GPS location
-  else if (flag == 3)
+  // a persistent session has the broker redeliver what it queued; the catch-up
+  // covers what it could not, e.g. alerts from before the session existed. A device
+  // that has never seen a seq has nothing to catch up from
+  if (alertSeq > 0)
   {
-    if (LTE_Serial.available())
-    {
-      String response2 = LTE_Serial.readString();
-      Serial.print("Response: ");
-      Serial.println(response2);
-      Serial.println("");
-      const char *jsonString = parseLOCResponse(response2.c_str());
-      Publish_Message(jsonString);
-    }
+    catchupFrom = alertSeq;
+    requestCatchup();
   }
+  Publish_LIVE_NOW();
+  uploadCrashReport();
+  vibrate(OnboardLED, 2000);
 }
 
 /**
- * Sends a series of AT commands to establish a connection to the network.
+ * Services the PubSubClient session in every loop() pass, alerts included, so
+ * keepalives go out and incoming messages are queued. A dropped session is handled
+ * like a failed broker step.
  */
-void connectToNet()
+void mqttLoop()
 {
-  sendATCommand("AT");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+CPIN?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+CREG?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+CGREG?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+CSQ");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+COPS?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+CGREG?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QICSGP=1,1,\"airtelgprs.com\",\"\",\"\",0");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QIACT=1");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QIACT?");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
+#if MQTT_TRANSPORT == MQTT_TRANSPORT_PUBSUB
+  if (brokerDown)
+    return;
+  mqtt.loop();
+  if (!mqtt.connected())
+    brokerFailed("session");
+#endif
 }
 
 /**
- * Sends AT commands to power on and configure the GPS module.
+ * Boot task for everything behind the SD card and I2S: boot bookkeeping and crash
+ * capture, provisioning, the dedup table, resumable downloads and audio setup. It
+ * runs while the main task powers up the modem and starts GNSS, and signals
+ * STORAGE_READY when done.
  */
-void connectToGPS()
+void storageTask(void *)
 {
-  sendATCommand("AT+QGPSPOWER=1");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QGPS=1");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QGPSCFG=\"nmeasrc\",1");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
+  bootStageBegin(BOOT_STORAGE);
+  sdReady = SD.begin(SD_CS);
+  if (!sdReady)
+    LOG_ERROR("Error accessing microSD card! Alerts will use the modem voice.");
+  recordBoot();
+  loadProvisioning(sdReady);
+  loadCertState();
+  if (sdReady)
+    loadJournal();
+  loadSeenAlerts();
+  loadAgnssState();
+  // safe mode keeps only what is needed to receive and sound alerts
+  if (!safeMode)
+  {
+    resumeOta();
+    if (sdReady)
+    {
+      loadClipIndex();
+      resumeClipDownload();
+    }
+  }
+  i2sReady = audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
+  audio.setVolume(21);
+  bootStageEnd(BOOT_STORAGE);
+  xEventGroupSetBits(bootEvents, STORAGE_READY);
+  vTaskDelete(NULL);
 }
 
 /**
- * The function connects to AWS and enters into a receive state permanently.
+ * Blocks the main task until the storage task has finished, feeding the watchdog.
  */
-void connectToAWS()
+void waitForStorage()
 {
-  sendATCommand("AT+QMTCFG=\"recv/mode\",0,0,1");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QMTCFG=\"SSL\",0,1,2");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"cacert\",2,\"UFS:cacert.pem\"");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"clientcert\",2,\"UFS:client.pem\"");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"clientkey\",2,\"UFS:user_key.pem\"");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"seclevel\",2,2");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"sslversion\",2,4");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"ciphersuite\",2,0xFFFF");
-  delay(1000);
-  receiveATCommand(0);
-  delay(500);
-  sendATCommand("AT+QSSLCFG=\"ignorelocaltime\",2,1");
-  delay(1000);
-  receiveATCommand(2);
-  delay(500);
-  sendATCommand("AT+QMTOPEN=0,\"a3egi4f3zufw8w-ats.iot.us-east-1.amazonaws.com\",8883");
-  delay(1000);
-  receiveATCommand(2);
-  delay(500);
-  sendATCommand("AT+QMTCONN=0,\"M26_0206\"");
-  delay(5000);
-  receiveATCommand(2);
-  delay(500);
-  sendATCommand("AT+QMTSUB=0,1,\"AWS/CIER/SUB/1\",1");
-  delay(5000);
-  receiveATCommand(2);
-  delay(500);
-  Serial.println("Entering into Receive state permanantly.....");
-
-  Publish_LIVE_NOW();
-  vibrate(OnboardLED, 2000);
+  while (!(xEventGroupWaitBits(bootEvents, STORAGE_READY, pdFALSE, pdTRUE, pdMS_TO_TICKS(1000)) & STORAGE_READY))
+    esp_task_wdt_reset();
 }
 
 /**
@@ -564,29 +6030,67 @@ void setup()
 {
   // Set microSD Card CS as OUTPUT and set HIGH
   Serial.begin(BAUDRATE);
+  xTaskCreatePinnedToCore(logTask, "log", 3072, NULL, LOG_TASK_PRIORITY, NULL, 0);
+  // read before the storage task starts, so the capture covers the modem boot
+  prefs.begin(CONFIG_NAMESPACE, true);
+  captureOn = prefs.getString(CAPTURE_SETTING, "0").toInt() != 0;
+  captureFromBoot = captureOn;
+  prefs.end();
+  LTE_Serial.setRxBufferSize(LTE_RX_BUFFER);
   LTE_Serial.begin(BAUDRATE, SERIAL_8N1, EC_RX, EC_TX);
+  LTE_Serial.onReceiveError(onModemRxError);
+  initDiagnostics();
   pinMode(33, OUTPUT);
   pinMode(VibraMotor, OUTPUT);
   pinMode(UserSwitch, INPUT);
   pinMode(OnboardLED, OUTPUT);
-  digitalWrite(33, HIGH);
-  delay(1000);
-  digitalWrite(33, LOW);
-  delay(500);
   pinMode(SD_CS, OUTPUT);
   digitalWrite(SD_CS, HIGH);
   SPI.begin(SPI_SCK, SPI_MISO, SPI_MOSI);
 
-  if (!SD.begin(SD_CS))
-  {
-    Serial.println("Error accessing microSD card!");
-    while (true)
-      ;
-  }
-  audio.setPinout(I2S_BCLK, I2S_LRC, I2S_DOUT);
-  audio.setVolume(21);
-  connectToNet();
+  // SD, provisioning and audio come up on the other core while the modem boots
+  bootEvents = xEventGroupCreate();
+  xTaskCreatePinnedToCore(storageTask, "storage", 8192, NULL, 1, NULL, 0);
+  xTaskCreatePinnedToCore(captureTask, "capture", 4096, NULL, CAPTURE_TASK_PRIORITY, NULL, 0);
+
+  enterStage(STAGE_NET);
+  bootStageBegin(BOOT_MODEM);
+  digitalWrite(33, HIGH);
+  delay(1000);
+  digitalWrite(33, LOW);
+  if (!waitForModem(MODEM_BOOT_TIMEOUT))
+    LOG_ERROR("Modem did not answer AT");
+  negotiateModemUart();
+  bootStageEnd(BOOT_MODEM);
+
+  // GNSS acquisition runs inside the modem in parallel with network registration
+  enterStage(STAGE_GPS);
+  bootStageBegin(BOOT_GNSS);
   connectToGPS();
+  bootStageEnd(BOOT_GNSS);
+
+  // the APN and broker endpoint come from the provisioning read by the storage task
+  waitForStorage();
+  journal(JOURNAL_BOOT, resetReason, bootCount, resetReasonName(resetReason));
+  enterStage(STAGE_RELAY);
+  initRelay();
+  enterStage(STAGE_NET);
+  bootStageBegin(BOOT_NET);
+  connectToNet();
+  bootStageEnd(BOOT_NET);
+
+  enterStage(STAGE_TIME);
+  bootStageBegin(BOOT_TIME);
+  syncTime();
+  bootStageEnd(BOOT_TIME);
+
+  // the cold session started above is restarted with assistance data if it is stale
+  enterStage(STAGE_GPS);
+  if (agnssStale())
+    injectAssistance();
+
+  enterStage(STAGE_AWS);
+  bootStageBegin(BOOT_AWS);
   connectToAWS();
 }
 
@@ -598,24 +6102,73 @@ void loop()
 {
   if (mainFlag == 0)
   {
+    enterStage(STAGE_RECEIVE);
     receiveATCommand(1);
+    enterStage(STAGE_LINK);
+    if (mainFlag == 0)
+      monitorLink();
+    enterStage(STAGE_PUBLISH);
+    if (mainFlag == 0)
+      commandLoop();
+    if (mainFlag == 0 && catchupPending && !brokerDown && millis() - lastCatchupAttempt >= CATCHUP_RETRY_INTERVAL)
+      requestCatchup();
+    if (statusPending && millis() - statusRequestedAt >= STATUS_COALESCE_WINDOW)
+      Publish_LIVE_NOW();
+    if (mainFlag == 0)
+      receiptLoop();
+    if (mainFlag == 0)
+      mqttBenchLoop();
+    enterStage(STAGE_OTA);
+    if (mainFlag == 0 && !safeMode)
+      otaLoop();
+    enterStage(STAGE_CLIP);
+    if (mainFlag == 0 && sdReady && !safeMode)
+      clipLoop();
+    if (mainFlag == 0 && !safeMode)
+      certLoop();
+    if (mainFlag == 0)
+      saveSeenAlerts();
+    if (mainFlag == 0)
+      journalLoop();
+    enterStage(STAGE_TIME);
+    if (mainFlag == 0)
+      timeLoop();
+    enterStage(STAGE_GPS);
+    if (mainFlag == 0)
+      gnssLoop();
+    enterStage(STAGE_AWS);
+    if (brokerDown && millis() - brokerDownSince >= BROKER_RETRY_INTERVAL)
+    {
+      LOG_INFO("Retrying the broker");
+      restartDevice();
+    }
+    markHealthy();
   }
   else if (mainFlag == 1)
   {
-    String trash = LTE_Serial.readString();
-    LTE_Serial.flush();
-    audio.loop();
+    // modem traffic waits in the RX buffer until playback is stopped
+    enterStage(STAGE_ALERT);
+    alertLoop();
   }
 
   buttonState = digitalRead(UserSwitch);
 
   if (mainFlag == 1 && buttonState == LOW && lastButtonState == HIGH)
   {
-    Serial.print("BUTTON STOP");
-    audio.stopSong();
+    LOG_INFO("BUTTON STOP");
+    stopAlert();
+    receiptAcknowledged(ACK_BUTTON);
     digitalWrite(VibraMotor, LOW);
     mainFlag = 0;
+    flagChangeTime = millis();
     checkLOC();
   }
   lastButtonState = buttonState;
+
+  // rebroadcasts go out during an alert too, so the flood does not stall here
+  enterStage(STAGE_RELAY);
+  relayLoop();
+  enterStage(STAGE_RECEIVE);
+  mqttLoop();
+  captureLoop();
 }
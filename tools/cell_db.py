@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""
+Builds the cell tower table the firmware uses for a position when there is no GNSS
+fix, from an OpenCellID export (cell_towers.csv or a per-country MCC file, plain or
+gzipped).
+
+  python3 tools/cell_db.py cell_towers.csv.gz sdcard/cells.bin --mcc 404 405
+  python3 tools/cell_db.py 404.csv.gz cells.bin --bbox 8 68 37 97
+
+Copy the output to the root of the SD card as cells.bin. Only GSM and LTE cells are
+kept, the radios of the EC200U; a cell listed twice keeps the entry with the most
+samples. The table is a sorted array of 24-byte little-endian records the firmware
+searches in place:
+
+  uint16 mcc, uint16 mnc, uint32 area, uint32 cell, int32 lat, int32 lon,
+  uint16 range, uint16 reserved
+
+with the TAC or LAC as area, coordinates in millionths of a degree and the range in
+metres (0 when unknown).
+"""
+
+import argparse
+import csv
+import gzip
+import struct
+import sys
+
+# keep in step with CellRecord in main.cpp
+RECORD = struct.Struct("<HHIIiiHH")
+RADIOS = ("GSM", "LTE")
+COLUMNS = ["radio", "mcc", "net", "area", "cell", "unit", "lon", "lat", "range", "samples"]
+
+
+def read_cells(path, args):
+    """Yields (key, lat, lon, range, samples) for the cells that pass the filters."""
+    opener = gzip.open if path.endswith(".gz") else open
+    with opener(path, "rt", newline="") as f:
+        for row in csv.reader(f):
+            if not row or row[0] == "radio":
+                continue
+            cell = dict(zip(COLUMNS, row))
+            if cell["radio"] not in RADIOS:
+                continue
+            mcc, mnc = int(cell["mcc"]), int(cell["net"])
+            if args.mcc and mcc not in args.mcc:
+                continue
+            lat, lon = float(cell["lat"]), float(cell["lon"])
+            if args.bbox and not (args.bbox[0] <= lat <= args.bbox[2] and args.bbox[1] <= lon <= args.bbox[3]):
+                continue
+            key = (mcc, mnc, int(cell["area"]), int(cell["cell"]))
+            if key[2] > 0xFFFFFFFF or key[3] > 0xFFFFFFFF:
+                continue
+            yield key, lat, lon, min(int(float(cell["range"] or 0)), 0xFFFF), int(cell["samples"] or 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("input", help="OpenCellID CSV export, may be gzipped")
+    parser.add_argument("output", help="table to write, cells.bin on the SD card")
+    parser.add_argument("--mcc", type=int, nargs="+", help="keep only these country codes")
+    parser.add_argument("--bbox", type=float, nargs=4, metavar=("S", "W", "N", "E"),
+                        help="keep only cells inside this box, in degrees")
+    args = parser.parse_args()
+
+    cells = {}
+    for key, lat, lon, radius, samples in read_cells(args.input, args):
+        if key not in cells or samples > cells[key][3]:
+            cells[key] = (lat, lon, radius, samples)
+    if not cells:
+        sys.exit("no cells matched")
+
+    with open(args.output, "wb") as f:
+        for key in sorted(cells):
+            lat, lon, radius, _ = cells[key]
+            f.write(RECORD.pack(key[0], key[1], key[2], key[3], round(lat * 1e6), round(lon * 1e6), radius, 0))
+    print("%d cells, %d bytes" % (len(cells), len(cells) * RECORD.size))
+
+
+if __name__ == "__main__":
+    main()
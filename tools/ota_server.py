@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""
+Local stand-in for the OTA image server, plus a helper to sign an image.
+
+  python3 tools/ota_server.py sign firmware.bin release_key.pem http://host:8080/firmware.bin
+  python3 tools/ota_server.py sign --cert clientcert client.pem release_key.pem https://host/client.pem
+  python3 tools/ota_server.py serve .pio/build/esp32dev --port 8080 --drop-every 3
+
+`sign` prints the MQTT payload to publish on AWS/CIER/SUB/<id>, an OTA command or,
+with --cert ROLE, a CERT command for a TLS credential (add "apply":true to the
+last one of a set). `serve` answers
+Range requests the way the firmware issues them through AT+QHTTPGET, and can cut
+every Nth response half way to simulate a link drop. To exercise the device's
+ranged, resumable download on Linux, run the firmware's own otaLoop() against it
+with the bench tool (see bench/ota.cpp):
+
+  bench/build/ota --key release_pub.pem "$(python3 tools/ota_server.py sign ...)"
+
+Signing uses the openssl command line: create a key with
+  openssl ecparam -name prime256v1 -genkey -noout -out release_key.pem
+  openssl ec -in release_key.pem -pubout -out release_pub.pem
+and build the firmware with the contents of release_pub.pem as OTA_PUBLIC_KEY.
+"""
+
+import argparse
+import hashlib
+import http.server
+import json
+import os
+import subprocess
+
+
+def sign(args):
+    with open(args.image, "rb") as f:
+        image = f.read()
+    signature = subprocess.run(
+        ["openssl", "dgst", "-sha256", "-sign", args.key],
+        input=image, capture_output=True, check=True).stdout
+    payload = {
+        "message": "CERT" if args.cert else "OTA",
+        "url": args.url,
+        "size": len(image),
+        "sha256": hashlib.sha256(image).hexdigest(),
+        "sig": signature.hex(),
+    }
+    if args.cert:
+        payload["role"] = args.cert
+    print(json.dumps(payload, separators=(",", ":")))
+
+
+class RangeHandler(http.server.SimpleHTTPRequestHandler):
+    drop_every = 0
+    served = 0
+
+    def do_GET(self):
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.send_error(404)
+            return
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        ranged = "Range" in self.headers
+        if ranged:
+            spec = self.headers["Range"].split("=", 1)[1]
+            first, last = spec.split("-", 1)
+            start = int(first)
+            end = min(int(last), size - 1) if last else size - 1
+            if start > end:
+                self.send_error(416)
+                return
+        length = end - start + 1
+
+        self.send_response(206 if ranged else 200)
+        self.send_header("Content-Type", "application/octet-stream")
+        self.send_header("Content-Length", str(length))
+        if ranged:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        self.end_headers()
+
+        RangeHandler.served += 1
+        drop = self.drop_every and RangeHandler.served % self.drop_every == 0
+        with open(path, "rb") as f:
+            f.seek(start)
+            body = f.read(length)
+        if drop:
+            self.wfile.write(body[: length // 2])
+            self.close_connection = True
+            self.log_message("dropped %s after %d bytes", self.headers.get("Range"), length // 2)
+            return
+        self.wfile.write(body)
+
+
+def serve(args):
+    os.chdir(args.directory)
+    RangeHandler.drop_every = args.drop_every
+    server = http.server.ThreadingHTTPServer(("", args.port), RangeHandler)
+    print("serving %s on port %d" % (args.directory, args.port))
+    server.serve_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    p = sub.add_parser("sign", help="print the MQTT OTA or CERT payload for a file")
+    p.add_argument("image")
+    p.add_argument("key", help="PEM private key")
+    p.add_argument("url", help="URL the device will download the image from")
+    p.add_argument("--cert", metavar="ROLE", help="sign a credential: cacert, clientcert or clientkey")
+    p.set_defaults(func=sign)
+
+    p = sub.add_parser("serve", help="serve a directory with Range support")
+    p.add_argument("directory")
+    p.add_argument("--port", type=int, default=8080)
+    p.add_argument("--drop-every", type=int, default=0, help="cut every Nth response half way")
+    p.set_defaults(func=serve)
+
+    args = parser.parse_args()
+    args.func(args)
+
+
+if __name__ == "__main__":
+    main()
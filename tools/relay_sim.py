@@ -0,0 +1,214 @@
+#!/usr/bin/env python3
+"""
+Simulates the ESP-NOW alert relay over a field of devices to size RELAY_TTL and the
+rebroadcast jitter before they are changed in main.cpp.
+
+  python3 tools/relay_sim.py
+  python3 tools/relay_sim.py --devices 500 2000 5000 --area 5 --lte 0.1
+  python3 tools/relay_sim.py --ttl 2 3 4 6 --runs 20
+
+Devices are placed uniformly in a square. A fraction of them (--lte) still has a
+cellular link and gets the alert from the broker; the rest only hear it from peers.
+Each device follows the firmware: a frame is queued by the radio (RELAY_QUEUE_DEPTH
+deep), drained on the next pass of loop(), deduplicated, and rebroadcast with one
+hop less after a random jitter. Transmitters defer while a neighbour is on the air;
+a frame is lost at a receiver when another neighbour of that receiver overlaps it
+(hidden terminals), or at random with --loss.
+
+The report gives, per configuration, the share of devices reached, latency from the
+broker publish for devices without LTE, the number of frames sent and their total
+airtime.
+"""
+
+import argparse
+import heapq
+import math
+import random
+
+# keep in step with the RELAY_* constants in main.cpp
+RELAY_TTL = 4
+RELAY_JITTER_MIN = 5
+RELAY_JITTER_MAX = 60
+RELAY_QUEUE_DEPTH = 8
+RELAY_OVERHEAD = 4 + 16  # header and tag
+# 802.11 vendor action frame around the ESP-NOW payload: MAC header, category,
+# OUI, random values, vendor element and FCS
+WIFI_OVERHEAD = 43
+
+
+def place(devices, side, radio_range, rng):
+    """Returns device positions and, for each device, the devices within range."""
+    points = [(rng.uniform(0, side), rng.uniform(0, side)) for _ in range(devices)]
+    grid = {}
+    for i, (x, y) in enumerate(points):
+        grid.setdefault((int(x // radio_range), int(y // radio_range)), []).append(i)
+    neighbours = []
+    for i, (x, y) in enumerate(points):
+        cx, cy = int(x // radio_range), int(y // radio_range)
+        near = []
+        for dx in (-1, 0, 1):
+            for dy in (-1, 0, 1):
+                for j in grid.get((cx + dx, cy + dy), ()):
+                    if j != i and math.hypot(points[j][0] - x, points[j][1] - y) <= radio_range:
+                        near.append(j)
+        neighbours.append(near)
+    return points, neighbours
+
+
+def airtime_ms(payload, rate_kbps, preamble_ms):
+    return preamble_ms + (payload + RELAY_OVERHEAD + WIFI_OVERHEAD) * 8.0 / rate_kbps
+
+
+def simulate(args, devices, ttl, rng):
+    """Floods one alert and returns the statistics of the run."""
+    side = args.area * 1000.0
+    _, neighbours = place(devices, side, args.range, rng)
+    frame_ms = airtime_ms(args.payload, args.rate, args.preamble)
+
+    events = []
+    order = 0
+
+    def push(time, kind, device, data=None):
+        nonlocal order
+        heapq.heappush(events, (time, order, kind, device, data))
+        order += 1
+
+    received = [None] * devices
+    via_relay = [False] * devices
+    queue = [[] for _ in range(devices)]
+    drain_pending = [False] * devices
+    on_air = [[] for _ in range(devices)]  # (start, end) of each transmission
+    stats = {"sent": 0, "collisions": 0, "lost": 0, "overflows": 0, "hops": []}
+
+    lte = [rng.random() < args.lte for _ in range(devices)]
+    if not any(lte):
+        lte[rng.randrange(devices)] = True
+    for i in range(devices):
+        if lte[i]:
+            push(rng.uniform(args.mqtt_min, args.mqtt_max), "broker", i)
+
+    def handle(time, device, frame_ttl, hops, relayed):
+        if received[device] is not None:
+            return
+        received[device] = time
+        via_relay[device] = relayed
+        if relayed:
+            stats["hops"].append(hops)
+        if not relayed:
+            push(time + rng.uniform(RELAY_JITTER_MIN, RELAY_JITTER_MAX), "send", device, (ttl, 0))
+        elif frame_ttl > 1:
+            push(time + rng.uniform(RELAY_JITTER_MIN, RELAY_JITTER_MAX), "send", device, (frame_ttl - 1, hops))
+
+    def busy_until(device, time):
+        end = 0.0
+        for n in neighbours[device]:
+            for start, stop in on_air[n]:
+                if start <= time < stop:
+                    end = max(end, stop)
+        return end
+
+    while events:
+        time, _, kind, device, data = heapq.heappop(events)
+        if kind == "broker":
+            handle(time, device, ttl, 0, False)
+        elif kind == "send":
+            busy = busy_until(device, time)
+            if busy > time:
+                push(busy + rng.uniform(0.0, args.backoff), "send", device, data)
+                continue
+            end = time + frame_ms
+            on_air[device].append((time, end))
+            stats["sent"] += 1
+            for n in neighbours[device]:
+                push(end, "receive", n, (device, time, end, data))
+        elif kind == "receive":
+            sender, start, end, frame = data
+            collided = any(
+                other != sender and s < end and start < e
+                for other in neighbours[device]
+                for s, e in on_air[other])
+            if collided or any(s < end and start < e for s, e in on_air[device]):
+                stats["collisions"] += 1
+                continue
+            if rng.random() < args.loss:
+                stats["lost"] += 1
+                continue
+            if len(queue[device]) >= RELAY_QUEUE_DEPTH:
+                stats["overflows"] += 1
+                continue
+            queue[device].append(frame)
+            if not drain_pending[device]:
+                drain_pending[device] = True
+                push(time + rng.expovariate(1.0 / args.loop), "drain", device)
+        elif kind == "drain":
+            drain_pending[device] = False
+            frames, queue[device] = queue[device], []
+            for frame_ttl, hops in frames:
+                handle(time, device, frame_ttl, hops + 1, True)
+
+    relay_only = [received[i] for i in range(devices) if not lte[i] and received[i] is not None]
+    stats["devices"] = devices
+    stats["lte"] = sum(lte)
+    stats["reached"] = sum(1 for t in received if t is not None)
+    stats["relay_only"] = devices - sum(lte)
+    stats["relay_reached"] = len(relay_only)
+    stats["latency"] = relay_only
+    stats["airtime"] = stats["sent"] * frame_ms
+    stats["degree"] = sum(len(n) for n in neighbours) / float(devices)
+    return stats
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--devices", type=int, nargs="+", default=[2000], help="field sizes to simulate")
+    parser.add_argument("--ttl", type=int, nargs="+", default=[RELAY_TTL], help="hop budgets to simulate")
+    parser.add_argument("--area", type=float, default=5.0, help="side of the square in km")
+    parser.add_argument("--range", type=float, default=400.0, help="radio range in m")
+    parser.add_argument("--lte", type=float, default=0.2, help="share of devices that still have LTE")
+    parser.add_argument("--payload", type=int, default=120, help="alert JSON size in bytes")
+    parser.add_argument("--rate", type=float, default=250.0, help="PHY rate in kbit/s (250 or 500 long range)")
+    parser.add_argument("--preamble", type=float, default=0.5, help="PHY preamble and header in ms")
+    parser.add_argument("--backoff", type=float, default=1.0, help="maximum random backoff after a busy channel, ms")
+    parser.add_argument("--loop", type=float, default=50.0, help="mean time until loop() drains the queue, ms")
+    parser.add_argument("--loss", type=float, default=0.05, help="random frame loss")
+    parser.add_argument("--mqtt-min", type=float, default=200.0, help="earliest broker delivery, ms")
+    parser.add_argument("--mqtt-max", type=float, default=2000.0, help="latest broker delivery, ms")
+    parser.add_argument("--runs", type=int, default=5, help="random fields per configuration")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+    if args.payload + RELAY_OVERHEAD > 250:
+        parser.error("--payload does not fit in one ESP-NOW frame")
+
+    rng = random.Random(args.seed)
+    print("airtime per frame %.2f ms" % airtime_ms(args.payload, args.rate, args.preamble))
+    print("%7s %3s %6s %8s %8s %8s %8s %8s %5s %7s %9s %6s %6s" % (
+        "devices", "ttl", "degree", "reached", "relayed", "p50 ms", "p90 ms", "max ms",
+        "hops", "frames", "airtime s", "coll", "ovf"))
+    for devices in args.devices:
+        for ttl in args.ttl:
+            runs = [simulate(args, devices, ttl, rng) for _ in range(args.runs)]
+            latency = [t for r in runs for t in r["latency"]]
+            hops = [h for r in runs for h in r["hops"]]
+            relay_only = sum(r["relay_only"] for r in runs)
+            print("%7d %3d %6.1f %7.1f%% %7.1f%% %8.0f %8.0f %8.0f %5.1f %7.0f %9.2f %6.0f %6.0f" % (
+                devices, ttl,
+                sum(r["degree"] for r in runs) / len(runs),
+                100.0 * sum(r["reached"] for r in runs) / sum(r["devices"] for r in runs),
+                100.0 * sum(r["relay_reached"] for r in runs) / relay_only if relay_only else 0.0,
+                percentile(latency, 50), percentile(latency, 90), max(latency) if latency else float("nan"),
+                sum(hops) / float(len(hops)) if hops else 0.0,
+                sum(r["sent"] for r in runs) / float(len(runs)),
+                sum(r["airtime"] for r in runs) / len(runs) / 1000.0,
+                sum(r["collisions"] for r in runs) / float(len(runs)),
+                sum(r["overflows"] for r in runs) / float(len(runs))))
+
+
+if __name__ == "__main__":
+    main()
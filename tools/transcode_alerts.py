@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""
+Converts the MP3 alert library into WAV clips the firmware plays without the MP3
+decoder: mono IMA-ADPCM (the default, about a quarter of the size of PCM) or raw
+16-bit PCM.
+
+  python3 tools/transcode_alerts.py sdcard/ sdcard/
+  python3 tools/transcode_alerts.py --format pcm --rate 22050 EARTHQUAKE.mp3 out/
+
+Every EARTHQUAKE.mp3 gets an EARTHQUAKE.wav; copy them to the root of the SD card
+next to the MP3s and playAlert() picks the WAV first. MP3 input is decoded with
+ffmpeg, which must be on the PATH; WAV input is read directly.
+"""
+
+import argparse
+import os
+import struct
+import subprocess
+import sys
+import wave
+
+# keep in step with PCM_MAX_BLOCK in main.cpp
+MAX_BLOCK = 1024
+
+IMA_STEPS = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767]
+IMA_INDEX_STEP = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def decode_input(path, rate):
+    """Returns the clip as mono 16-bit samples at `rate`."""
+    if path.lower().endswith(".wav"):
+        with wave.open(path) as w:
+            if w.getsampwidth() != 2 or w.getnchannels() != 1 or w.getframerate() != rate:
+                sys.exit("%s: WAV input must be 16-bit mono at %d Hz" % (path, rate))
+            raw = w.readframes(w.getnframes())
+    else:
+        raw = subprocess.run(
+            ["ffmpeg", "-v", "error", "-i", path, "-ac", "1", "-ar", str(rate), "-f", "s16le", "-"],
+            capture_output=True, check=True).stdout
+    return list(struct.unpack("<%dh" % (len(raw) // 2), raw[: len(raw) // 2 * 2]))
+
+
+def encode_ima_block(samples, index):
+    """Encodes one block: the header sample, then two samples per byte, low nibble first."""
+    out = bytearray(struct.pack("<hBB", samples[0], index, 0))
+    predictor = samples[0]
+    nibbles = []
+    for sample in samples[1:]:
+        step = IMA_STEPS[index]
+        diff = sample - predictor
+        nibble = 8 if diff < 0 else 0
+        diff = abs(diff)
+        delta = step >> 3
+        if diff >= step:
+            nibble |= 4
+            diff -= step
+            delta += step
+        if diff >= step >> 1:
+            nibble |= 2
+            diff -= step >> 1
+            delta += step >> 1
+        if diff >= step >> 2:
+            nibble |= 1
+            delta += step >> 2
+        predictor = max(-32768, min(32767, predictor - delta if nibble & 8 else predictor + delta))
+        index = max(0, min(88, index + IMA_INDEX_STEP[nibble]))
+        nibbles.append(nibble)
+    if len(nibbles) % 2:
+        nibbles.append(0)
+    for i in range(0, len(nibbles), 2):
+        out.append(nibbles[i] | nibbles[i + 1] << 4)
+    return bytes(out), index
+
+
+def write_adpcm(path, samples, rate, block):
+    per_block = (block - 4) * 2 + 1
+    data = bytearray()
+    index = 0
+    for start in range(0, len(samples), per_block):
+        chunk, index = encode_ima_block(samples[start:start + per_block], index)
+        data += chunk
+    fmt = struct.pack("<HHIIHHHH", 0x11, 1, rate, rate * block // per_block, block, 4, 2, per_block)
+    fact = struct.pack("<I", len(samples))
+    write_riff(path, [(b"fmt ", fmt), (b"fact", fact), (b"data", bytes(data))])
+
+
+def write_pcm(path, samples, rate):
+    fmt = struct.pack("<HHIIHH", 1, 1, rate, rate * 2, 2, 16)
+    write_riff(path, [(b"fmt ", fmt), (b"data", struct.pack("<%dh" % len(samples), *samples))])
+
+
+def write_riff(path, chunks):
+    body = b"WAVE"
+    for name, payload in chunks:
+        body += name + struct.pack("<I", len(payload)) + payload + (b"\0" if len(payload) % 2 else b"")
+    with open(path, "wb") as f:
+        f.write(b"RIFF" + struct.pack("<I", len(body)) + body)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("inputs", nargs="+", help="MP3 files or directories of them")
+    parser.add_argument("output", help="directory for the WAV clips")
+    parser.add_argument("--format", choices=["adpcm", "pcm"], default="adpcm")
+    parser.add_argument("--rate", type=int, default=16000, help="sample rate in Hz")
+    parser.add_argument("--block", type=int, default=512, help="ADPCM block size in bytes")
+    args = parser.parse_args()
+    if not 4 < args.block <= MAX_BLOCK:
+        sys.exit("--block must be between 5 and %d" % MAX_BLOCK)
+
+    sources = []
+    for item in args.inputs:
+        if os.path.isdir(item):
+            sources += [os.path.join(item, n) for n in sorted(os.listdir(item)) if n.lower().endswith(".mp3")]
+        else:
+            sources.append(item)
+    os.makedirs(args.output, exist_ok=True)
+
+    for source in sources:
+        samples = decode_input(source, args.rate)
+        if not samples:
+            sys.exit("%s: no audio" % source)
+        target = os.path.join(args.output, os.path.splitext(os.path.basename(source))[0] + ".wav")
+        if args.format == "adpcm":
+            write_adpcm(target, samples, args.rate, args.block)
+        else:
+            write_pcm(target, samples, args.rate)
+        print("%s -> %s (%d bytes, %.1f s)" % (source, target, os.path.getsize(target), len(samples) / args.rate))
+
+
+if __name__ == "__main__":
+    main()